@@ -0,0 +1,428 @@
+/*
+  +----------------------------------------------------------------------+
+  | GD-Pango                                                             |
+  +----------------------------------------------------------------------+
+  | This source file is subject to the New BSD license, That is bundled  |
+  | with this package in the file LICENSE.NEWBSD, and is available       |
+  | through the world-wide-web at                                        |
+  | http://www.opensource.org/licenses/bsd-license.php                   |
+  +----------------------------------------------------------------------+
+*/
+/* $Id$ */
+
+/*
+ * Benchmark of the phases of drawing text: shaping the layout and the
+ * whole gdPangoRenderTo, split into rasterizing and blitting by the
+ * counters of the context (gdPangoEnableStats), so that each quality
+ * tier is measured on its own paths. The results are written as JSON.
+ *
+ * usage: gd_pango_bench [--corpus DIR] [--warmup N] [--repeat N]
+ *                       [--quality draft|normal|high] [--filter TEXT]
+ *                       [--output FILE]
+ *
+ * Allocations are only counted with glibc, they are 0 elsewhere.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pango/pango.h>
+#include <pango/pangoft2.h>
+#include <gd.h>
+#include <gd_pango.h>
+
+#ifdef __GLIBC__
+/*
+ * Count the allocations of the process. The calls of Pango, GLib and
+ * fontconfig end up here too, glibc still does the work.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static volatile gint gdBenchAllocs = 0;
+
+void *malloc(size_t size)
+{
+	g_atomic_int_inc(&gdBenchAllocs);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+	g_atomic_int_inc(&gdBenchAllocs);
+	return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	g_atomic_int_inc(&gdBenchAllocs);
+	return __libc_realloc(ptr, size);
+}
+
+#define gdBenchAllocCount() g_atomic_int_get(&gdBenchAllocs)
+#else
+#define gdBenchAllocCount() 0
+#endif
+
+#define GD_BENCH_MARGIN 4
+#define GD_BENCH_WRAP_WIDTH 600
+
+static const char *gdBenchCorpora[] = {
+	"arabic", "hebrew", "japanese", "russian", "german", "english", NULL
+};
+
+static const char *gdBenchLabels[] = {
+	"OK", "Cancel", "Label 42", "Total: 1,234.56", "Zoom to fit selection", NULL
+};
+
+static const int gdBenchSizes[] = { 8, 12, 24, 48 };
+static const int gdBenchAngles[] = { 0, 30, 90 };
+static const char *gdBenchQualities[] = { "draft", "normal", "high" };
+
+typedef struct {
+	char name[64];
+	const char *kind;         /* corpus or labels */
+	char **texts;             /* NULL terminated, drawn one after the other */
+	int markup;
+	int size;                 /* points */
+	int angle;                /* degrees */
+	int palette;              /* palette surface instead of truecolor */
+	int quality;              /* GD_PANGO_QUALITY_* */
+
+	gdPangoContext *context;
+	PangoMatrix matrix;
+	gdImagePtr surface;
+} gdBenchCase;
+
+typedef long (*gdBenchPhase)(gdBenchCase *bench);
+
+typedef struct {
+	const char *name;
+	gdBenchPhase run;
+} gdBenchPhaseInfo;
+
+typedef struct {
+	int warmup;
+	int repeat;
+	const char *corpus;
+	const char *filter;
+	int quality;              /* -1 for all */
+	FILE *out;
+	int first;                /* no case written yet */
+} gdBenchOptions;
+
+static char *gdBenchReadFile(const char *filename)
+{
+	gchar *text;
+
+	if (!g_file_get_contents(filename, &text, NULL, NULL)) {
+		return NULL;
+	}
+	return text;
+}
+
+/* shape the text, the layout of the context is built again each time */
+static long gdBenchLayout(gdBenchCase *bench)
+{
+	long pixels = 0;
+	int i;
+
+	for (i = 0; bench->texts[i]; i++) {
+		if (bench->markup) {
+			gdPangoSetMarkup(bench->context, bench->texts[i], -1);
+		} else {
+			gdPangoSetText(bench->context, bench->texts[i], -1);
+		}
+		pixels += (long)gdPangoGetLayoutWidth(bench->context) *
+			gdPangoGetLayoutHeight(bench->context);
+	}
+	return pixels;
+}
+
+/* the whole drawing, with the caches and blit path of the context */
+static long gdBenchRender(gdBenchCase *bench)
+{
+	gdPangoRenderTo(bench->context, bench->surface, GD_BENCH_MARGIN, GD_BENCH_MARGIN);
+	return (long)gdPangoGetLayoutWidth(bench->context) *
+		gdPangoGetLayoutHeight(bench->context);
+}
+
+static const gdBenchPhaseInfo gdBenchPhases[] = {
+	{ "layout", gdBenchLayout },
+	{ "render", gdBenchRender },
+	{ NULL, NULL }
+};
+
+/*
+ * Split the render phase with the counters of the context: rasterizing,
+ * with the glyph cache and the simple text path, and blending on the
+ * surface, with the monochrome blit of draft. The allocations of the two
+ * are not told apart.
+ */
+static void gdBenchRunSplit(gdBenchCase *bench, gdBenchOptions *options)
+{
+	const char *names[2] = { "raster", "blit" };
+	gdPangoStats stats;
+	double seconds[2];
+	long pixels = 0;
+	int i;
+
+	gdPangoEnableStats(bench->context, 1);
+	gdPangoResetStats(bench->context);
+	for (i = 0; i < options->repeat; i++) {
+		pixels += gdBenchRender(bench);
+	}
+	gdPangoGetStats(bench->context, &stats);
+	gdPangoEnableStats(bench->context, 0);
+
+	seconds[0] = MAX(stats.raster_time / (double)G_USEC_PER_SEC, 1e-9);
+	seconds[1] = MAX(stats.blit_time / (double)G_USEC_PER_SEC, 1e-9);
+	for (i = 0; i < 2; i++) {
+		fprintf(options->out, ",\n       \"%s\": {\"seconds\": %.6f, \"strings_per_s\": %.1f, "
+			"\"pixels_per_s\": %.1f, \"allocs_per_string\": null}",
+			names[i], seconds[i], options->repeat / seconds[i],
+			(i == 0 ? pixels : (long)stats.pixels) / seconds[i]);
+	}
+}
+
+static void gdBenchSetup(gdBenchCase *bench)
+{
+	PangoFontDescription *font_desc;
+	gdPangoColors colors;
+	char *font_name;
+	int width = 0, height = 0, i;
+
+	bench->context = gdPangoCreateContext();
+	gdPangoSetQuality(bench->context, bench->quality);
+	font_name = g_strdup_printf("Vera %d", bench->size);
+	font_desc = pango_font_description_from_string(font_name);
+	gdPangoSetFontDescription(bench->context, font_desc);
+	pango_font_description_free(font_desc);
+	g_free(font_name);
+	if (bench->markup) {
+		gdPangoSetWidth(bench->context, GD_BENCH_WRAP_WIDTH);
+	}
+	colors.fg = gdTrueColorAlpha(0, 0, 0, 0);
+	colors.bg = gdTrueColorAlpha(255, 255, 255, 0);
+	colors.alpha = 0;
+	gdPangoSetDefaultColor(bench->context, &colors);
+
+	/* the same rotation as gdImageStringPangoFT */
+	bench->matrix = (PangoMatrix)PANGO_MATRIX_INIT;
+	bench->context->angle = bench->angle;
+	if (bench->angle != 0) {
+		pango_matrix_rotate(&bench->matrix, bench->angle);
+		pango_context_set_matrix(gdPangoGetPangoContext(bench->context), &bench->matrix);
+		pango_layout_context_changed(gdPangoGetPangoLayout(bench->context));
+		bench->context->matrix = &bench->matrix;
+	}
+
+	/* a surface large enough for the largest text */
+	for (i = 0; bench->texts[i]; i++) {
+		PangoRectangle rect;
+
+		if (bench->markup) {
+			gdPangoSetMarkup(bench->context, bench->texts[i], -1);
+		} else {
+			gdPangoSetText(bench->context, bench->texts[i], -1);
+		}
+		pango_layout_get_pixel_extents(gdPangoGetPangoLayout(bench->context), NULL, &rect);
+		pango_matrix_transform_pixel_rectangle(&bench->matrix, &rect);
+		width = MAX(width, rect.width);
+		height = MAX(height, rect.height);
+	}
+	width += 2 * GD_BENCH_MARGIN;
+	height += 2 * GD_BENCH_MARGIN;
+	bench->surface = bench->palette ? gdImageCreate(width, height) :
+		gdImageCreateTrueColor(width, height);
+	gdImageFilledRectangle(bench->surface, 0, 0, width - 1, height - 1,
+		gdImageColorResolve(bench->surface, 255, 255, 255));
+}
+
+static void gdBenchTeardown(gdBenchCase *bench)
+{
+	gdImageDestroy(bench->surface);
+	bench->context->matrix = NULL;
+	gdPangoFreeContext(bench->context);
+}
+
+static void gdBenchRunCase(gdBenchCase *bench, gdBenchOptions *options)
+{
+	int p, i;
+
+	if (options->filter && !strstr(bench->name, options->filter)) {
+		return;
+	}
+	gdBenchSetup(bench);
+
+	fprintf(options->out, "%s\n    {\"name\": \"%s\", \"kind\": \"%s\", \"size\": %d, \"angle\": %d, "
+		"\"surface\": \"%s\", \"quality\": \"%s\", \"strings\": %d,\n     \"phases\": {",
+		options->first ? "" : ",", bench->name, bench->kind, bench->size, bench->angle,
+		bench->palette ? "palette" : "truecolor", gdBenchQualities[bench->quality],
+		(int)g_strv_length(bench->texts));
+	options->first = 0;
+
+	/* the layout phase leaves the last text shaped for the others */
+	for (p = 0; gdBenchPhases[p].name; p++) {
+		long pixels = 0;
+		int allocs, n_strings;
+		gint64 start;
+		double seconds;
+
+		for (i = 0; i < options->warmup; i++) {
+			gdBenchPhases[p].run(bench);
+		}
+		allocs = gdBenchAllocCount();
+		start = g_get_monotonic_time();
+		for (i = 0; i < options->repeat; i++) {
+			pixels += gdBenchPhases[p].run(bench);
+		}
+		seconds = (g_get_monotonic_time() - start) / (double)G_USEC_PER_SEC;
+		allocs = gdBenchAllocCount() - allocs;
+		/* shaping goes through all the texts, the others draw the last one */
+		n_strings = options->repeat * (p == 0 ? (int)g_strv_length(bench->texts) : 1);
+		seconds = MAX(seconds, 1e-9);
+
+		fprintf(options->out, "%s\n       \"%s\": {\"seconds\": %.6f, \"strings_per_s\": %.1f, "
+			"\"pixels_per_s\": %.1f, \"allocs_per_string\": %.2f}",
+			p ? "," : "", gdBenchPhases[p].name, seconds, n_strings / seconds,
+			pixels / seconds, options->repeat ? allocs / (double)n_strings : 0.);
+	}
+	gdBenchRunSplit(bench, options);
+	fprintf(options->out, "}}");
+	gdBenchTeardown(bench);
+}
+
+static void gdBenchRunQualities(gdBenchCase *bench, gdBenchOptions *options,
+	const char *name)
+{
+	int quality;
+
+	for (quality = GD_PANGO_QUALITY_DRAFT; quality <= GD_PANGO_QUALITY_HIGH; quality++) {
+		if (options->quality >= 0 && options->quality != quality) {
+			continue;
+		}
+		bench->quality = quality;
+		g_snprintf(bench->name, sizeof(bench->name), "%s/%s", name,
+			gdBenchQualities[quality]);
+		gdBenchRunCase(bench, options);
+	}
+}
+
+static void gdBenchRunCorpora(gdBenchOptions *options)
+{
+	gdBenchCase bench;
+	char *texts[2];
+	int i;
+
+	for (i = 0; gdBenchCorpora[i]; i++) {
+		char *path = g_strdup_printf("%s/%s.txt", options->corpus, gdBenchCorpora[i]);
+
+		texts[0] = gdBenchReadFile(path);
+		texts[1] = NULL;
+		if (!texts[0]) {
+			fprintf(stderr, "Cannot read <%s>\n", path);
+			g_free(path);
+			continue;
+		}
+		memset(&bench, 0, sizeof(bench));
+		bench.kind = "corpus";
+		bench.texts = texts;
+		bench.markup = 1;
+		bench.size = 10;
+		gdBenchRunQualities(&bench, options, gdBenchCorpora[i]);
+		g_free(texts[0]);
+		g_free(path);
+	}
+}
+
+static void gdBenchRunLabels(gdBenchOptions *options)
+{
+	gdBenchCase bench;
+	int s, a, palette;
+
+	for (s = 0; s < (int)G_N_ELEMENTS(gdBenchSizes); s++) {
+		for (a = 0; a < (int)G_N_ELEMENTS(gdBenchAngles); a++) {
+			for (palette = 0; palette <= 1; palette++) {
+				char name[48];
+
+				memset(&bench, 0, sizeof(bench));
+				bench.kind = "labels";
+				bench.texts = (char **)gdBenchLabels;
+				bench.size = gdBenchSizes[s];
+				bench.angle = gdBenchAngles[a];
+				bench.palette = palette;
+				g_snprintf(name, sizeof(name), "labels/%dpt/%ddeg/%s",
+					bench.size, bench.angle, palette ? "palette" : "truecolor");
+				gdBenchRunQualities(&bench, options, name);
+			}
+		}
+	}
+}
+
+static void gdBenchUsage(void)
+{
+	fprintf(stderr, "usage: gd_pango_bench [--corpus DIR] [--warmup N] [--repeat N]\n"
+		"                      [--quality draft|normal|high] [--filter TEXT]\n"
+		"                      [--output FILE]\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	gdBenchOptions options;
+	int i;
+
+	options.warmup = 5;
+	options.repeat = 50;
+	options.corpus = ".";
+	options.filter = NULL;
+	options.quality = -1;
+	options.out = stdout;
+	options.first = 1;
+
+	for (i = 1; i < argc; i++) {
+		if (i + 1 >= argc) {
+			gdBenchUsage();
+		}
+		if (!strcmp(argv[i], "--corpus")) {
+			options.corpus = argv[++i];
+		} else if (!strcmp(argv[i], "--warmup")) {
+			options.warmup = MAX(atoi(argv[++i]), 0);
+		} else if (!strcmp(argv[i], "--repeat")) {
+			options.repeat = MAX(atoi(argv[++i]), 1);
+		} else if (!strcmp(argv[i], "--output")) {
+			options.out = fopen(argv[++i], "w");
+			if (!options.out) {
+				fprintf(stderr, "Cannot open <%s>\n", argv[i]);
+				exit(2);
+			}
+		} else if (!strcmp(argv[i], "--filter")) {
+			options.filter = argv[++i];
+		} else if (!strcmp(argv[i], "--quality")) {
+			i++;
+			for (options.quality = GD_PANGO_QUALITY_HIGH; options.quality >= 0; options.quality--) {
+				if (!strcmp(argv[i], gdBenchQualities[options.quality])) {
+					break;
+				}
+			}
+			if (options.quality < 0) {
+				gdBenchUsage();
+			}
+		} else {
+			gdBenchUsage();
+		}
+	}
+
+	gdPangoInit();
+	fprintf(options.out, "{\"pango\": \"%s\", \"warmup\": %d, \"repeat\": %d,\n \"cases\": [",
+		pango_version_string(), options.warmup, options.repeat);
+	gdBenchRunCorpora(&options);
+	gdBenchRunLabels(&options);
+	fprintf(options.out, "\n ]}\n");
+	if (options.out != stdout) {
+		fclose(options.out);
+	}
+	return 0;
+}
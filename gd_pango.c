@@ -93,9 +93,24 @@
  * \endcode
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* memfd_create */
+#endif
 #include <pango/pango.h>
 #include <pango/pangoft2.h>
+#include <pango/pangofc-font.h>
+#include <pango/pangofc-fontmap.h>
+#include <ft2build.h>
+#include FT_TRUETYPE_TABLES_H
+#include FT_TRUETYPE_TAGS_H
+#include <glib/gstdio.h>
 #include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
 #include <fontconfig/fontconfig.h>
 #include <fontconfig/fcfreetype.h>
 #include <gd.h>
@@ -104,6 +119,9 @@
 /*! non-zero if initialized */
 static int GD_PANGO_IS_INITIALIZED = 0;
 
+/* extra height below the line ink where underlines may be drawn */
+#define GD_PANGO_DECORATION_MARGIN 4
+
 static void gdPangoGetItemProperties (
     PangoItem *item,
     PangoUnderline *uline,
@@ -216,20 +234,22 @@ static FT_Bitmap * gdPangoCreateFTBitmap(int width, int height)
 	return bitmap;
 }
 
-static void gdPangoCleanFTBitmap(FT_Bitmap *bitmap)
+/* returns the number of bytes cleared */
+static int gdPangoCleanFTBitmap(FT_Bitmap *bitmap)
 {
 	unsigned char *p = (unsigned char *)bitmap->buffer;
 	int length = bitmap->pitch * bitmap->rows;
 	memset(p, 0, length);
+	return length;
 }
 
-static void gdPangoModifyFTBitmap(FT_Bitmap *bitmap, int width, int height)
+static int gdPangoModifyFTBitmap(FT_Bitmap *bitmap, int width, int height)
 {
 	if (bitmap->width != width || bitmap->rows != height) {
 		gdPangoSetFTBitmap(bitmap, width, height);
 		bitmap->buffer = (unsigned char *)g_realloc( bitmap->buffer, bitmap->pitch * bitmap->rows);
 	}
-	gdPangoCleanFTBitmap(bitmap);
+	return gdPangoCleanFTBitmap(bitmap);
 }
 
 static void gdPangoFreeFTBitmap(FT_Bitmap *bitmap)
@@ -241,659 +261,6579 @@ static void gdPangoFreeFTBitmap(FT_Bitmap *bitmap)
 	}
 }
 
-void gdPangoCopyFTBitmapToSurface(
-	const FT_Bitmap *bitmap,
-	gdImagePtr surface,
-	const gdPangoColors *colors,
-	gdRect *rect)
+/*
+ * Grow a rectangle (ie. a damaged area) to include the given area. An
+ * empty rectangle (zero width or height) is simply replaced.
+ */
+static void gdPangoRectUnion(gdRect *rect, int x, int y, int width, int height)
 {
-	int i;
-	unsigned char *p_ft;
-	int width = rect->width;
-	int height = rect->height;
-	int x = rect->x;
-	int y = rect->y;
-	int color_fg, alpha_blending_back;
+	int x1, y1;
 
-	if (width > bitmap->width) {
-		width = bitmap->width;
-	}
-	if (x + width > surface->sx) {
-		width = surface->sx - x;
+	if (!rect || width <= 0 || height <= 0) {
+		return;
 	}
-	if (width <= 0) {
+
+	if (rect->width <= 0 || rect->height <= 0) {
+		rect->x = x;
+		rect->y = y;
+		rect->width = width;
+		rect->height = height;
 		return;
 	}
-	if (height > bitmap->rows) {
-		height = bitmap->rows;
+
+	x1 = MAX(rect->x + rect->width, x + width);
+	y1 = MAX(rect->y + rect->height, y + height);
+	rect->x = MIN(rect->x, x);
+	rect->y = MIN(rect->y, y);
+	rect->width = x1 - rect->x;
+	rect->height = y1 - rect->y;
+}
+
+/*
+ * Get the drawable area of a surface: the gd clipping rectangle set with
+ * gdImageSetClip, limited to the surface bounds.
+ */
+static int gdPangoGetSurfaceClip(gdImagePtr surface, gdRect *clip)
+{
+	int x1, y1, x2, y2;
+
+	gdImageGetClip(surface, &x1, &y1, &x2, &y2);
+	x1 = MAX(x1, 0);
+	y1 = MAX(y1, 0);
+	x2 = MIN(x2, surface->sx - 1);
+	y2 = MIN(y2, surface->sy - 1);
+
+	clip->x = x1;
+	clip->y = y1;
+	clip->width = x2 - x1 + 1;
+	clip->height = y2 - y1 + 1;
+
+	return (clip->width > 0 && clip->height > 0);
+}
+
+/*
+ * Intersect two rectangles, result may be NULL to only test whether
+ * they overlap.
+ */
+static int gdPangoIntersectRect(const gdRect *r1, const gdRect *r2, gdRect *result)
+{
+	int x0 = MAX(r1->x, r2->x);
+	int y0 = MAX(r1->y, r2->y);
+	int x1 = MIN(r1->x + r1->width, r2->x + r2->width);
+	int y1 = MIN(r1->y + r1->height, r2->y + r2->height);
+
+	if (x1 <= x0 || y1 <= y0) {
+		return 0;
 	}
-	if (y + height > surface->sy) {
-		height = surface->sy - y;
+	if (result) {
+		result->x = x0;
+		result->y = y0;
+		result->width = x1 - x0;
+		result->height = y1 - y0;
 	}
-	if (height <= 0) {
-		return;
+	return 1;
+}
+
+/*
+ * Blend a color on a pixel inside the clip of the surface, as
+ * gdImageSetPixel does with alpha blending on. Truecolor pixels are
+ * blended in place.
+ */
+static void gdPangoBlendPixel(gdImagePtr surface, int x, int y, int color)
+{
+	if (surface->trueColor) {
+		surface->tpixels[y][x] = gdAlphaBlend(surface->tpixels[y][x], color);
+	} else {
+		gdImageSetPixel(surface, x, y, color);
+	}
+}
+
+/* returns the number of pixels blended */
+static int gdPangoBlitFTBitmap(
+	const FT_Bitmap *bitmap,
+	gdImagePtr surface,
+	const gdPangoColors *colors,
+	gdRect *rect,
+	gdRect *damage)
+{
+	int i, pixels = 0;
+	unsigned char *p_ft;
+	gdRect clip, area;
+	int skip_x, skip_y;
+	int color_fg, alpha_blending_back;
+	int min_x, max_x, min_y, max_y;
+
+	area.x = rect->x;
+	area.y = rect->y;
+	area.width = MIN(rect->width, (int)bitmap->width);
+	area.height = MIN(rect->height, (int)bitmap->rows);
+
+	if (!gdPangoGetSurfaceClip(surface, &clip) ||
+		!gdPangoIntersectRect(&area, &clip, &area)) {
+		return 0;
 	}
+	skip_x = area.x - rect->x;
+	skip_y = area.y - rect->y;
 
 	alpha_blending_back = surface->alphaBlendingFlag;
 	gdImageAlphaBlending(surface, 1);
-	p_ft = (unsigned char *)bitmap->buffer;
+	p_ft = (unsigned char *)bitmap->buffer + skip_y * bitmap->pitch + skip_x;
 	color_fg = colors->fg;
+	min_x = area.width;
+	max_x = -1;
+	min_y = area.height;
+	max_y = -1;
 
-	for (i = 0; i < height; i++) {
-		int k;
-		for (k = 0; k < width; k++) {
+	for (i = 0; i < area.height; i++) {
+		int k, first = -1, last = -1;
+		for (k = 0; k < area.width; k++) {
 			int level;
 			if (p_ft[k]==0) {
 				continue;
 			}
+			if (first < 0) {
+				first = k;
+			}
+			last = k;
 			level = gdAlphaMax - (p_ft[k] >> 1);
-			gdImageSetPixel(surface, x + k, y + i,  color_fg | (level<<24));
+			gdPangoBlendPixel(surface, area.x + k, area.y + i, color_fg | (level<<24));
+			pixels++;
+		}
+		if (first >= 0) {
+			min_x = MIN(min_x, first);
+			max_x = MAX(max_x, last);
+			if (min_y > i) {
+				min_y = i;
+			}
+			max_y = i;
 		}
 		p_ft += bitmap->pitch;
 	}
 	gdImageAlphaBlending(surface, alpha_blending_back);
+
+	if (max_y >= 0) {
+		gdPangoRectUnion(damage, area.x + min_x, area.y + min_y,
+			max_x - min_x + 1, max_y - min_y + 1);
+	}
+	return pixels;
 }
 
-static void gdPangoRenderGlyphString(
-	gdPangoContext *context,
+/*
+ * Draw a monochrome bitmap of the draft quality: covered pixels are
+ * fully covered and blended with the color as the antialiased blit
+ * does. Returns the number of pixels blended.
+ */
+static int gdPangoBlitMonoBitmap(
+	const FT_Bitmap *bitmap,
 	gdImagePtr surface,
-	gdPangoColors *colors,
-	PangoFont *font,
-	PangoGlyphString *glyphs,
+	const gdPangoColors *colors,
 	gdRect *rect,
-	int baseline)
+	gdRect *damage)
 {
-	pango_ft2_render(context->ft2bmp, font, glyphs, 0, baseline);
-	gdPangoCopyFTBitmapToSurface(context->ft2bmp, surface, colors, rect);
-	gdPangoCleanFTBitmap(context->ft2bmp);
-}
+	int i, pixels = 0;
+	unsigned char *p_ft;
+	gdRect clip, area;
+	int alpha_blending_back;
+	int min_x, max_x, min_y, max_y;
 
-static void gdPangoDrawSpan(
-	gdImagePtr surface,
-	gdPangoColors *colors,
-	int y,
-	int start,
-	int end)
-{
-	int color;
-	int ix;
+	area.x = rect->x;
+	area.y = rect->y;
+	area.width = MIN(rect->width, (int)bitmap->width);
+	area.height = MIN(rect->height, (int)bitmap->rows);
 
-	if (y < 0 || y >= surface->sy) {
-		return;
+	if (!gdPangoGetSurfaceClip(surface, &clip) ||
+		!gdPangoIntersectRect(&area, &clip, &area)) {
+		return 0;
 	}
+	p_ft = (unsigned char *)bitmap->buffer + (area.y - rect->y) * bitmap->pitch +
+		area.x - rect->x;
+	alpha_blending_back = surface->alphaBlendingFlag;
+	gdImageAlphaBlending(surface, 1);
+	min_x = area.width;
+	max_x = -1;
+	min_y = area.height;
+	max_y = -1;
 
-	if (end <= 0 || start >= surface->sx) {
-		return;
+	for (i = 0; i < area.height; i++) {
+		int k, first = -1, last = -1;
+		for (k = 0; k < area.width; k++) {
+			if (p_ft[k] < 0x80) {
+				continue;
+			}
+			if (first < 0) {
+				first = k;
+			}
+			last = k;
+			gdPangoBlendPixel(surface, area.x + k, area.y + i, colors->fg);
+			pixels++;
+		}
+		if (first >= 0) {
+			min_x = MIN(min_x, first);
+			max_x = MAX(max_x, last);
+			if (min_y > i) {
+				min_y = i;
+			}
+			max_y = i;
+		}
+		p_ft += bitmap->pitch;
 	}
+	gdImageAlphaBlending(surface, alpha_blending_back);
 
-	if (start < 0) {
-		start = 0;
+	if (max_y >= 0) {
+		gdPangoRectUnion(damage, area.x + min_x, area.y + min_y,
+			max_x - min_x + 1, max_y - min_y + 1);
 	}
+	return pixels;
+}
 
-	if (end > surface->sx) {
-		end = surface->sx;
-	}
-	color = colors->fg;
-	for (ix = start; ix < end; ix++) {
-		gdImageSetPixel(surface, ix, y, color);
+/* draw the text bitmap with the blit of the quality of the context */
+static int gdPangoBlitText(
+	gdPangoContext *context,
+	const FT_Bitmap *bitmap,
+	gdImagePtr surface,
+	const gdPangoColors *colors,
+	gdRect *rect,
+	gdRect *damage)
+{
+	if (context->quality == GD_PANGO_QUALITY_DRAFT) {
+		return gdPangoBlitMonoBitmap(bitmap, surface, colors, rect, damage);
 	}
+	return gdPangoBlitFTBitmap(bitmap, surface, colors, rect, damage);
 }
 
-static void gdPangoRenderLine(
-	gdPangoContext *context,
+void gdPangoCopyFTBitmapToSurface(
+	const FT_Bitmap *bitmap,
 	gdImagePtr surface,
-	PangoLayoutIter *iter,
-	gint x,
-	gint y)
+	const gdPangoColors *colors,
+	gdRect *rect)
 {
-	PangoLayoutLine *line;
-	PangoRectangle line_logical_rect;
-	gint baseline;
-	PangoLayoutRun *run;
-	line = pango_layout_iter_get_line_readonly(iter);
-	pango_layout_iter_get_line_extents(iter, NULL, &line_logical_rect);
-	x += PANGO_PIXELS(line_logical_rect.x);
-	y += PANGO_PIXELS(line_logical_rect.y);
-	baseline = pango_layout_iter_get_baseline(iter);
-	baseline = PANGO_PIXELS(baseline - line_logical_rect.y);
+	gdPangoBlitFTBitmap(bitmap, surface, colors, rect, NULL);
+}
 
-	while ( (run = pango_layout_iter_get_run_readonly(iter)) ) {
-		gdPangoColors colors = context->default_colors;
-		PangoUnderline uline = PANGO_UNDERLINE_NONE;
-		gboolean strike, fg_set, bg_set, shape_set;
-		gint rise, risen_y;
-		PangoColor fg_color, bg_color;
-		PangoRectangle logical_rect, ink_rect;
-		PangoRectangle run_logical_rect, run_ink_rect;
-		gdRect d_rect;
+/*
+ * A coverage mask drawn in one color, see gdPangoBlitLayers.
+ */
+typedef struct {
+	const unsigned char *mask;
+	int pitch;
+	int color;
+	int mono;  /* drawn as gdPangoBlitMonoBitmap does */
+} gdPangoLayer;
 
-		pango_layout_iter_get_run_extents(iter, &run_ink_rect, &run_logical_rect);
+/*
+ * Composite coverage masks of the same size, bottom layer first, on a
+ * surface in a single pass. rect is the area of the masks on the surface.
+ * Returns the number of pixels blended.
+ */
+static int gdPangoBlitLayers(
+	const gdPangoLayer *layers,
+	int n_layers,
+	gdImagePtr surface,
+	const gdRect *rect,
+	gdRect *damage)
+{
+	gdRect clip, area;
+	int i, j, k, skip_x, skip_y;
+	int alpha_blending_back, pixels = 0;
+	int min_x, max_x, min_y, max_y;
 
-		gdPangoGetItemProperties(run->item,
-			&uline, &strike, &rise,
-			&fg_color, &fg_set, &bg_color, &bg_set,
-			&shape_set, &ink_rect, &logical_rect);
+	if (!gdPangoGetSurfaceClip(surface, &clip) ||
+		!gdPangoIntersectRect(rect, &clip, &area)) {
+		return 0;
+	}
+	skip_x = area.x - rect->x;
+	skip_y = area.y - rect->y;
 
-		risen_y = y + baseline - PANGO_PIXELS(rise);
+	alpha_blending_back = surface->alphaBlendingFlag;
+	gdImageAlphaBlending(surface, 1);
+	min_x = area.width;
+	max_x = -1;
+	min_y = area.height;
+	max_y = -1;
 
-		if (fg_set) {
-			colors.fg = gdPangoColorToRGBA7888(fg_color);
+	for (i = 0; i < area.height; i++) {
+		int first = -1, last = -1;
 
-			if (gdTrueColorGetAlpha(colors.bg) == gdAlphaTransparent) {
-				colors.bg = gdPangoColorToRGBA7888(fg_color);
+		for (k = 0; k < area.width; k++) {
+			for (j = 0; j < n_layers; j++) {
+				int level = layers[j].mask[(skip_y + i) * layers[j].pitch + skip_x + k];
+
+				if (level == 0 || (layers[j].mono && level < 0x80)) {
+					continue;
+				}
+				if (first < 0) {
+					first = k;
+				}
+				last = k;
+				if (layers[j].mono) {
+					gdPangoBlendPixel(surface, area.x + k, area.y + i, layers[j].color);
+				} else {
+					gdPangoBlendPixel(surface, area.x + k, area.y + i,
+						layers[j].color | ((gdAlphaMax - (level >> 1)) << 24));
+				}
+				pixels++;
 			}
 		}
-
-		if (bg_set) {
-			colors.bg = gdPangoColorToRGBA7888(bg_color);
+		if (first >= 0) {
+			min_x = MIN(min_x, first);
+			max_x = MAX(max_x, last);
+			if (min_y > i) {
+				min_y = i;
+			}
+			max_y = i;
 		}
+	}
+	gdImageAlphaBlending(surface, alpha_blending_back);
 
-		if (!shape_set) {
-			if (uline == PANGO_UNDERLINE_NONE) {
-				pango_glyph_string_extents(run->glyphs, run->item->analysis.font,
-							 &ink_rect, &logical_rect);
-			} else {
-				pango_glyph_string_extents(run->glyphs, run->item->analysis.font,
-							 &ink_rect, &logical_rect);
-			}
+	if (max_y >= 0) {
+		gdPangoRectUnion(damage, area.x + min_x, area.y + min_y,
+			max_x - min_x + 1, max_y - min_y + 1);
+	}
+	return pixels;
+}
+
+/*
+ * Dilate a coverage mask with a square of 2 * radius + 1 pixels, as two
+ * separable max filters. The inner loops run along rows so that they
+ * can be vectorized. dst and tmp are width * height.
+ */
+static void gdPangoMaxFilter(
+	const unsigned char *src,
+	int src_pitch,
+	unsigned char *tmp,
+	unsigned char *dst,
+	int width,
+	int height,
+	int radius)
+{
+	int x, y, k;
 
-			d_rect.width = (int)PANGO_PIXELS(run_logical_rect.width);
-			d_rect.height = (int)PANGO_PIXELS(run_logical_rect.height);
-			d_rect.x = (int)(x + PANGO_PIXELS(run_logical_rect.x));
-			d_rect.y = (int)(risen_y - baseline);
+	for (y = 0; y < height; y++) {
+		const unsigned char *s_row = src + y * src_pitch;
+		unsigned char *t_row = tmp + y * width;
 
-			if (context->ft2bmp) {
-				gdPangoModifyFTBitmap(context->ft2bmp, d_rect.width, d_rect.height);
-			} else {
-				context->ft2bmp = gdPangoCreateFTBitmap(d_rect.width, d_rect.height);
+		memcpy(t_row, s_row, width);
+		for (k = 1; k <= radius && k < width; k++) {
+			for (x = 0; x < width - k; x++) {
+				t_row[x] = MAX(t_row[x], s_row[x + k]);
+			}
+			for (x = k; x < width; x++) {
+				t_row[x] = MAX(t_row[x], s_row[x - k]);
 			}
-
-			gdPangoRenderGlyphString(context, surface, &colors,
-				run->item->analysis.font, run->glyphs, &d_rect, baseline);
 		}
+	}
 
-		switch (uline) {
-			case PANGO_UNDERLINE_NONE:
-				break;
-
-			case PANGO_UNDERLINE_DOUBLE:
-				gdPangoDrawSpan(surface, &colors,
-				risen_y + 4,
-				x + PANGO_PIXELS(run_ink_rect.x),
-				x + PANGO_PIXELS(run_ink_rect.x + run_ink_rect.width));
-				/* Just do it twice */
-
-			case PANGO_UNDERLINE_SINGLE:
-				gdPangoDrawSpan(surface, &colors,
-				risen_y + 2,
-				x + PANGO_PIXELS(run_ink_rect.x),
-				x + PANGO_PIXELS(run_ink_rect.x + run_ink_rect.width));
-				break;
+	for (y = 0; y < height; y++) {
+		unsigned char *d_row = dst + y * width;
+		int y0 = MAX(y - radius, 0), y1 = MIN(y + radius, height - 1);
 
-			case PANGO_UNDERLINE_ERROR:
-			{
-				int point_x;
-				int counter = 0;
-				int end_x = x + PANGO_PIXELS(run_ink_rect.x + run_ink_rect.width);
+		memcpy(d_row, tmp + y0 * width, width);
+		for (k = y0 + 1; k <= y1; k++) {
+			const unsigned char *t_row = tmp + k * width;
 
-				for (point_x = x + PANGO_PIXELS(run_ink_rect.x) - 1;
-				 point_x <= end_x;
-				 point_x += 2) {
-					if (counter) {
-						gdPangoDrawSpan(surface, &colors, risen_y + 2, point_x,
-									MIN (point_x + 1, end_x));
-					} else {
-						gdPangoDrawSpan(surface, &colors, risen_y + 3, point_x,
-									MIN (point_x + 1, end_x));
-					}
-					counter = (counter + 1) % 2;
-				}
+			for (x = 0; x < width; x++) {
+				d_row[x] = MAX(d_row[x], t_row[x]);
 			}
-				break;
+		}
+	}
+}
 
-			case PANGO_UNDERLINE_LOW:
-				gdPangoDrawSpan(surface, &colors,
-				risen_y + PANGO_PIXELS(ink_rect.y + ink_rect.height),
-				x + PANGO_PIXELS(run_ink_rect.x),
-				x + PANGO_PIXELS(run_ink_rect.x + run_ink_rect.width));
-				break;
+/*
+ * Box blur of a line of n values spaced by stride, each output is the
+ * mean of the 2 * b + 1 inputs around it, computed with a running sum.
+ */
+static void gdPangoBoxBlurLine(
+	const unsigned char *src,
+	unsigned char *dst,
+	int n,
+	int stride,
+	int b)
+{
+	int i, sum = 0, size = 2 * b + 1;
 
-			default:
-				break;
+	for (i = 0; i < b && i < n; i++) {
+		sum += src[i * stride];
+	}
+	for (i = 0; i < n; i++) {
+		if (i + b < n) {
+			sum += src[(i + b) * stride];
 		}
-
-		if (strike) {
-			gdPangoDrawSpan(surface, &colors,
-			risen_y + PANGO_PIXELS(logical_rect.y + logical_rect.height / 2),
-			x + PANGO_PIXELS(run_logical_rect.x),
-			x + PANGO_PIXELS(run_logical_rect.x + run_logical_rect.width));
+		dst[i * stride] = sum / size;
+		if (i - b >= 0) {
+			sum -= src[(i - b) * stride];
 		}
-
-		pango_layout_iter_next_run(iter);
 	}
 }
 
+/*
+ * Approximate a gaussian blur of a width * height mask with three box
+ * blurs of half width b in each direction, constant time per pixel. The
+ * result is in buffer, tmp is of the same size.
+ */
+static void gdPangoBoxBlur(
+	unsigned char *buffer,
+	unsigned char *tmp,
+	int width,
+	int height,
+	int b)
+{
+	unsigned char *src = buffer, *dst = tmp, *swap;
+	int x, y, pass;
 
-/* Public API */
+	for (pass = 0; pass < 3; pass++) {
+		for (y = 0; y < height; y++) {
+			gdPangoBoxBlurLine(src + y * width, dst + y * width, width, 1, b);
+		}
+		swap = src; src = dst; dst = swap;
+	}
+	for (pass = 0; pass < 3; pass++) {
+		for (x = 0; x < width; x++) {
+			gdPangoBoxBlurLine(src + x, dst + x, height, width, b);
+		}
+		swap = src; src = dst; dst = swap;
+	}
+	/* six passes, the result is back in buffer */
+}
 
-/**
- * Initialize the GLib and Pango API.
- * This function must be called before using any other functions
- * in this library besides gdPangoIsInitialized.
- *
- * @return always GD_SUCCESS.
-*/
-int gdPangoInit(void) {
-	g_type_init();
-	GD_PANGO_IS_INITIALIZED = 1;
-	return GD_SUCCESS;
+/* test whether context has a shadow */
+static int gdPangoHasShadow(gdPangoContext *context)
+{
+	return (context->effects.shadow_dx || context->effects.shadow_dy ||
+		context->effects.shadow_radius);
 }
 
-/**
- * Return the intialization status.
- * Tells whether gdPango has been already initialized or not.
- *
- * @return positive if it was initialized, otherwise zero.
- */
-int gdPangoIsInitialized(void)
+/* add n to a counter of context, if its statistics are enabled */
+#define GD_PANGO_STAT(context, counter, n) \
+	do { \
+		if ((context)->stats) { \
+			(context)->stats->counter += (n); \
+		} \
+	} while (0)
+
+/* the monotonic clock, only read when the statistics are enabled */
+static gint64 gdPangoStatsClock(gdPangoContext *context)
 {
-	return GD_PANGO_IS_INITIALIZED;
+	return context->stats ? g_get_monotonic_time() : 0;
 }
 
-/**
- * Create a context which contains Pango objects.
- *
- * @return A pointer to the context as a gdPangoContext*.
- */
-gdPangoContext* gdPangoCreateContext(void)
+G_LOCK_DEFINE_STATIC(gdPangoGlobalStats);
+static gdPangoStats gdPangoGlobalStats;
+
+/* add the counts of context which are not in the global ones yet */
+static void gdPangoFlushStats(gdPangoContext *context)
 {
-	gdPangoContext *context = (gdPangoContext *)g_malloc(sizeof(gdPangoContext));
-	G_CONST_RETURN char *charset;
+	/* all the members are guint64 */
+	guint64 *counted = (guint64 *)&context->stats[0];
+	guint64 *flushed = (guint64 *)&context->stats[1];
+	guint64 *global = (guint64 *)&gdPangoGlobalStats;
+	int i;
 
-	context->font_map = pango_ft2_font_map_new();
-	pango_ft2_font_map_set_resolution (PANGO_FT2_FONT_MAP (context->font_map), GD_PANGO_DEFAULT_DPI, GD_PANGO_DEFAULT_DPI);
-	context->context = pango_ft2_font_map_create_context (PANGO_FT2_FONT_MAP (context->font_map));
+	G_LOCK(gdPangoGlobalStats);
+	for (i = 0; i < (int)(sizeof(gdPangoStats) / sizeof(guint64)); i++) {
+		global[i] += counted[i] - flushed[i];
+	}
+	G_UNLOCK(gdPangoGlobalStats);
+	context->stats[1] = context->stats[0];
+}
 
-	g_get_charset(&charset);
-	pango_context_set_language(context->context, pango_language_from_string(charset));
-	/*pango_context_set_base_dir(context->context, PANGO_DIRECTION_LTR);*/
-	/*pango_context_set_base_gravity(context->context, PANGO_GRAVITY_SOUTH);*/
+/* get a scratch buffer of the context of at least size bytes */
+static unsigned char *gdPangoScratch(gdPangoContext *context, int size)
+{
+	if (context->scratch_size < size) {
+		GD_PANGO_STAT(context, scratch_reallocs, 1);
+		context->scratch = (unsigned char *)g_realloc(context->scratch, size);
+		context->scratch_size = size;
+	}
+	return context->scratch;
+}
 
-	context->font_desc = pango_font_description_from_string(
-		GD_PANGO_MAKE_FONT_NAME(GD_PANGO_DEFAULT_FONT_FAMILY, GD_PANGO_DEFAULT_FONT_SIZE));
+/*
+ * Room needed around the ink by the effects of context, in pixels.
+ */
+static int gdPangoEffectsMargin(gdPangoContext *context)
+{
+	int margin = context->effects.halo_radius;
 
-	context->matrix = NULL;
-	context->layout = pango_layout_new(context->context);
+	if (gdPangoHasShadow(context)) {
+		margin = MAX(margin, context->effects.shadow_radius +
+			MAX(ABS(context->effects.shadow_dx), ABS(context->effects.shadow_dy)));
+	}
+	return margin;
+}
 
-	/*
+/*
+ * A surface receiving a rendered layout. The same layout can be drawn on
+ * several targets at once (ie. map tiles), each run is then rasterized
+ * only once and blitted to every target it intersects.
+ */
+typedef struct {
+	gdImagePtr surface;
+	int x;          /* layout origin on the surface */
+	int y;
+	gdRect clip;    /* drawable area, surface coordinates */
+	gdRect *damage; /* written area, may be NULL */
+} gdPangoTarget;
+
+/*
+ * Test whether a rectangle, in layout coordinates, is visible on at
+ * least one target.
+ */
+static int gdPangoTargetsIntersect(
+	const gdPangoTarget *targets,
+	int n_targets,
+	const gdRect *rect)
+{
+	int i;
+
+	for (i = 0; i < n_targets; i++) {
+		gdRect area = *rect;
+
+		if (targets[i].clip.width <= 0) {
+			continue;
+		}
+		area.x += targets[i].x;
+		area.y += targets[i].y;
+		if (gdPangoIntersectRect(&area, &targets[i].clip, NULL)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Glyph cache file.
+ *
+ * Glyph masks rendered ahead of time by gdPangoWriteGlyphCache and
+ * mapped read-only, so that processes share them. All values are little
+ * endian. The header is the magic "GDPC", the version and the number of
+ * fonts (16 bits each), then the file length (32 bits). Each font has a
+ * GD_PANGO_GLYPH_CACHE_FONT_SIZE record: its key (gdPangoFontKey, five
+ * 32 bits values), the number of glyphs, then the offset and length of
+ * its data (32 bits each). The data of a font holds its glyphs, sorted
+ * by id, as GD_PANGO_GLYPH_CACHE_ENTRY_SIZE records: glyph id (32 bits),
+ * bearing x and y (signed 16 bits), width and height (16 bits) and the
+ * offset of the mask in the data of the font (32 bits), then the masks,
+ * width * height bytes each.
+ */
+#define GD_PANGO_GLYPH_CACHE_VERSION 1
+#define GD_PANGO_GLYPH_CACHE_HEADER_SIZE 12
+#define GD_PANGO_GLYPH_CACHE_FONT_SIZE 32
+#define GD_PANGO_GLYPH_CACHE_ENTRY_SIZE 16
+
+struct gdPangoGlyphCache {
+	GMappedFile *file;
+	const unsigned char *data;
+	int length;
+	int n_fonts;
+};
+
+/* what the masks of a font depend on */
+typedef struct {
+	guint32 hash[2];  /* of the font file */
+	guint32 index;    /* face in the file */
+	guint32 size;     /* pixel size, 26.6 fixed point: the point size at the dpi */
+	guint32 flags;    /* antialiasing and hinting */
+} gdPangoFontKey;
+
+static int gdPangoGet16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static guint32 gdPangoGet32(const unsigned char *p)
+{
+	return (guint32)gdPangoGet16(p) | ((guint32)gdPangoGet16(p + 2) << 16);
+}
+
+/*
+ * A font file as it is on disk: paths are reused, by the memory files of
+ * registries (/proc/self/fd/N) or by a file replaced in place.
+ */
+typedef struct {
+	guint64 dev;
+	guint64 ino;
+	guint64 size;
+	gint64 mtime;
+	guint64 hash;  /* FNV-1a of the contents */
+} gdPangoFileId;
+
+static guint gdPangoFileIdHash(gconstpointer data)
+{
+	const gdPangoFileId *id = (const gdPangoFileId *)data;
+
+	return g_int64_hash(&id->ino) ^ g_int64_hash(&id->size);
+}
+
+static gboolean gdPangoFileIdEqual(gconstpointer a, gconstpointer b)
+{
+	const gdPangoFileId *id1 = (const gdPangoFileId *)a;
+	const gdPangoFileId *id2 = (const gdPangoFileId *)b;
+
+	return id1->dev == id2->dev && id1->ino == id2->ino &&
+		id1->size == id2->size && id1->mtime == id2->mtime;
+}
+
+G_LOCK_DEFINE_STATIC(gdPangoFileHashes);
+static GHashTable *gdPangoFileHashes = NULL;  /* set of gdPangoFileId */
+
+/* hash a font file once per process and version of the file, FNV-1a */
+static int gdPangoFileHash(const char *path, guint64 *hash)
+{
+	GMappedFile *file;
+	const unsigned char *p;
+	gdPangoFileId id, *cached;
+	struct stat st;
+	gsize i, length;
+	int fd;
+
+	fd = g_open(path, O_RDONLY, 0);
+	if (fd < 0) {
+		return 0;
+	}
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return 0;
+	}
+	id.dev = st.st_dev;
+	id.ino = st.st_ino;
+	id.size = st.st_size;
+	id.mtime = st.st_mtime;
+
+	G_LOCK(gdPangoFileHashes);
+	if (!gdPangoFileHashes) {
+		gdPangoFileHashes = g_hash_table_new_full(gdPangoFileIdHash, gdPangoFileIdEqual,
+			g_free, NULL);
+	}
+	cached = (gdPangoFileId *)g_hash_table_lookup(gdPangoFileHashes, &id);
+	if (cached) {
+		*hash = cached->hash;
+	}
+	G_UNLOCK(gdPangoFileHashes);
+	if (cached) {
+		close(fd);
+		return 1;
+	}
+
+	/* the file just identified, even if the path changes meanwhile */
+	file = g_mapped_file_new_from_fd(fd, FALSE, NULL);
+	close(fd);
+	if (!file) {
+		return 0;
+	}
+	p = (const unsigned char *)g_mapped_file_get_contents(file);
+	length = g_mapped_file_get_length(file);
+	*hash = 14695981039346656037ULL;
+	for (i = 0; i < length; i++) {
+		*hash = (*hash ^ p[i]) * 1099511628211ULL;
+	}
+	g_mapped_file_unref(file);
+
+	G_LOCK(gdPangoFileHashes);
+	if (!g_hash_table_lookup(gdPangoFileHashes, &id)) {
+		cached = g_new(gdPangoFileId, 1);
+		*cached = id;
+		cached->hash = *hash;
+		g_hash_table_add(gdPangoFileHashes, cached);
+	}
+	G_UNLOCK(gdPangoFileHashes);
+	return 1;
+}
+
+static int gdPangoGetFontKey(PangoFont *font, gdPangoFontKey *key)
+{
+	FcPattern *pattern;
+	FcChar8 *file;
+	FcBool antialias = FcTrue, hinting = FcTrue, autohint = FcFalse;
+	int index = 0, hint_style = FC_HINT_FULL;
+	double pixel_size;
+	guint64 hash;
+
+	if (!PANGO_IS_FC_FONT(font)) {
+		return 0;
+	}
+	pattern = pango_fc_font_get_pattern(PANGO_FC_FONT(font));
+	if (!pattern ||
+		FcPatternGetString(pattern, FC_FILE, 0, &file) != FcResultMatch ||
+		FcPatternGetDouble(pattern, FC_PIXEL_SIZE, 0, &pixel_size) != FcResultMatch ||
+		!gdPangoFileHash((const char *)file, &hash)) {
+		return 0;
+	}
+	FcPatternGetInteger(pattern, FC_INDEX, 0, &index);
+	FcPatternGetBool(pattern, FC_ANTIALIAS, 0, &antialias);
+	FcPatternGetBool(pattern, FC_HINTING, 0, &hinting);
+	FcPatternGetBool(pattern, FC_AUTOHINT, 0, &autohint);
+	FcPatternGetInteger(pattern, FC_HINT_STYLE, 0, &hint_style);
+
+	key->hash[0] = (guint32)(hash & 0xFFFFFFFF);
+	key->hash[1] = (guint32)(hash >> 32);
+	key->index = index;
+	key->size = (guint32)(pixel_size * 64 + 0.5);
+	key->flags = (antialias ? 1 : 0) | (hinting ? 2 : 0) | (autohint ? 4 : 0) |
+		(hint_style << 4);
+	return 1;
+}
+
+/*
+ * Check the tables of a cache file, so that reading it can never go out
+ * of the file. Returns the number of fonts, or -1.
+ */
+static int gdPangoCheckGlyphCache(const unsigned char *data, gsize length)
+{
+	int i, n_fonts;
+
+	if (length < GD_PANGO_GLYPH_CACHE_HEADER_SIZE || length > G_MAXINT ||
+		memcmp(data, "GDPC", 4) != 0 ||
+		gdPangoGet16(data + 4) != GD_PANGO_GLYPH_CACHE_VERSION ||
+		gdPangoGet32(data + 8) != length) {
+		return -1;
+	}
+	n_fonts = gdPangoGet16(data + 6);
+	if (GD_PANGO_GLYPH_CACHE_HEADER_SIZE + n_fonts * GD_PANGO_GLYPH_CACHE_FONT_SIZE > length) {
+		return -1;
+	}
+	for (i = 0; i < n_fonts; i++) {
+		const unsigned char *font = data + GD_PANGO_GLYPH_CACHE_HEADER_SIZE +
+			i * GD_PANGO_GLYPH_CACHE_FONT_SIZE;
+		guint32 n_glyphs = gdPangoGet32(font + 20);
+		guint32 offset = gdPangoGet32(font + 24);
+		guint32 size = gdPangoGet32(font + 28);
+		guint32 j;
+
+		if (offset > length || size > length - offset ||
+			n_glyphs > size / GD_PANGO_GLYPH_CACHE_ENTRY_SIZE) {
+			return -1;
+		}
+		for (j = 0; j < n_glyphs; j++) {
+			const unsigned char *entry = data + offset + j * GD_PANGO_GLYPH_CACHE_ENTRY_SIZE;
+			guint32 mask_size = gdPangoGet16(entry + 8) * gdPangoGet16(entry + 10);
+			guint32 mask = gdPangoGet32(entry + 12);
+
+			if (mask > size || mask_size > size - mask) {
+				return -1;
+			}
+		}
+	}
+	return n_fonts;
+}
+
+static int gdPangoFontKeyEqual(const unsigned char *font, const gdPangoFontKey *key)
+{
+	return gdPangoGet32(font) == key->hash[0] &&
+		gdPangoGet32(font + 4) == key->hash[1] &&
+		gdPangoGet32(font + 8) == key->index &&
+		gdPangoGet32(font + 12) == key->size &&
+		gdPangoGet32(font + 16) == key->flags;
+}
+
+static const unsigned char *gdPangoGlyphCacheFont(const gdPangoGlyphCache *cache,
+	const gdPangoFontKey *key)
+{
+	int i;
+
+	for (i = 0; i < cache->n_fonts; i++) {
+		const unsigned char *font = cache->data + GD_PANGO_GLYPH_CACHE_HEADER_SIZE +
+			i * GD_PANGO_GLYPH_CACHE_FONT_SIZE;
+
+		if (gdPangoFontKeyEqual(font, key)) {
+			return font;
+		}
+	}
+	return NULL;
+}
+
+static const unsigned char *gdPangoGlyphCacheFind(const gdPangoGlyphCache *cache,
+	const unsigned char *font, unsigned int glyph)
+{
+	const unsigned char *entries = cache->data + gdPangoGet32(font + 24);
+	int low = 0, high = (int)gdPangoGet32(font + 20) - 1;
+
+	while (low <= high) {
+		int middle = (low + high) / 2;
+		guint32 id = gdPangoGet32(entries + middle * GD_PANGO_GLYPH_CACHE_ENTRY_SIZE);
+
+		if (id == glyph) {
+			return entries + middle * GD_PANGO_GLYPH_CACHE_ENTRY_SIZE;
+		} else if (id < glyph) {
+			low = middle + 1;
+		} else {
+			high = middle - 1;
+		}
+	}
+	return NULL;
+}
+
+/* get the cached glyphs of a font, looked up once per font */
+static const unsigned char *gdPangoContextCacheFont(gdPangoContext *context,
+	PangoFont *font)
+{
+	const unsigned char *cache_font = NULL;
+	gdPangoFontKey key;
+	gpointer value;
+
+	if (g_hash_table_lookup_extended(context->cache_fonts, font, NULL, &value)) {
+		return (const unsigned char *)value;
+	}
+	if (gdPangoGetFontKey(font, &key)) {
+		cache_font = gdPangoGlyphCacheFont(context->glyph_cache, &key);
+	}
+	g_hash_table_insert(context->cache_fonts, g_object_ref(font), (gpointer)cache_font);
+	return cache_font;
+}
+
+/*
+ * Draw glyphs from the glyph cache of the context in ft2bmp, the same
+ * way as pango_ft2_render. Returns 0, drawing nothing, unless all of
+ * them are in the cache.
+ */
+static int gdPangoRenderCachedGlyphs(
+	gdPangoContext *context,
+	PangoFont *font,
+	PangoGlyphString *glyphs,
+	int x,
+	int y)
+{
+	const gdPangoGlyphCache *cache = context->glyph_cache;
+	FT_Bitmap *bitmap = context->ft2bmp;
+	const unsigned char *cache_font;
+	int i, x_position = 0;
+
+	/* the file holds unrotated glyphs only */
+	if (pango_context_get_matrix(context->context)) {
+		return 0;
+	}
+	cache_font = gdPangoContextCacheFont(context, font);
+	if (!cache_font) {
+		return 0;
+	}
+	for (i = 0; i < glyphs->num_glyphs; i++) {
+		PangoGlyph glyph = glyphs->glyphs[i].glyph;
+
+		if (glyph != PANGO_GLYPH_EMPTY &&
+			!gdPangoGlyphCacheFind(cache, cache_font, glyph)) {
+			return 0;
+		}
+	}
+
+	for (i = 0; i < glyphs->num_glyphs; i++) {
+		PangoGlyphInfo *info = &glyphs->glyphs[i];
+		const unsigned char *entry, *mask;
+		int gx, gy, width, height, row, col, x0, x1, y0, y1;
+
+		if (info->glyph == PANGO_GLYPH_EMPTY) {
+			x_position += info->geometry.width;
+			continue;
+		}
+		entry = gdPangoGlyphCacheFind(cache, cache_font, info->glyph);
+		mask = cache->data + gdPangoGet32(cache_font + 24) + gdPangoGet32(entry + 12);
+		gx = PANGO_PIXELS(x * PANGO_SCALE + x_position + info->geometry.x_offset) +
+			(gint16)gdPangoGet16(entry + 4);
+		gy = PANGO_PIXELS(y * PANGO_SCALE + info->geometry.y_offset) +
+			(gint16)gdPangoGet16(entry + 6);
+		width = gdPangoGet16(entry + 8);
+		height = gdPangoGet16(entry + 10);
+		x0 = MAX(0, -gx);
+		x1 = MIN(width, (int)bitmap->width - gx);
+		y0 = MAX(0, -gy);
+		y1 = MIN(height, (int)bitmap->rows - gy);
+		for (row = y0; row < y1; row++) {
+			const unsigned char *src = mask + row * width;
+			unsigned char *dst = bitmap->buffer + (gy + row) * bitmap->pitch + gx;
+
+			for (col = x0; col < x1; col++) {
+				int level = dst[col] + src[col];
+				dst[col] = level > 0xFF ? 0xFF : level;
+			}
+		}
+		x_position += info->geometry.width;
+	}
+	return 1;
+}
+
+static void gdPangoRenderGlyphString(
+	gdPangoContext *context,
+	gdPangoTarget *targets,
+	int n_targets,
+	gdPangoColors *colors,
+	PangoFont *font,
+	PangoGlyphString *glyphs,
+	gdRect *rect,
+	int origin_x,
+	int baseline)
+{
+	gdPangoLayer layers[3];
+	int i, n_layers = 0, pixels = 0, cleared;
+	int width = context->ft2bmp->width, height = context->ft2bmp->rows;
+	unsigned char *buffer = NULL;
+	gint64 start = gdPangoStatsClock(context), now;
+
+	if (context->glyph_cache &&
+		gdPangoRenderCachedGlyphs(context, font, glyphs, origin_x, baseline)) {
+		GD_PANGO_STAT(context, cache_hits, glyphs->num_glyphs);
+	} else {
+		pango_ft2_render(context->ft2bmp, font, glyphs, origin_x, baseline);
+		GD_PANGO_STAT(context, glyphs, glyphs->num_glyphs);
+		if (context->glyph_cache) {
+			GD_PANGO_STAT(context, cache_misses, glyphs->num_glyphs);
+		}
+	}
+
+	if ((context->draw & GD_PANGO_DRAW_EFFECTS) && gdPangoEffectsMargin(context) > 0) {
+		buffer = gdPangoScratch(context, 4 * width * height);
+	}
+
+	if (buffer && gdPangoHasShadow(context)) {
+		unsigned char *shadow = buffer + 2 * width * height;
+		int dx = context->effects.shadow_dx, dy = context->effects.shadow_dy;
+		int y, x0 = MAX(dx, 0), x1 = MIN(width + dx, width);
+
+		/* the coverage moved by the offset, the margin keeps it inside */
+		memset(shadow, 0, width * height);
+		for (y = MAX(dy, 0); y < MIN(height + dy, height) && x0 < x1; y++) {
+			memcpy(shadow + y * width + x0,
+				context->ft2bmp->buffer + (y - dy) * context->ft2bmp->pitch + x0 - dx,
+				x1 - x0);
+		}
+		if (context->effects.shadow_radius > 0) {
+			gdPangoBoxBlur(shadow, shadow + width * height, width, height,
+				MAX(context->effects.shadow_radius / 3, 1));
+		}
+		layers[n_layers].mask = shadow;
+		layers[n_layers].pitch = width;
+		layers[n_layers].color = context->effects.shadow_color;
+		layers[n_layers].mono = 0;
+		n_layers++;
+	}
+	if (buffer && context->effects.halo_radius > 0) {
+		gdPangoMaxFilter(context->ft2bmp->buffer, context->ft2bmp->pitch,
+			buffer, buffer + width * height, width, height,
+			context->effects.halo_radius);
+		layers[n_layers].mask = buffer + width * height;
+		layers[n_layers].pitch = width;
+		layers[n_layers].color = context->effects.halo_color;
+		layers[n_layers].mono = 0;
+		n_layers++;
+	}
+	if (context->draw & GD_PANGO_DRAW_TEXT) {
+		layers[n_layers].mask = context->ft2bmp->buffer;
+		layers[n_layers].pitch = context->ft2bmp->pitch;
+		layers[n_layers].color = colors->fg;
+		/* draft text is monochrome over effects too */
+		layers[n_layers].mono = context->quality == GD_PANGO_QUALITY_DRAFT;
+		n_layers++;
+	}
+	now = gdPangoStatsClock(context);
+	GD_PANGO_STAT(context, raster_time, now - start);
+
+	for (i = 0; i < n_targets; i++) {
+		gdRect d_rect = *rect;
+
+		if (targets[i].clip.width <= 0) {
+			continue;
+		}
+		d_rect.x += targets[i].x;
+		d_rect.y += targets[i].y;
+		if (n_layers == 1 && layers[0].mask == context->ft2bmp->buffer) {
+			pixels += gdPangoBlitText(context, context->ft2bmp, targets[i].surface, colors,
+				&d_rect, targets[i].damage);
+		} else {
+			pixels += gdPangoBlitLayers(layers, n_layers, targets[i].surface,
+				&d_rect, targets[i].damage);
+		}
+	}
+	GD_PANGO_STAT(context, blit_time, gdPangoStatsClock(context) - now);
+	GD_PANGO_STAT(context, pixels, pixels);
+	cleared = gdPangoCleanFTBitmap(context->ft2bmp);
+	GD_PANGO_STAT(context, memset_bytes, cleared);
+}
+
+static void gdPangoDrawSpan(
+	gdImagePtr surface,
+	gdPangoColors *colors,
+	int y,
+	int start,
+	int end,
+	gdRect *damage)
+{
+	int color;
+	int ix;
+	gdRect clip;
+
+	if (!gdPangoGetSurfaceClip(surface, &clip)) {
+		return;
+	}
+
+	if (y < clip.y || y >= clip.y + clip.height) {
+		return;
+	}
+
+	if (end <= clip.x || start >= clip.x + clip.width) {
+		return;
+	}
+
+	if (start < clip.x) {
+		start = clip.x;
+	}
+
+	if (end > clip.x + clip.width) {
+		end = clip.x + clip.width;
+	}
+	color = colors->fg;
+	for (ix = start; ix < end; ix++) {
+		gdImageSetPixel(surface, ix, y, color);
+	}
+	gdPangoRectUnion(damage, start, y, end - start, 1);
+}
+
+/*
+ * Draw a decoration span, given in layout coordinates, on all targets.
+ */
+static void gdPangoDrawSpanTargets(
+	gdPangoTarget *targets,
+	int n_targets,
+	gdPangoColors *colors,
+	int y,
+	int start,
+	int end)
+{
+	int i;
+
+	for (i = 0; i < n_targets; i++) {
+		if (targets[i].clip.width <= 0) {
+			continue;
+		}
+		gdPangoDrawSpan(targets[i].surface, colors, y + targets[i].y,
+			start + targets[i].x, end + targets[i].x, targets[i].damage);
+	}
+}
+
+/*
+ * Compute the pixel box covering both the ink and the logical extents of
+ * a glyph string or a line, in the coordinates of the given extents.
+ * Glyphs overhanging their logical box (italics, accents) are covered.
+ */
+static int gdPangoExtentsBox(
+	const PangoRectangle *ink_rect,
+	const PangoRectangle *logical_rect,
+	gdRect *box)
+{
+	int x0, y0, x1, y1;
+
+	x0 = logical_rect->x;
+	y0 = logical_rect->y;
+	x1 = logical_rect->x + logical_rect->width;
+	y1 = logical_rect->y + logical_rect->height;
+
+	if (ink_rect->width > 0 && ink_rect->height > 0) {
+		x0 = MIN(x0, ink_rect->x);
+		y0 = MIN(y0, ink_rect->y);
+		x1 = MAX(x1, ink_rect->x + ink_rect->width);
+		y1 = MAX(y1, ink_rect->y + ink_rect->height);
+	}
+
+	box->x = PANGO_PIXELS_FLOOR(x0);
+	box->y = PANGO_PIXELS_FLOOR(y0);
+	box->width = PANGO_PIXELS_CEIL(x1) - box->x;
+	box->height = PANGO_PIXELS_CEIL(y1) - box->y;
+
+	return (box->width > 0 && box->height > 0);
+}
+
+/*
+ * Rasterize the visible part of a glyph string, if any, and blit it on
+ * the targets. ink_rect and logical_rect are the extents of the glyphs,
+ * the origin is in layout coordinates.
+ */
+static void gdPangoRenderRun(
+	gdPangoContext *context,
+	gdPangoTarget *targets,
+	int n_targets,
+	const gdRect *bounds,
+	gdPangoColors *colors,
+	PangoFont *font,
+	PangoGlyphString *glyphs,
+	const PangoRectangle *ink_rect,
+	const PangoRectangle *logical_rect,
+	int origin_x,
+	int baseline)
+{
+	gdRect d_rect, r_rect;
+	int margin = 0;
+
+	if (!gdPangoExtentsBox(ink_rect, logical_rect, &d_rect)) {
+		return;
+	}
+	d_rect.x += origin_x;
+	d_rect.y += baseline;
+
+	if (context->draw & GD_PANGO_DRAW_EFFECTS) {
+		margin = gdPangoEffectsMargin(context);
+	}
+	if (margin > 0) {
+		/* effects spread around the ink and need the coverage around the
+		   visible part */
+		gdRect area = *bounds;
+
+		d_rect.x -= margin;
+		d_rect.y -= margin;
+		d_rect.width += 2 * margin;
+		d_rect.height += 2 * margin;
+		area.x -= margin;
+		area.y -= margin;
+		area.width += 2 * margin;
+		area.height += 2 * margin;
+		if (!gdPangoIntersectRect(&d_rect, &area, &r_rect) ||
+			!gdPangoTargetsIntersect(targets, n_targets, &d_rect)) {
+			return;
+		}
+	} else if (!gdPangoIntersectRect(&d_rect, bounds, &r_rect) ||
+		!gdPangoTargetsIntersect(targets, n_targets, &r_rect)) {
+		return;
+	}
+
+	if (context->ft2bmp) {
+		int cleared = gdPangoModifyFTBitmap(context->ft2bmp, r_rect.width, r_rect.height);
+
+		GD_PANGO_STAT(context, memset_bytes, cleared);
+	} else {
+		context->ft2bmp = gdPangoCreateFTBitmap(r_rect.width, r_rect.height);
+	}
+
+	gdPangoRenderGlyphString(context, targets, n_targets, colors,
+		font, glyphs, &r_rect, origin_x - r_rect.x, baseline - r_rect.y);
+}
+
+/*
+ * Render the current line of iter. All coordinates are layout
+ * coordinates, bounds is the union of the visible areas of the targets.
+ */
+static void gdPangoRenderLine(
+	gdPangoContext *context,
+	PangoLayoutIter *iter,
+	gdPangoTarget *targets,
+	int n_targets,
+	const gdRect *bounds)
+{
+	gint baseline;
+	PangoLayoutRun *run;
+
+	baseline = PANGO_PIXELS(pango_layout_iter_get_baseline(iter));
+	if (context->draw & GD_PANGO_DRAW_TEXT) {
+		GD_PANGO_STAT(context, lines, 1);
+	}
+
+	while ( (run = pango_layout_iter_get_run_readonly(iter)) ) {
+		gdPangoColors colors = context->default_colors;
+		PangoUnderline uline = PANGO_UNDERLINE_NONE;
+		gboolean strike, fg_set, bg_set, shape_set;
+		gint rise, risen_y, origin_x;
+		PangoColor fg_color, bg_color;
+		PangoRectangle logical_rect, ink_rect;
+		PangoRectangle run_logical_rect, run_ink_rect;
+
+		pango_layout_iter_get_run_extents(iter, &run_ink_rect, &run_logical_rect);
+		if (context->draw & GD_PANGO_DRAW_TEXT) {
+			GD_PANGO_STAT(context, runs, 1);
+		}
+
+		gdPangoGetItemProperties(run->item,
+			&uline, &strike, &rise,
+			&fg_color, &fg_set, &bg_color, &bg_set,
+			&shape_set, &ink_rect, &logical_rect);
+
+		origin_x = PANGO_PIXELS(run_logical_rect.x);
+		risen_y = baseline - PANGO_PIXELS(rise);
+
+		if (fg_set) {
+			colors.fg = gdPangoColorToRGBA7888(fg_color);
+
+			if (gdTrueColorGetAlpha(colors.bg) == gdAlphaTransparent) {
+				colors.bg = gdPangoColorToRGBA7888(fg_color);
+			}
+		}
+
+		if (bg_set) {
+			colors.bg = gdPangoColorToRGBA7888(bg_color);
+		}
+
+		if (!shape_set) {
+			pango_glyph_string_extents(run->glyphs, run->item->analysis.font,
+						 &ink_rect, &logical_rect);
+
+			gdPangoRenderRun(context, targets, n_targets, bounds, &colors,
+				run->item->analysis.font, run->glyphs, &ink_rect, &logical_rect,
+				origin_x, risen_y);
+		}
+
+		if (!(context->draw & GD_PANGO_DRAW_TEXT)) {
+			uline = PANGO_UNDERLINE_NONE;
+			strike = FALSE;
+		}
+
+		switch (uline) {
+			case PANGO_UNDERLINE_NONE:
+				break;
+
+			case PANGO_UNDERLINE_DOUBLE:
+				gdPangoDrawSpanTargets(targets, n_targets, &colors,
+				risen_y + 4,
+				PANGO_PIXELS(run_ink_rect.x),
+				PANGO_PIXELS(run_ink_rect.x + run_ink_rect.width));
+				/* Just do it twice */
+
+			case PANGO_UNDERLINE_SINGLE:
+				gdPangoDrawSpanTargets(targets, n_targets, &colors,
+				risen_y + 2,
+				PANGO_PIXELS(run_ink_rect.x),
+				PANGO_PIXELS(run_ink_rect.x + run_ink_rect.width));
+				break;
+
+			case PANGO_UNDERLINE_ERROR:
+			{
+				int point_x;
+				int counter = 0;
+				int end_x = PANGO_PIXELS(run_ink_rect.x + run_ink_rect.width);
+
+				for (point_x = PANGO_PIXELS(run_ink_rect.x) - 1;
+				 point_x <= end_x;
+				 point_x += 2) {
+					if (counter) {
+						gdPangoDrawSpanTargets(targets, n_targets, &colors,
+									risen_y + 2, point_x,
+									MIN (point_x + 1, end_x));
+					} else {
+						gdPangoDrawSpanTargets(targets, n_targets, &colors,
+									risen_y + 3, point_x,
+									MIN (point_x + 1, end_x));
+					}
+					counter = (counter + 1) % 2;
+				}
+			}
+				break;
+
+			case PANGO_UNDERLINE_LOW:
+				gdPangoDrawSpanTargets(targets, n_targets, &colors,
+				risen_y + PANGO_PIXELS(ink_rect.y + ink_rect.height),
+				PANGO_PIXELS(run_ink_rect.x),
+				PANGO_PIXELS(run_ink_rect.x + run_ink_rect.width));
+				break;
+
+			default:
+				break;
+		}
+
+		if (strike) {
+			gdPangoDrawSpanTargets(targets, n_targets, &colors,
+			risen_y + PANGO_PIXELS(logical_rect.y + logical_rect.height / 2),
+			PANGO_PIXELS(run_logical_rect.x),
+			PANGO_PIXELS(run_logical_rect.x + run_logical_rect.width));
+		}
+
+		pango_layout_iter_next_run(iter);
+	}
+}
+
+/*
+ * Compute the drawable area of each target and their union, in layout
+ * coordinates. Returns zero if nothing can be drawn.
+ */
+static int gdPangoTargetsBounds(
+	gdPangoTarget *targets,
+	int n_targets,
+	gdRect *bounds)
+{
+	int i;
+
+	bounds->x = bounds->y = 0;
+	bounds->width = bounds->height = 0;
+	for (i = 0; i < n_targets; i++) {
+		gdPangoTarget *target = &targets[i];
+
+		if (!gdPangoGetSurfaceClip(target->surface, &target->clip)) {
+			target->clip.width = target->clip.height = 0;
+			continue;
+		}
+		gdPangoRectUnion(bounds,
+			target->clip.x - target->x, target->clip.y - target->y,
+			target->clip.width, target->clip.height);
+	}
+	return (bounds->width > 0 && bounds->height > 0);
+}
+
+/*
+ * Get the pixel box of the current line of iter, including the room
+ * needed by decorations, in layout coordinates.
+ */
+static int gdPangoLineBox(gdPangoContext *context, PangoLayoutIter *iter,
+	gdRect *line_rect)
+{
+	PangoRectangle line_ink_rect, line_logical_rect;
+	int margin = gdPangoEffectsMargin(context);
+
+	pango_layout_iter_get_line_extents(iter, &line_ink_rect, &line_logical_rect);
+	if (!gdPangoExtentsBox(&line_ink_rect, &line_logical_rect, line_rect)) {
+		return 0;
+	}
+	/* underlines may be drawn a few pixels below the ink */
+	line_rect->height += GD_PANGO_DECORATION_MARGIN;
+
+	line_rect->x -= margin;
+	line_rect->y -= margin;
+	line_rect->width += 2 * margin;
+	line_rect->height += 2 * margin;
+	return 1;
+}
+
+/*
+ * Render the lines from the current position of iter on the targets,
+ * until the first line below bounds. Lines and runs which are not
+ * visible on any target are skipped before any FreeType work.
+ */
+static void gdPangoRenderLinesPass(
+	gdPangoContext *context,
+	PangoLayoutIter *iter,
+	gdPangoTarget *targets,
+	int n_targets,
+	const gdRect *bounds)
+{
+	do {
+		gdRect line_rect;
+
+		if (!gdPangoLineBox(context, iter, &line_rect)) {
+			continue;
+		}
+
+		/* lines are sorted top to bottom */
+		if (line_rect.y >= bounds->y + bounds->height) {
+			break;
+		}
+		if (gdPangoIntersectRect(&line_rect, bounds, NULL) &&
+			gdPangoTargetsIntersect(targets, n_targets, &line_rect)) {
+			gdPangoRenderLine(context, iter, targets, n_targets, bounds);
+		}
+	} while (pango_layout_iter_next_line(iter));
+}
+
+/* test whether the layout of iter is a single line of a single run */
+static int gdPangoSingleRun(PangoLayoutIter *iter)
+{
+	PangoLayoutLine *line = pango_layout_iter_get_line_readonly(iter);
+
+	return pango_layout_get_line_count(pango_layout_iter_get_layout(iter)) == 1 &&
+		line->runs && !line->runs->next;
+}
+
+/*
+ * With effects, the effects of all the lines are drawn first so that
+ * they never cover the text of a neighbouring run or line. A single run
+ * has no neighbour: its effects and text are drawn in one pass from the
+ * same glyph mask.
+ */
+static void gdPangoRenderLines(
+	gdPangoContext *context,
+	PangoLayoutIter *iter,
+	gdPangoTarget *targets,
+	int n_targets,
+	const gdRect *bounds)
+{
+	if (gdPangoEffectsMargin(context) > 0 && !gdPangoSingleRun(iter)) {
+		PangoLayoutIter *effects_iter = pango_layout_iter_copy(iter);
+
+		context->draw = GD_PANGO_DRAW_EFFECTS;
+		gdPangoRenderLinesPass(context, effects_iter, targets, n_targets, bounds);
+		pango_layout_iter_free(effects_iter);
+		context->draw = GD_PANGO_DRAW_TEXT;
+	}
+	gdPangoRenderLinesPass(context, iter, targets, n_targets, bounds);
+	context->draw = GD_PANGO_DRAW_ALL;
+}
+
+/* a context rendering the text of another one at a scale */
+typedef struct {
+	double scale;
+	gdPangoContext *context;
+} gdPangoScaled;
+
+static void gdPangoFreeScaled(gdPangoContext *context)
+{
+	GSList *l;
+
+	for (l = context->scaled; l; l = l->next) {
+		gdPangoScaled *scaled = (gdPangoScaled *)l->data;
+
+		gdPangoFreeContext(scaled->context);
+		g_free(scaled);
+	}
+	g_slist_free(context->scaled);
+	context->scaled = NULL;
+}
+
+/* distance fields of the glyphs of a font, see gdPangoBuildAtlasSDF */
+typedef struct {
+	PangoFontDescription *font_desc;
+	int spread;
+	GHashTable *glyphs;  /* glyph id -> gdPangoSDFGlyph */
+} gdPangoSDFCache;
+
+typedef struct {
+	int width;
+	int height;
+	unsigned char values[1];  /* width * height */
+} gdPangoSDFGlyph;
+
+static void gdPangoFreeSDF(gdPangoContext *context)
+{
+	GSList *l;
+
+	for (l = context->sdf; l; l = l->next) {
+		gdPangoSDFCache *cache = (gdPangoSDFCache *)l->data;
+
+		pango_font_description_free(cache->font_desc);
+		g_hash_table_destroy(cache->glyphs);
+		g_free(cache);
+	}
+	g_slist_free(context->sdf);
+	context->sdf = NULL;
+}
+
+/*
+ * Simple text fast path.
+ *
+ * Single line text in one of the simple scripts, drawn with one font and
+ * no attributes, is placed from per-font glyph and advance tables plus
+ * pair adjustments (kerning) instead of itemizing and shaping it. The
+ * tables are filled lazily by shaping single characters and pairs with
+ * Pango, so the result is the same as the full path. Anything the tables
+ * cannot reproduce (fallback fonts, ligatures, marks, bidi, ...) makes
+ * the text go through the full path.
+ */
+
+#define GD_PANGO_GLYPH_UNKNOWN 0
+#define GD_PANGO_GLYPH_SIMPLE  1
+#define GD_PANGO_GLYPH_COMPLEX 2
+
+/* pair cache value of a pair which needs shaping */
+#define GD_PANGO_PAIR_COMPLEX G_MININT
+
+typedef struct {
+	PangoGlyph glyph;
+	int width;
+	int state;  /* GD_PANGO_GLYPH_* */
+} gdPangoGlyphEntry;
+
+struct gdPangoMetrics {
+	PangoFontDescription *font_desc;
+	PangoLayout *layout;  /* scratch layout to shape characters and pairs */
+	PangoFont *font;      /* the font of all the simple glyphs */
+	int baseline;         /* line metrics, -1 until a glyph is known */
+	int height;
+	gdPangoGlyphEntry *pages[256];  /* BMP glyphs by 256 characters pages */
+	GHashTable *pairs;    /* left << 16 | right -> width of left glyph */
+	int contextual;       /* the font has lookups beyond pairs of glyphs */
+};
+
+/* OpenType features applied by default to the simple scripts */
+static const char *const gdPangoGSUBFeatures[] = {
+	"ccmp", "locl", "rvrn", "rlig", "rclt", "calt", "clig", "liga", NULL
+};
+static const char *const gdPangoGPOSFeatures[] = {
+	"kern", "mark", "mkmk", "curs", "dist", "abvm", "blwm", NULL
+};
+
+/*
+ * Read a big endian integer of size bytes from an OpenType table. ok is
+ * cleared if it is out of the table.
+ */
+static guint32 gdPangoOTRead(const FT_Byte *table, FT_ULong length,
+	FT_ULong offset, int size, int *ok)
+{
+	guint32 value = 0;
+	int i;
+
+	if (offset + size > length) {
+		*ok = 0;
+		return 0;
+	}
+	for (i = 0; i < size; i++) {
+		value = value << 8 | table[offset + i];
+	}
+	return value;
+}
+
+/*
+ * Tell whether a ligature substitution subtable forms ligatures of more
+ * than two characters.
+ */
+static int gdPangoOTLongLigatures(const FT_Byte *table, FT_ULong length,
+	FT_ULong subtable, int *ok)
+{
+	guint n_sets, n_ligatures, i, j;
+	FT_ULong set, ligature;
+
+	n_sets = gdPangoOTRead(table, length, subtable + 4, 2, ok);
+	for (i = 0; i < n_sets && *ok; i++) {
+		set = subtable + gdPangoOTRead(table, length, subtable + 6 + 2 * i, 2, ok);
+		n_ligatures = gdPangoOTRead(table, length, set, 2, ok);
+		for (j = 0; j < n_ligatures && *ok; j++) {
+			ligature = set + gdPangoOTRead(table, length, set + 2 + 2 * j, 2, ok);
+			if (gdPangoOTRead(table, length, ligature + 2, 2, ok) > 2) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Tell whether a GSUB or GPOS lookup reaches beyond a pair of glyphs:
+ * contextual lookups and long ligatures, extensions unwrapped.
+ */
+static int gdPangoOTLongLookup(const FT_Byte *table, FT_ULong length,
+	FT_ULong lookup, int gsub, int *ok)
+{
+	guint type, subtype, n_subtables, i;
+	FT_ULong subtable;
+
+	type = gdPangoOTRead(table, length, lookup, 2, ok);
+	n_subtables = gdPangoOTRead(table, length, lookup + 4, 2, ok);
+	for (i = 0; i < n_subtables && *ok; i++) {
+		subtable = lookup + gdPangoOTRead(table, length, lookup + 6 + 2 * i, 2, ok);
+		subtype = type;
+		if (type == (gsub ? 7 : 9)) {
+			subtype = gdPangoOTRead(table, length, subtable + 2, 2, ok);
+			subtable += gdPangoOTRead(table, length, subtable + 4, 4, ok);
+		}
+		if (gsub) {
+			if (subtype == 5 || subtype == 6 || subtype == 8 ||
+				(subtype == 4 && gdPangoOTLongLigatures(table, length, subtable, ok))) {
+				return 1;
+			}
+		} else if (subtype == 7 || subtype == 8) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Tell whether the default features of a GSUB or GPOS table use lookups
+ * reaching beyond a pair of glyphs. Damaged tables count as such.
+ */
+static int gdPangoOTLongFeatures(const FT_Byte *table, FT_ULong length,
+	int gsub)
+{
+	const char *const *features = gsub ? gdPangoGSUBFeatures : gdPangoGPOSFeatures;
+	FT_ULong feature_list, lookup_list, record, feature, lookup;
+	guint n_features, n_lookups, n_indices, index, i, j, k;
+	int ok = 1;
+
+	feature_list = gdPangoOTRead(table, length, 6, 2, &ok);
+	lookup_list = gdPangoOTRead(table, length, 8, 2, &ok);
+	n_features = gdPangoOTRead(table, length, feature_list, 2, &ok);
+	n_lookups = gdPangoOTRead(table, length, lookup_list, 2, &ok);
+	for (i = 0; i < n_features && ok; i++) {
+		record = feature_list + 2 + 6 * i;
+		feature = feature_list + gdPangoOTRead(table, length, record + 4, 2, &ok);
+		for (k = 0; ok && features[k]; k++) {
+			if (memcmp(table + record, features[k], 4) == 0) {
+				break;
+			}
+		}
+		if (!ok || !features[k]) {
+			continue;
+		}
+		n_indices = gdPangoOTRead(table, length, feature + 2, 2, &ok);
+		for (j = 0; j < n_indices && ok; j++) {
+			index = gdPangoOTRead(table, length, feature + 4 + 2 * j, 2, &ok);
+			if (index >= n_lookups) {
+				continue;
+			}
+			lookup = lookup_list + gdPangoOTRead(table, length,
+				lookup_list + 2 + 2 * index, 2, &ok);
+			if (ok && gdPangoOTLongLookup(table, length, lookup, gsub, &ok)) {
+				return 1;
+			}
+		}
+	}
+	return !ok;
+}
+
+/*
+ * Tell whether shaping a font may change glyphs or positions beyond what
+ * single characters and pairs show: ligatures of three characters or
+ * more, contextual substitutions and positioning, AAT morphing.
+ */
+static int gdPangoFontContextual(PangoFont *font)
+{
+	static const FT_ULong tags[] = { TTAG_GSUB, TTAG_GPOS };
+	FT_Face face;
+	FT_Byte *table;
+	FT_ULong length;
+	int contextual = 0;
+	int i;
+
+	if (!PANGO_IS_FC_FONT(font)) {
+		return 1;
+	}
+	face = pango_fc_font_lock_face(PANGO_FC_FONT(font));
+	if (!face) {
+		return 1;
+	}
+	length = 0;
+	if (FT_Load_Sfnt_Table(face, TTAG_morx, 0, NULL, &length) == 0) {
+		contextual = 1;
+	}
+	for (i = 0; i < 2 && !contextual; i++) {
+		length = 0;
+		if (FT_Load_Sfnt_Table(face, tags[i], 0, NULL, &length) != 0) {
+			continue;
+		}
+		table = (FT_Byte *)g_malloc(length);
+		if (FT_Load_Sfnt_Table(face, tags[i], 0, table, &length) == 0) {
+			contextual = gdPangoOTLongFeatures(table, length, i == 0);
+		} else {
+			contextual = 1;
+		}
+		g_free(table);
+	}
+	pango_fc_font_unlock_face(PANGO_FC_FONT(font));
+	return contextual;
+}
+
+static gdPangoMetrics *gdPangoMetricsNew(PangoContext *pango_context,
+	const PangoFontDescription *font_desc)
+{
+	gdPangoMetrics *metrics = (gdPangoMetrics *)g_malloc0(sizeof(gdPangoMetrics));
+
+	metrics->font_desc = pango_font_description_copy(font_desc);
+	metrics->layout = pango_layout_new(pango_context);
+	pango_layout_set_auto_dir(metrics->layout, TRUE);
+	pango_layout_set_font_description(metrics->layout, font_desc);
+	metrics->font = pango_context_load_font(pango_context, font_desc);
+	metrics->contextual = !metrics->font || gdPangoFontContextual(metrics->font);
+	metrics->baseline = -1;
+	metrics->height = -1;
+	metrics->pairs = g_hash_table_new(g_direct_hash, g_direct_equal);
+	return metrics;
+}
+
+static void gdPangoMetricsFree(gdPangoMetrics *metrics)
+{
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		g_free(metrics->pages[i]);
+	}
+	g_hash_table_destroy(metrics->pairs);
+	if (metrics->font) {
+		g_object_unref(metrics->font);
+	}
+	g_object_unref(metrics->layout);
+	pango_font_description_free(metrics->font_desc);
+	g_free(metrics);
+}
+
+/*
+ * Get the metrics of a font description, created on first use.
+ */
+static gdPangoMetrics *gdPangoContextMetrics(gdPangoContext *context,
+	const PangoFontDescription *font_desc)
+{
+	gdPangoMetrics *metrics;
+	GSList *l;
+
+	for (l = context->metrics; l; l = l->next) {
+		metrics = (gdPangoMetrics *)l->data;
+		if (pango_font_description_equal(metrics->font_desc, font_desc)) {
+			return metrics;
+		}
+	}
+	metrics = gdPangoMetricsNew(context->context, font_desc);
+	context->metrics = g_slist_prepend(context->metrics, metrics);
+	return metrics;
+}
+
+static void gdPangoContextFreeMetrics(gdPangoContext *context)
+{
+	GSList *l;
+
+	for (l = context->metrics; l; l = l->next) {
+		gdPangoMetricsFree((gdPangoMetrics *)l->data);
+	}
+	g_slist_free(context->metrics);
+	context->metrics = NULL;
+	context->simple = NULL;
+	context->simple_valid = 0;
+}
+
+/*
+ * Shape a short text with the scratch layout. Returns its glyphs if it
+ * is a single run drawn with the font of metrics, otherwise NULL.
+ */
+static PangoGlyphString *gdPangoMetricsShapeText(gdPangoMetrics *metrics,
+	const char *text, int length)
+{
+	PangoLayoutLine *line;
+	PangoLayoutRun *run;
+
+	pango_layout_set_text(metrics->layout, text, length);
+	if (!metrics->font || pango_layout_get_line_count(metrics->layout) != 1) {
+		return NULL;
+	}
+	line = pango_layout_get_line_readonly(metrics->layout, 0);
+	if (!line->runs || line->runs->next) {
+		return NULL;
+	}
+	run = (PangoLayoutRun *)line->runs->data;
+	if (run->item->analysis.font != metrics->font) {
+		return NULL;
+	}
+	return run->glyphs;
+}
+
+/*
+ * Get the glyph of a BMP character, or NULL if it needs shaping.
+ */
+static const gdPangoGlyphEntry *gdPangoMetricsGlyph(gdPangoMetrics *metrics,
+	gunichar c)
+{
+	gdPangoGlyphEntry *page = metrics->pages[c >> 8];
+	gdPangoGlyphEntry *entry;
+
+	if (!page) {
+		page = g_new0(gdPangoGlyphEntry, 256);
+		metrics->pages[c >> 8] = page;
+	}
+	entry = &page[c & 0xFF];
+
+	if (entry->state == GD_PANGO_GLYPH_UNKNOWN) {
+		PangoGlyphString *glyphs;
+		char buf[6];
+
+		glyphs = gdPangoMetricsShapeText(metrics, buf, g_unichar_to_utf8(c, buf));
+		entry->state = GD_PANGO_GLYPH_COMPLEX;
+		if (glyphs && glyphs->num_glyphs == 1 &&
+			!(glyphs->glyphs[0].glyph & PANGO_GLYPH_UNKNOWN_FLAG) &&
+			glyphs->glyphs[0].geometry.x_offset == 0 &&
+			glyphs->glyphs[0].geometry.y_offset == 0) {
+			entry->glyph = glyphs->glyphs[0].glyph;
+			entry->width = glyphs->glyphs[0].geometry.width;
+			entry->state = GD_PANGO_GLYPH_SIMPLE;
+
+			if (metrics->height < 0) {
+				PangoRectangle logical_rect;
+
+				pango_layout_get_extents(metrics->layout, NULL, &logical_rect);
+				metrics->height = logical_rect.height;
+				metrics->baseline = pango_layout_get_baseline(metrics->layout);
+			}
+		}
+	}
+	return entry->state == GD_PANGO_GLYPH_SIMPLE ? entry : NULL;
+}
+
+/*
+ * Get the width of the left glyph of a pair, kerning included. Returns
+ * zero if the pair needs shaping (ligature, contextual forms, ...).
+ */
+static int gdPangoMetricsPair(gdPangoMetrics *metrics,
+	gunichar left, const gdPangoGlyphEntry *left_entry,
+	gunichar right, const gdPangoGlyphEntry *right_entry,
+	int *width)
+{
+	gpointer key = GUINT_TO_POINTER(left << 16 | right);
+	gpointer value;
+
+	if (!g_hash_table_lookup_extended(metrics->pairs, key, NULL, &value)) {
+		PangoGlyphString *glyphs;
+		char buf[12];
+		int length;
+
+		length = g_unichar_to_utf8(left, buf);
+		length += g_unichar_to_utf8(right, buf + length);
+		glyphs = gdPangoMetricsShapeText(metrics, buf, length);
+
+		if (glyphs && glyphs->num_glyphs == 2 &&
+			glyphs->glyphs[0].glyph == left_entry->glyph &&
+			glyphs->glyphs[1].glyph == right_entry->glyph &&
+			glyphs->glyphs[1].geometry.width == right_entry->width &&
+			glyphs->glyphs[0].geometry.x_offset == 0 &&
+			glyphs->glyphs[0].geometry.y_offset == 0 &&
+			glyphs->glyphs[1].geometry.x_offset == 0 &&
+			glyphs->glyphs[1].geometry.y_offset == 0) {
+			value = GINT_TO_POINTER(glyphs->glyphs[0].geometry.width);
+		} else {
+			value = GINT_TO_POINTER(GD_PANGO_PAIR_COMPLEX);
+		}
+		g_hash_table_insert(metrics->pairs, key, value);
+	}
+
+	if (GPOINTER_TO_INT(value) == GD_PANGO_PAIR_COMPLEX) {
+		return 0;
+	}
+	*width = GPOINTER_TO_INT(value);
+	return 1;
+}
+
+/*
+ * Test whether a character may be placed without shaping. script is the
+ * strong script of the text so far, updated.
+ */
+static int gdPangoSimpleChar(gunichar c, GUnicodeScript *script)
+{
+	GUnicodeScript char_script;
+
+	if (c == 0 || c > 0xFFFF ||
+		g_unichar_iscntrl(c) || g_unichar_ismark(c) || g_unichar_iszerowidth(c)) {
+		return 0;
+	}
+
+	switch (pango_bidi_type_for_unichar(c)) {
+		case PANGO_BIDI_TYPE_L:
+		case PANGO_BIDI_TYPE_EN:
+		case PANGO_BIDI_TYPE_ES:
+		case PANGO_BIDI_TYPE_ET:
+		case PANGO_BIDI_TYPE_CS:
+		case PANGO_BIDI_TYPE_WS:
+		case PANGO_BIDI_TYPE_ON:
+			break;
+		default:
+			return 0;
+	}
+
+	/* one item only: common characters plus a single strong script */
+	char_script = g_unichar_get_script(c);
+	switch (char_script) {
+		case G_UNICODE_SCRIPT_COMMON:
+			return 1;
+		case G_UNICODE_SCRIPT_LATIN:
+		case G_UNICODE_SCRIPT_GREEK:
+		case G_UNICODE_SCRIPT_CYRILLIC:
+			if (*script != G_UNICODE_SCRIPT_COMMON && *script != char_script) {
+				return 0;
+			}
+			*script = char_script;
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+/*
+ * Place the glyphs of a text from the tables of metrics and sum their
+ * widths. glyphs may be NULL to measure only. Returns zero if the text
+ * needs the full path.
+ */
+static int gdPangoMetricsPlace(gdPangoMetrics *metrics, const char *text,
+	int length, PangoGlyphString *glyphs, int *width)
+{
+	GUnicodeScript script = G_UNICODE_SCRIPT_COMMON;
+	const gdPangoGlyphEntry *entry, *prev = NULL;
+	gunichar c, prev_c = 0;
+	const char *p, *end;
+	int i, prev_width = 0, total = 0;
+
+	if (metrics->contextual) {
+		return 0;
+	}
+	if (length < 0) {
+		length = strlen(text);
+	}
+	end = text + length;
+
+	if (glyphs) {
+		pango_glyph_string_set_size(glyphs, g_utf8_strlen(text, length));
+	}
+	for (p = text, i = 0; p < end; p = g_utf8_next_char(p), i++) {
+		c = g_utf8_get_char(p);
+		if (!gdPangoSimpleChar(c, &script)) {
+			return 0;
+		}
+		entry = gdPangoMetricsGlyph(metrics, c);
+		if (!entry) {
+			return 0;
+		}
+		if (prev) {
+			if (!gdPangoMetricsPair(metrics, prev_c, prev, c, entry, &prev_width)) {
+				return 0;
+			}
+			if (glyphs) {
+				glyphs->glyphs[i - 1].geometry.width = prev_width;
+			}
+			total += prev_width;
+		}
+
+		if (glyphs) {
+			glyphs->glyphs[i].glyph = entry->glyph;
+			glyphs->glyphs[i].geometry.width = entry->width;
+			glyphs->glyphs[i].geometry.x_offset = 0;
+			glyphs->glyphs[i].geometry.y_offset = 0;
+			glyphs->glyphs[i].attr.is_cluster_start = 1;
+			glyphs->log_clusters[i] = p - text;
+		}
+
+		prev = entry;
+		prev_c = c;
+	}
+	if (prev) {
+		total += prev->width;
+	}
+	if (width) {
+		*width = total;
+	}
+	return 1;
+}
+
+/*
+ * Place the glyphs of the layout of context for the fast path. Returns
+ * their metrics, or NULL if the layout needs the full path.
+ */
+static gdPangoMetrics *gdPangoSimplePlace(gdPangoContext *context)
+{
+	PangoLayout *layout = context->layout;
+	const PangoFontDescription *font_desc;
+	gdPangoMetrics *metrics;
+	const char *text;
+
+	if (pango_context_get_matrix(context->context) != NULL ||
+		pango_layout_get_attributes(layout) != NULL ||
+		pango_layout_get_width(layout) != -1 ||
+		pango_layout_get_indent(layout) != 0) {
+		return NULL;
+	}
+
+	switch (pango_context_get_base_dir(context->context)) {
+		case PANGO_DIRECTION_LTR:
+		case PANGO_DIRECTION_WEAK_LTR:
+		case PANGO_DIRECTION_NEUTRAL:
+			break;
+		default:
+			return NULL;
+	}
+
+	font_desc = pango_layout_get_font_description(layout);
+	text = pango_layout_get_text(layout);
+	if (!font_desc || !text || !*text) {
+		return NULL;
+	}
+
+	metrics = gdPangoContextMetrics(context, font_desc);
+	if (!gdPangoMetricsPlace(metrics, text, -1, context->glyphs, NULL) ||
+		metrics->height < 0) {
+		return NULL;
+	}
+	return metrics;
+}
+
+/*
+ * Try the fast path on the layout of context. On success the glyphs are
+ * in context->glyphs and their metrics are returned, otherwise NULL. The
+ * result is kept until the layout changes, so measuring then rendering
+ * places the text once.
+ */
+static gdPangoMetrics *gdPangoSimpleShape(gdPangoContext *context)
+{
+	guint serial = pango_layout_get_serial(context->layout);
+
+	if (!context->simple_valid || context->simple_serial != serial) {
+		context->simple = gdPangoSimplePlace(context);
+		context->simple_serial = serial;
+		context->simple_valid = 1;
+	}
+	return context->simple;
+}
+
+/*
+ * Get the extents of the glyphs placed by the fast path, as
+ * pango_layout_get_extents would.
+ */
+static void gdPangoSimpleExtents(gdPangoMetrics *metrics,
+	PangoGlyphString *glyphs,
+	PangoRectangle *ink_rect,
+	PangoRectangle *logical_rect)
+{
+	if (ink_rect) {
+		pango_glyph_string_extents(glyphs, metrics->font, ink_rect, NULL);
+		ink_rect->y += metrics->baseline;
+	}
+	if (logical_rect) {
+		logical_rect->x = 0;
+		logical_rect->y = 0;
+		logical_rect->width = pango_glyph_string_get_width(glyphs);
+		logical_rect->height = metrics->height;
+	}
+}
+
+/*
+ * Get the extents of the layout of context, through the fast path when
+ * possible.
+ */
+static void gdPangoGetExtents(gdPangoContext *context,
+	PangoRectangle *ink_rect,
+	PangoRectangle *logical_rect)
+{
+	gdPangoMetrics *metrics = gdPangoSimpleShape(context);
+
+	if (metrics) {
+		gdPangoSimpleExtents(metrics, context->glyphs, ink_rect, logical_rect);
+	} else {
+		pango_layout_get_extents(context->layout, ink_rect, logical_rect);
+	}
+}
+
+/*
+ * Render the glyphs placed by the fast path, as the only run of the
+ * only line of the layout.
+ */
+static void gdPangoRenderSimple(
+	gdPangoContext *context,
+	gdPangoMetrics *metrics,
+	gdPangoTarget *targets,
+	int n_targets,
+	const gdRect *bounds)
+{
+	PangoRectangle ink_rect, logical_rect;
+
+	GD_PANGO_STAT(context, lines, 1);
+	GD_PANGO_STAT(context, runs, 1);
+	pango_glyph_string_extents(context->glyphs, metrics->font,
+		&ink_rect, &logical_rect);
+	gdPangoRenderRun(context, targets, n_targets, bounds,
+		&context->default_colors, metrics->font, context->glyphs,
+		&ink_rect, &logical_rect, 0, PANGO_PIXELS(metrics->baseline));
+}
+
+/*
+ * Render a non-transformed layout on one or more targets.
+ */
+static void gdPangoRenderLayout(
+	gdPangoContext *context,
+	PangoLayout *layout,
+	gdPangoTarget *targets,
+	int n_targets)
+{
+	PangoLayoutIter *iter;
+	gdPangoMetrics *metrics;
+	gdRect bounds;
+
+	if (!gdPangoTargetsBounds(targets, n_targets, &bounds)) {
+		return;
+	}
+
+	if (layout == context->layout && (metrics = gdPangoSimpleShape(context))) {
+		gdPangoRenderSimple(context, metrics, targets, n_targets, &bounds);
+		return;
+	}
+
+	iter = pango_layout_get_iter(layout);
+	gdPangoRenderLines(context, iter, targets, n_targets, &bounds);
+	pango_layout_iter_free (iter);
+}
+
+
+/* Public API */
+
+/**
+ * Initialize the GLib and Pango API.
+ * This function must be called before using any other functions
+ * in this library besides gdPangoIsInitialized.
+ *
+ * @return always GD_SUCCESS.
+*/
+int gdPangoInit(void) {
+	g_type_init();
+	GD_PANGO_IS_INITIALIZED = 1;
+	return GD_SUCCESS;
+}
+
+/**
+ * Return the intialization status.
+ * Tells whether gdPango has been already initialized or not.
+ *
+ * @return positive if it was initialized, otherwise zero.
+ */
+int gdPangoIsInitialized(void)
+{
+	return GD_PANGO_IS_INITIALIZED;
+}
+
+/* fontconfig options of the quality tiers other than the normal one */
+static void gdPangoQualitySubstitute(FcPattern *pattern, gpointer data)
+{
+	int quality = GPOINTER_TO_INT(data);
+
+	FcPatternDel(pattern, FC_ANTIALIAS);
+	FcPatternDel(pattern, FC_HINTING);
+	FcPatternDel(pattern, FC_HINT_STYLE);
+	FcPatternDel(pattern, FC_AUTOHINT);
+	if (quality == GD_PANGO_QUALITY_DRAFT) {
+		/* one bit per pixel, the outlines snapped to the pixel grid */
+		FcPatternAddBool(pattern, FC_ANTIALIAS, FcFalse);
+		FcPatternAddInteger(pattern, FC_HINT_STYLE, FC_HINT_FULL);
+	} else {
+		/* only vertical hinting, which keeps the shapes and widths */
+		FcPatternAddBool(pattern, FC_ANTIALIAS, FcTrue);
+		FcPatternAddInteger(pattern, FC_HINT_STYLE, FC_HINT_SLIGHT);
+	}
+	FcPatternAddBool(pattern, FC_HINTING, FcTrue);
+	FcPatternAddBool(pattern, FC_AUTOHINT, FcFalse);
+}
+
+/* set the rasterizer options of a quality tier, dropping the loaded fonts */
+static void gdPangoSetMapQuality(PangoFontMap *font_map, int quality)
+{
+	if (quality == GD_PANGO_QUALITY_NORMAL) {
+		pango_ft2_font_map_set_default_substitute(PANGO_FT2_FONT_MAP(font_map),
+			NULL, NULL, NULL);
+	} else {
+		pango_ft2_font_map_set_default_substitute(PANGO_FT2_FONT_MAP(font_map),
+			gdPangoQualitySubstitute, GINT_TO_POINTER(quality), NULL);
+	}
+}
+
+/*
+ * Font maps shared by the contexts of a thread, one per resolution,
+ * see gdPangoCreateSharedContext.
+ */
+struct gdPangoSharedMap {
+	double dpi_x;
+	double dpi_y;
+	int quality;
+	int users;             /* shared contexts drawing with the map */
+	PangoFontMap *font_map;
+	GHashTable *fontsets;  /* gdPangoFallbackKey -> PangoFontset */
+};
+
+/* what the fallback font sets of a context were last resolved for */
+struct gdPangoFallbackMemo {
+	char *text;
+	PangoAttrList *attrs;
+	PangoFontDescription *font_desc;
+	PangoLanguage *language;
+};
+
+/* the fallback font set of a font for a script */
+typedef struct {
+	PangoFontDescription *font_desc;
+	PangoScript script;
+	PangoLanguage *language;
+} gdPangoFallbackKey;
+
+static guint gdPangoFallbackHash(gconstpointer data)
+{
+	const gdPangoFallbackKey *key = (const gdPangoFallbackKey *)data;
+
+	return pango_font_description_hash(key->font_desc) ^ ((guint)key->script << 16) ^
+		GPOINTER_TO_UINT(key->language);
+}
+
+static gboolean gdPangoFallbackEqual(gconstpointer a, gconstpointer b)
+{
+	const gdPangoFallbackKey *k1 = (const gdPangoFallbackKey *)a;
+	const gdPangoFallbackKey *k2 = (const gdPangoFallbackKey *)b;
+
+	return k1->script == k2->script && k1->language == k2->language &&
+		pango_font_description_equal(k1->font_desc, k2->font_desc);
+}
+
+static void gdPangoFreeFallbackKey(gpointer data)
+{
+	gdPangoFallbackKey *key = (gdPangoFallbackKey *)data;
+
+	pango_font_description_free(key->font_desc);
+	g_free(key);
+}
+
+static void gdPangoFreeSharedMap(gdPangoSharedMap *shared)
+{
+	g_hash_table_destroy(shared->fontsets);
+	g_object_unref(shared->font_map);
+	g_free(shared);
+}
+
+/* the maps of a thread, freed when it exits */
+static void gdPangoFreeSharedMaps(gpointer data)
+{
+	GSList *l;
+
+	for (l = (GSList *)data; l; l = l->next) {
+		gdPangoFreeSharedMap((gdPangoSharedMap *)l->data);
+	}
+	g_slist_free((GSList *)data);
+}
+
+static GPrivate gdPangoSharedMaps = G_PRIVATE_INIT(gdPangoFreeSharedMaps);
+
+/* get the shared font map of the calling thread for a resolution */
+static gdPangoSharedMap *gdPangoGetSharedMap(double dpi_x, double dpi_y,
+	int quality)
+{
+	GSList *maps = (GSList *)g_private_get(&gdPangoSharedMaps), *l;
+	gdPangoSharedMap *shared;
+
+	for (l = maps; l; l = l->next) {
+		shared = (gdPangoSharedMap *)l->data;
+		if (shared->dpi_x == dpi_x && shared->dpi_y == dpi_y &&
+			shared->quality == quality) {
+			return shared;
+		}
+	}
+	shared = g_new(gdPangoSharedMap, 1);
+	shared->dpi_x = dpi_x;
+	shared->dpi_y = dpi_y;
+	shared->quality = quality;
+	shared->users = 0;
+	shared->font_map = pango_ft2_font_map_new();
+	pango_ft2_font_map_set_resolution(PANGO_FT2_FONT_MAP(shared->font_map), dpi_x, dpi_y);
+	gdPangoSetMapQuality(shared->font_map, quality);
+	shared->fontsets = g_hash_table_new_full(gdPangoFallbackHash, gdPangoFallbackEqual,
+		gdPangoFreeFallbackKey, g_object_unref);
+	g_private_set(&gdPangoSharedMaps, g_slist_prepend(maps, shared));
+	return shared;
+}
+
+static void gdPangoFreeFallbackMemo(gdPangoFallbackMemo *memo)
+{
+	if (!memo) {
+		return;
+	}
+	g_free(memo->text);
+	if (memo->attrs) {
+		pango_attr_list_unref(memo->attrs);
+	}
+	pango_font_description_free(memo->font_desc);
+	g_free(memo);
+}
+
+/* make a context draw with a shared map, or with none */
+static void gdPangoUseSharedMap(gdPangoContext *context,
+	gdPangoSharedMap *shared)
+{
+	if (context->shared) {
+		context->shared->users--;
+	}
+	/* the font sets of another map are still to be resolved */
+	gdPangoFreeFallbackMemo(context->fallback);
+	context->fallback = NULL;
+	context->shared = shared;
+	if (shared) {
+		shared->users++;
+	}
+}
+
+static int gdPangoAttrListEqual(PangoAttrList *a, PangoAttrList *b)
+{
+	if (!a || !b) {
+		return a == b;
+	}
+#if PANGO_VERSION_CHECK(1, 46, 0)
+	return pango_attr_list_equal(a, b);
+#else
+	return 0;
+#endif
+}
+
+/* resolve the fallback font sets of the scripts of a part of the text */
+static void gdPangoResolveFallbackRange(gdPangoContext *context,
+	const char *text, int length, const PangoFontDescription *font_desc,
+	PangoLanguage *language)
+{
+	gdPangoFallbackKey key, *copy;
+	PangoScriptIter *iter;
+	PangoFontset *fontset;
+
+	key.font_desc = (PangoFontDescription *)font_desc;
+	iter = pango_script_iter_new(text, length);
+	do {
+		const char *start, *end;
+
+		pango_script_iter_get_range(iter, &start, &end, &key.script);
+		/* common and inherited characters go with their neighbours */
+		if (key.script == PANGO_SCRIPT_COMMON || key.script == PANGO_SCRIPT_INHERITED ||
+			key.script == PANGO_SCRIPT_INVALID_CODE) {
+			continue;
+		}
+		key.language = language;
+		if (!pango_language_includes_script(language, key.script) &&
+			pango_script_get_sample_language(key.script)) {
+			key.language = pango_script_get_sample_language(key.script);
+		}
+		if (g_hash_table_lookup(context->shared->fontsets, &key)) {
+			continue;
+		}
+		fontset = pango_context_load_fontset(context->context, key.font_desc, key.language);
+		if (fontset) {
+			copy = g_new(gdPangoFallbackKey, 1);
+			*copy = key;
+			copy->font_desc = pango_font_description_copy(key.font_desc);
+			g_hash_table_insert(context->shared->fontsets, copy, fontset);
+		}
+	} while (pango_script_iter_next(iter));
+	pango_script_iter_free(iter);
+}
+
+/*
+ * Resolve the fallback font sets of the scripts of the text once per
+ * shared font map. The font sets are kept, and with them the font lists
+ * sorted by fontconfig, so that no context of the thread sorts the fonts
+ * again for the same font, script and language. Fonts are the ones the
+ * attributes of the layout give to each part of the text, and nothing
+ * is done again while the text, attributes, font and language stay the
+ * same.
+ */
+static void gdPangoResolveFallback(gdPangoContext *context)
+{
+	PangoLayout *layout = context->layout;
+	PangoLanguage *language = pango_context_get_language(context->context);
+	const char *text = pango_layout_get_text(layout);
+	PangoAttrList *attrs = pango_layout_get_attributes(layout);
+	const PangoFontDescription *base = pango_layout_get_font_description(layout);
+	gdPangoFallbackMemo *memo = context->fallback;
+	int length;
+
+	if (!context->shared || !text || !*text) {
+		return;
+	}
+	if (!base) {
+		base = context->font_desc;
+	}
+	if (memo && memo->language == language && strcmp(memo->text, text) == 0 &&
+		pango_font_description_equal(memo->font_desc, base) &&
+		gdPangoAttrListEqual(memo->attrs, attrs)) {
+		return;
+	}
+
+	length = strlen(text);
+	if (!attrs) {
+		gdPangoResolveFallbackRange(context, text, length, base, language);
+	} else {
+		PangoAttrIterator *iter = pango_attr_list_get_iterator(attrs);
+
+		do {
+			PangoFontDescription *font_desc = pango_font_description_copy(base);
+			PangoLanguage *range_language = NULL;
+			gint start, end;
+
+			pango_attr_iterator_range(iter, &start, &end);
+			end = MIN(end, length);
+			if (start < end) {
+				pango_attr_iterator_get_font(iter, font_desc, &range_language, NULL);
+				gdPangoResolveFallbackRange(context, text + start, end - start,
+					font_desc, range_language ? range_language : language);
+			}
+			pango_font_description_free(font_desc);
+		} while (pango_attr_iterator_next(iter));
+		pango_attr_iterator_destroy(iter);
+	}
+
+	gdPangoFreeFallbackMemo(memo);
+	memo = g_new(gdPangoFallbackMemo, 1);
+	memo->text = g_strdup(text);
+	memo->attrs = attrs ? pango_attr_list_copy(attrs) : NULL;
+	memo->font_desc = pango_font_description_copy(base);
+	memo->language = language;
+	context->fallback = memo;
+}
+
+/* create a context drawing with a font map */
+static gdPangoContext* gdPangoNewContext(PangoFontMap *font_map)
+{
+	gdPangoContext *context = (gdPangoContext *)g_malloc(sizeof(gdPangoContext));
+
+	context->font_map = font_map;
+	context->shared = NULL;
+	context->fallback = NULL;
+	context->registry = NULL;
+	context->context = pango_ft2_font_map_create_context (PANGO_FT2_FONT_MAP (context->font_map));
+
+	pango_context_set_language(context->context, pango_language_get_default());
+	/*pango_context_set_base_dir(context->context, PANGO_DIRECTION_LTR);*/
+	/*pango_context_set_base_gravity(context->context, PANGO_GRAVITY_SOUTH);*/
+
+	context->font_desc = pango_font_description_from_string(
+		GD_PANGO_MAKE_FONT_NAME(GD_PANGO_DEFAULT_FONT_FAMILY, GD_PANGO_DEFAULT_FONT_SIZE));
+
+	context->matrix = NULL;
+	context->layout = pango_layout_new(context->context);
+
+	/*
 	   TODO: use other color formats to keep flexibility (once we support
 	   more of them)
 	 */
-	context->default_colors.fg = 0xFFFFFF;
-	context->default_colors.bg = 0x0;
-	context->default_colors.alpha = 0x0;
+	context->default_colors.fg = 0xFFFFFF;
+	context->default_colors.bg = 0x0;
+	context->default_colors.alpha = 0x0;
+
+	context->ft2bmp = NULL;
+	context->glyphs = pango_glyph_string_new();
+	context->metrics = NULL;
+	context->simple = NULL;
+	context->simple_valid = 0;
+	context->scaled = NULL;
+	context->sdf = NULL;
+	context->glyph_cache = NULL;
+	context->cache_fonts = NULL;
+	context->quality = GD_PANGO_QUALITY_NORMAL;
+	context->stats = NULL;
+	context->effects.halo_radius = 0;
+	context->effects.halo_color = 0;
+	context->effects.shadow_dx = 0;
+	context->effects.shadow_dy = 0;
+	context->effects.shadow_radius = 0;
+	context->effects.shadow_color = 0;
+	context->draw = GD_PANGO_DRAW_ALL;
+	context->scratch = NULL;
+	context->scratch_size = 0;
+	context->dpi_x = GD_PANGO_DEFAULT_DPI;
+	context->dpi_y = GD_PANGO_DEFAULT_DPI;
+
+	context->min_height = 0;
+	context->min_width = 0;
+	context->angle = 0.0;
+
+	context->updating = 0;
+	context->pending.flags = 0;
+	context->pending.text = NULL;
+	context->pending.attrs = NULL;
+
+	return context;
+}
+
+/**
+ * Create a context which contains Pango objects.
+ *
+ * The context has its own font map, so it can be used from any thread.
+ *
+ * @return A pointer to the context as a gdPangoContext*.
+ */
+gdPangoContext* gdPangoCreateContext(void)
+{
+	PangoFontMap *font_map = pango_ft2_font_map_new();
+
+	pango_ft2_font_map_set_resolution (PANGO_FT2_FONT_MAP (font_map), GD_PANGO_DEFAULT_DPI, GD_PANGO_DEFAULT_DPI);
+	return gdPangoNewContext(font_map);
+}
+
+/**
+ * Create a context sharing its font map with the other shared contexts
+ * of the calling thread.
+ *
+ * Fonts, fallback font sets and rendered glyphs are then resolved once
+ * per thread instead of once per context, which makes short-lived
+ * contexts cheap. The context must only be used by the thread which
+ * created it.
+ *
+ * @return A pointer to the context as a gdPangoContext*.
+ */
+gdPangoContext* gdPangoCreateSharedContext(void)
+{
+	gdPangoSharedMap *shared = gdPangoGetSharedMap(GD_PANGO_DEFAULT_DPI, GD_PANGO_DEFAULT_DPI,
+		GD_PANGO_QUALITY_NORMAL);
+	gdPangoContext *context = gdPangoNewContext(g_object_ref(shared->font_map));
+
+	gdPangoUseSharedMap(context, shared);
+	return context;
+}
+
+/**
+ * Free the font maps shared by the contexts of the calling thread.
+ *
+ * Shared font maps live as long as their thread and are freed when it
+ * exits. Threads living as long as the process, which drew with shared
+ * contexts or gdImageStringPangoFT, release them with this function once
+ * done with text. Maps still used by a shared context are kept.
+ */
+void gdPangoReleaseSharedMaps(void)
+{
+	GSList *maps = (GSList *)g_private_get(&gdPangoSharedMaps), *kept = NULL, *l;
+
+	for (l = maps; l; l = l->next) {
+		gdPangoSharedMap *shared = (gdPangoSharedMap *)l->data;
+
+		if (shared->users > 0) {
+			kept = g_slist_prepend(kept, shared);
+		} else {
+			gdPangoFreeSharedMap(shared);
+		}
+	}
+	g_slist_free(maps);
+	g_private_set(&gdPangoSharedMaps, kept);
+}
+
+/**
+ * Free a context.
+ *
+ * @param *context	Context to be freed
+ */
+void gdPangoFreeContext(gdPangoContext *context)
+{
+	gdPangoEnableStats(context, 0);
+	gdPangoUseSharedMap(context, NULL);
+	gdPangoFreeFTBitmap(context->ft2bmp);
+	gdPangoContextFreeMetrics(context);
+	gdPangoFreeScaled(context);
+	gdPangoFreeSDF(context);
+	gdPangoSetGlyphCache(context, NULL);
+	pango_glyph_string_free(context->glyphs);
+	g_free(context->scratch);
+	g_free(context->pending.text);
+	if (context->pending.attrs) {
+		pango_attr_list_unref(context->pending.attrs);
+	}
+	g_object_unref(context->layout);
+	pango_font_description_free(context->font_desc);
+	g_object_unref(context->context);
+	g_object_unref(context->font_map);
+	if (context->registry) {
+		gdPangoFreeFontRegistry(context->registry);
+	}
+	g_free(context);
+}
+
+/* milliseconds since start, start is moved to now */
+static double gdPangoElapsed(gint64 *start)
+{
+	gint64 now = g_get_monotonic_time();
+	double elapsed = (now - *start) / 1000.0;
+
+	*start = now;
+	return elapsed;
+}
+
+/* set up the layout to draw a sample with a font in a language */
+static void gdPangoWarmupLayout(PangoLayout *layout,
+	const PangoFontDescription *font_desc, PangoLanguage *language,
+	const char *sample)
+{
+	PangoAttrList *attrs = pango_attr_list_new();
+
+	pango_attr_list_insert(attrs, pango_attr_language_new(language));
+	pango_layout_set_attributes(layout, attrs);
+	pango_attr_list_unref(attrs);
+	pango_layout_set_font_description(layout, font_desc);
+	pango_layout_set_text(layout, sample, -1);
+}
+
+/*
+ * Test whether a font was matched for one of the families of a font
+ * description rather than substituted. Generic families always match.
+ */
+static int gdPangoFontHasFamily(PangoFont *font,
+	const PangoFontDescription *font_desc)
+{
+	static const char *const generic[] = {
+		"sans", "sans-serif", "serif", "monospace", "mono", "system-ui",
+		"cursive", "fantasy", NULL
+	};
+	const char *family = pango_font_description_get_family(font_desc);
+	FcPattern *pattern;
+	FcChar8 *name;
+	char **families;
+	int i, j, found = 0;
+
+	if (!family || !PANGO_IS_FC_FONT(font)) {
+		return 1;
+	}
+	pattern = pango_fc_font_get_pattern(PANGO_FC_FONT(font));
+	families = g_strsplit(family, ",", -1);
+	for (i = 0; families[i] && !found; i++) {
+		const char *requested = g_strstrip(families[i]);
+
+		for (j = 0; generic[j] && !found; j++) {
+			found = (g_ascii_strcasecmp(requested, generic[j]) == 0);
+		}
+		for (j = 0; !found &&
+			FcPatternGetString(pattern, FC_FAMILY, j, &name) == FcResultMatch; j++) {
+			found = (FcStrCmpIgnoreCase((const FcChar8 *)requested, name) == 0);
+		}
+	}
+	g_strfreev(families);
+	return found;
+}
+
+/**
+ * Warm up fonts before the first rendering.
+ *
+ * Does at once the work the first rendering would otherwise pay for:
+ * loading the fontconfig configuration and font caches, matching the
+ * fonts and opening their faces, building the fallback font sets of
+ * each language and shaping the samples, then rasterizing their
+ * glyphs. The fontconfig state is shared by the process; fonts, font
+ * sets and glyphs are cached in the font map of context, which must
+ * be the context to be used afterwards. A font is reported as not
+ * found when fontconfig substitutes another family for it.
+ *
+ * @param *context	Context to warm up, or NULL to warm up the font map
+ *						shared by the contexts of the calling thread (see
+ *						gdPangoCreateSharedContext)
+ * @param **fonts		NULL-terminated font descriptions, as
+ *						"Sans Bold 12". NULL means the font of context.
+ * @param **languages	NULL-terminated RFC-3066 language tags. NULL means
+ *						the language of context.
+ * @param **samples	NULL-terminated utf-8 texts to shape and render, may
+ *						be NULL
+ * @param *times		output of the time spent by each phase, may be NULL
+ * @return GD_SUCCESS on success, GD_FAILURE if a font was not found.
+ */
+int gdPangoWarmup(gdPangoContext *context, const char **fonts,
+	const char **languages, const char **samples, gdPangoWarmupTimes *times)
+{
+	gdPangoContext *own = NULL;
+	gdPangoWarmupTimes elapsed;
+	PangoFontDescription **descs;
+	PangoLanguage **langs;
+	PangoLayout *layout;
+	FT_Bitmap *bitmap;
+	gint64 start = g_get_monotonic_time();
+	int i, j, k, n_fonts, n_langs, result = GD_SUCCESS;
+
+	FcInit();
+	elapsed.fontconfig = gdPangoElapsed(&start);
+
+	if (!context) {
+		context = own = gdPangoCreateSharedContext();
+	}
+	for (n_fonts = 0; fonts && fonts[n_fonts]; n_fonts++);
+	descs = g_new(PangoFontDescription *, MAX(n_fonts, 1));
+	if (!fonts) {
+		descs[0] = pango_font_description_copy(context->font_desc);
+		n_fonts = 1;
+	}
+	for (i = 0; i < n_fonts; i++) {
+		PangoFont *font;
+
+		if (fonts) {
+			descs[i] = pango_font_description_from_string(fonts[i]);
+		}
+		font = pango_context_load_font(context->context, descs[i]);
+		if (!font) {
+			result = GD_FAILURE;
+			continue;
+		}
+		if (!gdPangoFontHasFamily(font, descs[i])) {
+			/* the substitute is still warmed, it is what will be drawn */
+			result = GD_FAILURE;
+		}
+		/* the face is opened lazily */
+		if (PANGO_IS_FC_FONT(font)) {
+			pango_fc_font_lock_face(PANGO_FC_FONT(font));
+			pango_fc_font_unlock_face(PANGO_FC_FONT(font));
+		}
+		g_object_unref(font);
+		gdPangoContextMetrics(context, descs[i]);
+	}
+	elapsed.fonts = gdPangoElapsed(&start);
+
+	for (n_langs = 0; languages && languages[n_langs]; n_langs++);
+	langs = g_new(PangoLanguage *, MAX(n_langs, 1));
+	if (!languages) {
+		langs[0] = pango_context_get_language(context->context);
+		n_langs = 1;
+	}
+	for (j = 0; languages && j < n_langs; j++) {
+		langs[j] = pango_language_from_string(languages[j]);
+	}
+	layout = pango_layout_new(context->context);
+	for (i = 0; i < n_fonts; i++) {
+		for (j = 0; j < n_langs; j++) {
+			PangoFontset *fontset = pango_context_load_fontset(context->context,
+				descs[i], langs[j]);
+
+			if (fontset) {
+				g_object_unref(fontset);
+			}
+			for (k = 0; samples && samples[k]; k++) {
+				gdPangoWarmupLayout(layout, descs[i], langs[j], samples[k]);
+				pango_layout_get_extents(layout, NULL, NULL);
+			}
+		}
+	}
+	elapsed.fallback = gdPangoElapsed(&start);
+
+	bitmap = gdPangoCreateFTBitmap(1, 1);
+	for (i = 0; i < n_fonts; i++) {
+		for (j = 0; j < n_langs; j++) {
+			for (k = 0; samples && samples[k]; k++) {
+				PangoRectangle ink_rect;
+
+				gdPangoWarmupLayout(layout, descs[i], langs[j], samples[k]);
+				pango_layout_get_pixel_extents(layout, &ink_rect, NULL);
+				if (ink_rect.width > 0 && ink_rect.height > 0) {
+					gdPangoModifyFTBitmap(bitmap, ink_rect.width, ink_rect.height);
+					pango_ft2_render_layout(bitmap, layout, -ink_rect.x, -ink_rect.y);
+				}
+			}
+		}
+	}
+	gdPangoFreeFTBitmap(bitmap);
+	elapsed.render = gdPangoElapsed(&start);
+
+	g_object_unref(layout);
+	for (i = 0; i < n_fonts; i++) {
+		pango_font_description_free(descs[i]);
+	}
+	g_free(descs);
+	g_free(langs);
+	if (own) {
+		gdPangoFreeContext(own);
+	}
+	if (times) {
+		*times = elapsed;
+	}
+	return result;
+}
+
+struct gdPangoWarmupTask {
+	GThread *thread;
+	gdPangoContext *context;
+	char **fonts;
+	char **languages;
+	char **samples;
+	gdPangoWarmupTimes times;
+	int result;
+};
+
+static char **gdPangoCopyStrings(const char **strings)
+{
+	char **copy;
+	int i, n;
+
+	if (!strings) {
+		return NULL;
+	}
+	for (n = 0; strings[n]; n++);
+	copy = g_new(char *, n + 1);
+	for (i = 0; i < n; i++) {
+		copy[i] = g_strdup(strings[i]);
+	}
+	copy[n] = NULL;
+	return copy;
+}
+
+static void gdPangoFreeStrings(char **strings)
+{
+	int i;
+
+	for (i = 0; strings && strings[i]; i++) {
+		g_free(strings[i]);
+	}
+	g_free(strings);
+}
+
+static gpointer gdPangoWarmupThread(gpointer data)
+{
+	gdPangoWarmupTask *task = (gdPangoWarmupTask *)data;
+	gdPangoContext *own = NULL;
+
+	/* the shared maps of this thread would die with it */
+	if (!task->context) {
+		own = gdPangoCreateContext();
+	}
+	task->result = gdPangoWarmup(task->context ? task->context : own,
+		(const char **)task->fonts, (const char **)task->languages,
+		(const char **)task->samples, &task->times);
+	if (own) {
+		gdPangoFreeContext(own);
+	}
+	return NULL;
+}
+
+/**
+ * Warm up fonts on a background thread.
+ *
+ * Runs gdPangoWarmup on a new thread. The context must not be used
+ * until gdPangoWarmupJoin returns; the arrays are copied. Shared
+ * contexts are refused: their font map belongs to the thread which
+ * created them and must not be used by another one. Warm them up with
+ * gdPangoWarmup on their own thread. Without a context, only what the
+ * process shares (the fontconfig configuration and caches) is warmed.
+ *
+ * @param *context	Context to warm up, or NULL
+ * @param **fonts		NULL-terminated font descriptions, or NULL
+ * @param **languages	NULL-terminated language tags, or NULL
+ * @param **samples	NULL-terminated utf-8 texts, or NULL
+ * @return The task, to be given to gdPangoWarmupJoin, or NULL if context
+ *			is a shared context.
+ */
+gdPangoWarmupTask* gdPangoWarmupStart(gdPangoContext *context,
+	const char **fonts, const char **languages, const char **samples)
+{
+	gdPangoWarmupTask *task;
+
+	if (context && context->shared) {
+		return NULL;
+	}
+	task = g_new(gdPangoWarmupTask, 1);
+
+	task->context = context;
+	task->fonts = gdPangoCopyStrings(fonts);
+	task->languages = gdPangoCopyStrings(languages);
+	task->samples = gdPangoCopyStrings(samples);
+	task->thread = g_thread_try_new("gd-pango-warmup", gdPangoWarmupThread, task, NULL);
+	if (!task->thread) {
+		/* no thread, warm up now */
+		gdPangoWarmupThread(task);
+	}
+	return task;
+}
+
+/**
+ * Wait for the end of a background warm-up.
+ *
+ * @param *task	Task of gdPangoWarmupStart, freed by this call
+ * @param *times	output of the time spent by each phase, may be NULL
+ * @return The result of gdPangoWarmup.
+ */
+int gdPangoWarmupJoin(gdPangoWarmupTask *task, gdPangoWarmupTimes *times)
+{
+	int result;
+
+	if (task->thread) {
+		g_thread_join(task->thread);
+	}
+	if (times) {
+		*times = task->times;
+	}
+	result = task->result;
+	gdPangoFreeStrings(task->fonts);
+	gdPangoFreeStrings(task->languages);
+	gdPangoFreeStrings(task->samples);
+	g_free(task);
+	return result;
+}
+
+/*!
+    Create a surface and draw text on it.
+    The size of surface is same as layout size.
+
+    @param *context [in] Context
+    @return A newly created surface
+*/
+gdImagePtr gdPangoCreateSurfaceDraw(gdPangoContext *context)
+{
+	gdImagePtr surface = NULL;
+
+	surface = gdPangoRenderTo(context, surface, 0, 0);
+	return surface;
+}
+
+/*
+ * Grow box, in layout pixels, to the underlines drawn below the runs,
+ * which are outside of the ink extents of Pango.
+ */
+static void gdPangoDecorationBox(gdPangoContext *context, gdRect *box)
+{
+	PangoLayoutIter *iter;
+
+	/* only attributes underline */
+	if (!pango_layout_get_attributes(context->layout)) {
+		return;
+	}
+	iter = pango_layout_get_iter(context->layout);
+	do {
+		PangoLayoutRun *run = pango_layout_iter_get_run_readonly(iter);
+		PangoUnderline uline = PANGO_UNDERLINE_NONE;
+		gboolean strike, fg_set, bg_set, shape_set;
+		PangoColor fg_color, bg_color;
+		PangoRectangle ink_rect, logical_rect, run_ink_rect;
+		gint rise, risen_y, x0, x1, y0, y1;
+
+		if (!run) {
+			continue;
+		}
+		gdPangoGetItemProperties(run->item,
+			&uline, &strike, &rise,
+			&fg_color, &fg_set, &bg_color, &bg_set,
+			&shape_set, &ink_rect, &logical_rect);
+		if (uline == PANGO_UNDERLINE_NONE) {
+			continue;
+		}
+		pango_layout_iter_get_run_extents(iter, &run_ink_rect, NULL);
+		risen_y = PANGO_PIXELS(pango_layout_iter_get_baseline(iter)) - PANGO_PIXELS(rise);
+		if (uline == PANGO_UNDERLINE_LOW) {
+			pango_glyph_string_extents(run->glyphs, run->item->analysis.font,
+				&ink_rect, NULL);
+			y0 = y1 = risen_y + PANGO_PIXELS(ink_rect.y + ink_rect.height);
+		} else {
+			y0 = risen_y + 2;
+			y1 = risen_y + GD_PANGO_DECORATION_MARGIN;
+		}
+		/* the error underline starts one pixel to the left */
+		x0 = PANGO_PIXELS(run_ink_rect.x) - 1;
+		x1 = PANGO_PIXELS(run_ink_rect.x + run_ink_rect.width);
+		gdPangoRectUnion(box, x0, y0, x1 - x0 + 1, y1 - y0 + 1);
+	} while (pango_layout_iter_next_run(iter));
+	pango_layout_iter_free(iter);
+}
+
+/**
+ * Create a surface trimmed to the ink of the text and draw on it.
+ *
+ * The surface is sized from the ink extents of the layout instead of its
+ * logical extents, so empty line gaps are dropped and overhanging ink is
+ * not clipped. Underlines and the room of the halo and shadow of the
+ * context are included. The surface is allocated once and the text is
+ * rendered at the matching offset, no crop is required afterwards.
+ * Rotated layouts are sized as with gdPangoCreateSurfaceDraw.
+ *
+ * @param *context	Context
+ * @param padding		Margin in pixels added on each side of the ink
+ * @param *origin		Position of the layout top-left corner on the new
+ *							surface; simply ignored if origin = NULL
+ * @return A newly created surface
+ */
+gdImagePtr gdPangoCreateSurfaceDrawInk(gdPangoContext *context,
+	int padding, gdPointPtr origin)
+{
+	PangoRectangle ink_rect;
+	gdRect box;
+	gdImagePtr surface;
+	int x, y, width, height;
+
+	if (pango_context_get_matrix(context->context) != NULL) {
+		if (origin) {
+			origin->x = 0;
+			origin->y = 0;
+		}
+		return gdPangoCreateSurfaceDraw(context);
+	}
+
+	if (padding < 0) {
+		padding = 0;
+	}
+
+	gdPangoGetExtents(context, &ink_rect, NULL);
+	pango_extents_to_pixels(&ink_rect, NULL);
+	box.x = ink_rect.x;
+	box.y = ink_rect.y;
+	box.width = ink_rect.width;
+	box.height = ink_rect.height;
+	gdPangoDecorationBox(context, &box);
+	padding += gdPangoEffectsMargin(context);
+
+	width = MAX(box.width + 2 * padding, 1);
+	height = MAX(box.height + 2 * padding, 1);
+
+	surface = gdImageCreateTrueColor(width, height);
+	if (!surface) {
+		return NULL;
+	}
+
+	x = padding - box.x;
+	y = padding - box.y;
+	gdPangoRenderTo(context, surface, x, y);
+
+	if (origin) {
+		origin->x = x;
+		origin->y = y;
+	}
+	return surface;
+}
+
+/* count the lines, runs and glyphs of a layout rendered at once */
+static void gdPangoCountLayout(gdPangoContext *context, PangoLayout *layout)
+{
+	GSList *lines, *runs;
+
+	for (lines = pango_layout_get_lines_readonly(layout); lines; lines = lines->next) {
+		GD_PANGO_STAT(context, lines, 1);
+		for (runs = ((PangoLayoutLine *)lines->data)->runs; runs; runs = runs->next) {
+			GD_PANGO_STAT(context, runs, 1);
+			GD_PANGO_STAT(context, glyphs, ((PangoLayoutRun *)runs->data)->glyphs->num_glyphs);
+		}
+	}
+}
+
+/**
+ * Render the text to the given image.
+ *
+ * Render the text to the given image. The (x,y) coordinate set the top
+ * left corner of the text rectangle.
+ *
+ * @param *context	Context
+ * @param *surface	Surface to draw on it
+ * @param x				X of left-top of drawing area
+ * @param y				Y of left-top of drawing area
+ */
+gdImagePtr gdPangoRenderTo(gdPangoContext *context, gdImage* surface, int x, int y)
+{
+	return gdPangoRenderToWithDamage(context, surface, x, y, NULL);
+}
+
+/**
+ * Render the text to the given image and report the changed area.
+ *
+ * Same as gdPangoRenderTo. In addition the union rectangle of the pixels
+ * actually written (glyphs and decorations) is stored in damage. It is
+ * collected during the blit and clipped to the surface; an empty
+ * rectangle (zero width and height) means nothing was written.
+ *
+ * @param *context	Context
+ * @param *surface	Surface to draw on it
+ * @param x				X of left-top of drawing area
+ * @param y				Y of left-top of drawing area
+ * @param *damage		output of the written area; simply ignored if
+ *							damage = NULL
+ */
+gdImagePtr gdPangoRenderToWithDamage(gdPangoContext *context, gdImage* surface,
+	int x, int y, gdRectPtr damage)
+{
+	PangoRectangle logical_rect, brect;
+	int rotated;
+	double angle = 0;
+	int new_w, new_h;
+	gint64 start = gdPangoStatsClock(context);
+
+	if (damage) {
+		damage->x = damage->y = 0;
+		damage->width = damage->height = 0;
+	}
+
+	gdPangoGetExtents(context, NULL, &logical_rect);
+	GD_PANGO_STAT(context, layout_time, gdPangoStatsClock(context) - start);
+
+	brect = logical_rect; /* copy in pango units */
+	pango_extents_to_pixels (&logical_rect, NULL);
+
+	rotated = (pango_context_get_matrix(context->context) != NULL);
+
+	/* check if a matrix has been used
+	 * NB: other transformations are not supported yet. GD2 Renderer class
+	 * is required.
+	 */
+	if (rotated) {
+		angle = context->angle * G_PI/180;
+
+		pango_matrix_transform_rectangle (
+				pango_context_get_matrix(context->context),
+				&brect);
+		pango_extents_to_pixels (&brect, NULL);
+		new_w = brect.width;
+		new_h = brect.height;
+
+		/* Right aligned rotated layout has different widths than the same contents
+		 * but left aligned
+		if (pango_layout_get_alignment(context->layout) != PANGO_ALIGN_LEFT) {
+			new_w = abs(sin(angle) * logical_rect.height + cos(angle) * logical_rect.width);
+		};
+		 */
+	} else {
+		new_w = logical_rect.width;
+		new_h = logical_rect.height;
+	}
+
+	if (!surface) {
+		surface = gdImageCreateTrueColor(new_w, new_h);
+		if (!surface) {
+			return NULL;
+		}
+	}
+
+	if (rotated) {
+		int layout_x = 0, layout_y = 0;
+		gdRect rect;
+
+		/* the whole transformed layout is rendered at once */
+		if (context->ft2bmp) {
+			int cleared = gdPangoModifyFTBitmap(context->ft2bmp, new_w, new_h);
+
+			GD_PANGO_STAT(context, memset_bytes, cleared);
+		} else {
+			context->ft2bmp = gdPangoCreateFTBitmap(new_w, new_h);
+		}
+
+		angle = fmod(angle, 2*G_PI);
+		angle = angle > G_PI ? angle - 2*G_PI : angle;
+		if (angle > 0. && angle < G_PI/2) {
+			layout_x =  brect.y * sin(angle);
+			layout_y = -brect.y * cos(angle);
+		} else if (angle >= -G_PI/2 && angle <= 0.) {
+			layout_x =  -brect.x * cos(angle);
+			layout_y =  -brect.x * sin(angle);
+		} else if (angle >= G_PI/2 && angle <= G_PI) {
+			layout_x = -logical_rect.width + logical_rect.height * cos(angle) * sin(angle);
+			layout_y = -logical_rect.height * cos(angle) * cos(angle);
+		} else if (angle >= -G_PI && angle < -G_PI/2) {
+			layout_x = -logical_rect.width * cos(angle) * cos(angle);
+			layout_y = -logical_rect.height - (logical_rect.width * cos(angle) * sin(angle));
+		} else {
+			fprintf(stderr, "angle %f not handled\n", angle * 180/G_PI);
+		}
+		
+		rect.x = x + brect.x;
+		rect.y = y + brect.y;
+		rect.width = new_w;
+		rect.height = new_h;
+
+		start = gdPangoStatsClock(context);
+		pango_ft2_render_layout(context->ft2bmp, context->layout, layout_x, layout_y);
+		if (context->stats) {
+			gint64 now = gdPangoStatsClock(context);
+			int pixels;
+
+			context->stats->raster_time += now - start;
+			gdPangoCountLayout(context, context->layout);
+			pixels = gdPangoBlitText(context, context->ft2bmp, surface,
+				&context->default_colors, &rect, damage);
+			context->stats->blit_time += gdPangoStatsClock(context) - now;
+			context->stats->pixels += pixels;
+		} else {
+			gdPangoBlitText(context, context->ft2bmp, surface, &context->default_colors, &rect, damage);
+		}
+	} else {
+		gdPangoTarget target;
+
+		target.surface = surface;
+		target.x = x;
+		target.y = y;
+		target.damage = damage;
+		gdPangoRenderLayout(context, context->layout, &target, 1);
+	}
+	if (context->stats) {
+		gdPangoFlushStats(context);
+	}
+	return surface;
+}
+
+/**
+ * Render the text across a grid of tiles.
+ *
+ * The layout is shaped once and each run is rasterized once; every tile
+ * it crosses receives its own slice of the same coverage, so label
+ * seams match exactly across tile boundaries. Tiles are given row by
+ * row, tile (column, row) covers the grid pixels starting at
+ * (column * tile_width, row * tile_height). NULL tiles are skipped.
+ * Rotated layouts are not supported.
+ *
+ * @param *context	Context
+ * @param *tiles		columns * rows surfaces, row by row
+ * @param columns		Number of tile columns
+ * @param rows			Number of tile rows
+ * @param tile_width	Width of a tile
+ * @param tile_height	Height of a tile
+ * @param x				X of left-top of the text in grid pixels
+ * @param y				Y of left-top of the text in grid pixels
+ * @param *damages	columns * rows written areas, in tile coordinates;
+ *							simply ignored if damages = NULL
+ * @return GD_SUCCESS on success, otherwise GD_FAILURE.
+ */
+int gdPangoRenderTiles(gdPangoContext *context, gdImagePtr *tiles,
+	int columns, int rows, int tile_width, int tile_height,
+	int x, int y, gdRectPtr damages)
+{
+	PangoRectangle ink_rect, logical_rect;
+	gdPangoTarget *targets;
+	gdRect text_rect;
+	int row, column, margin, n_targets = 0;
+
+	if (!tiles || columns <= 0 || rows <= 0 || tile_width <= 0 || tile_height <= 0) {
+		return GD_FAILURE;
+	}
+	if (pango_context_get_matrix(context->context) != NULL) {
+		return GD_FAILURE;
+	}
+
+	gdPangoGetExtents(context, &ink_rect, &logical_rect);
+	gdPangoExtentsBox(&ink_rect, &logical_rect, &text_rect);
+	text_rect.x += x;
+	text_rect.y += y;
+	text_rect.height += GD_PANGO_DECORATION_MARGIN;
+	margin = gdPangoEffectsMargin(context);
+	text_rect.x -= margin;
+	text_rect.y -= margin;
+	text_rect.width += 2 * margin;
+	text_rect.height += 2 * margin;
+
+	targets = g_new(gdPangoTarget, columns * rows);
+	for (row = 0; row < rows; row++) {
+		for (column = 0; column < columns; column++) {
+			int i = row * columns + column;
+			gdRect tile_rect;
+
+			if (damages) {
+				damages[i].x = damages[i].y = 0;
+				damages[i].width = damages[i].height = 0;
+			}
+
+			tile_rect.x = column * tile_width;
+			tile_rect.y = row * tile_height;
+			tile_rect.width = tile_width;
+			tile_rect.height = tile_height;
+			if (!tiles[i] || !gdPangoIntersectRect(&tile_rect, &text_rect, NULL)) {
+				continue;
+			}
+
+			targets[n_targets].surface = tiles[i];
+			targets[n_targets].x = x - tile_rect.x;
+			targets[n_targets].y = y - tile_rect.y;
+			targets[n_targets].damage = damages ? &damages[i] : NULL;
+			n_targets++;
+		}
+	}
+
+	if (n_targets > 0) {
+		gdPangoRenderLayout(context, context->layout, targets, n_targets);
+	}
+	g_free(targets);
+	if (context->stats) {
+		gdPangoFlushStats(context);
+	}
+
+	return GD_SUCCESS;
+}
+
+/**
+ * Render the text in fixed height row bands.
+ *
+ * The text is rendered as gdPangoCreateSurfaceDraw would, but only one
+ * band of band_height rows is kept in memory at a time. Each band is
+ * drawn from the lines intersecting it only, then passed to callback
+ * in top to bottom order; it is cleared and reused for the next band,
+ * copy it if it has to be kept. This fits row by row encoders for very
+ * tall images. Rotated layouts are not supported.
+ *
+ * @param *context	Context
+ * @param band_height	Height of a band in pixels
+ * @param callback	Called for each band with the band surface, the Y
+ *							of its first row in the whole image, the number
+ *							of valid rows (the last band may be shorter) and
+ *							user_data. Return GD_SUCCESS to continue.
+ * @param *user_data	Passed to callback
+ * @return GD_SUCCESS on success, otherwise GD_FAILURE.
+ */
+int gdPangoRenderBands(gdPangoContext *context, int band_height,
+	gdPangoBandCallback callback, void *user_data)
+{
+	PangoRectangle logical_rect;
+	PangoLayoutIter *iter;
+	gdPangoTarget target;
+	gdImagePtr band;
+	int band_y, more, r = GD_SUCCESS;
+
+	if (band_height <= 0 || !callback) {
+		return GD_FAILURE;
+	}
+	if (pango_context_get_matrix(context->context) != NULL) {
+		return GD_FAILURE;
+	}
+
+	pango_layout_get_pixel_extents(context->layout, NULL, &logical_rect);
+	if (logical_rect.width <= 0 || logical_rect.height <= 0) {
+		return GD_FAILURE;
+	}
+
+	band = gdImageCreateTrueColor(logical_rect.width, band_height);
+	if (!band) {
+		return GD_FAILURE;
+	}
+
+	target.surface = band;
+	target.x = 0;
+	target.damage = NULL;
+
+	iter = pango_layout_get_iter(context->layout);
+	more = 1;
+	for (band_y = 0; band_y < logical_rect.height; band_y += band_height) {
+		gdRect bounds;
+
+		if (band_y > 0) {
+			gdImageAlphaBlending(band, 0);
+			gdImageFilledRectangle(band, 0, 0, gdImageSX(band) - 1, band_height - 1, 0);
+			gdImageAlphaBlending(band, 1);
+		}
+
+		/* drop the lines ending above this band, they are done */
+		while (more) {
+			gdRect line_rect;
+
+			if (gdPangoLineBox(context, iter, &line_rect) &&
+				line_rect.y + line_rect.height > band_y) {
+				break;
+			}
+			more = pango_layout_iter_next_line(iter);
+		}
+
+		target.y = -band_y;
+		if (more && gdPangoTargetsBounds(&target, 1, &bounds)) {
+			PangoLayoutIter *band_iter = pango_layout_iter_copy(iter);
+
+			gdPangoRenderLines(context, band_iter, &target, 1, &bounds);
+			pango_layout_iter_free(band_iter);
+		}
+
+		if (callback(band, band_y, MIN(band_height, logical_rect.height - band_y),
+				user_data) != GD_SUCCESS) {
+			r = GD_FAILURE;
+			break;
+		}
+	}
+
+	pango_layout_iter_free(iter);
+	gdImageDestroy(band);
+	if (context->stats) {
+		gdPangoFlushStats(context);
+	}
+	return r;
+}
+
+/*
+ * Get the context rendering at scale, created on first use. It has its
+ * own font map at the scaled resolution, so fonts, fallbacks and glyphs
+ * are cached per scale.
+ */
+static gdPangoContext *gdPangoScaledContext(gdPangoContext *context,
+	double scale)
+{
+	gdPangoScaled *scaled;
+	GSList *l;
+
+	for (l = context->scaled; l; l = l->next) {
+		scaled = (gdPangoScaled *)l->data;
+		if (scaled->scale == scale) {
+			return scaled->context;
+		}
+	}
+
+	scaled = (gdPangoScaled *)g_malloc(sizeof(gdPangoScaled));
+	scaled->scale = scale;
+	if (context->registry) {
+		/* the fonts of the registry only */
+		scaled->context = gdPangoCreateRegistryContext(context->registry);
+	} else if (context->shared) {
+		scaled->context = gdPangoCreateSharedContext();
+	} else {
+		scaled->context = gdPangoCreateContext();
+	}
+	gdPangoSetQuality(scaled->context, context->quality);
+	gdPangoSetDpi(scaled->context, context->dpi_x * scale, context->dpi_y * scale);
+	pango_context_set_language(scaled->context->context,
+		pango_context_get_language(context->context));
+	context->scaled = g_slist_prepend(context->scaled, scaled);
+	return scaled->context;
+}
+
+/* scale the attributes given in device units */
+static gboolean gdPangoScaleAttr(PangoAttribute *attr, gpointer data)
+{
+	double scale = *(double *)data;
+
+	switch (attr->klass->type) {
+		case PANGO_ATTR_RISE:
+		case PANGO_ATTR_LETTER_SPACING:
+			((PangoAttrInt *)attr)->value *= scale;
+			break;
+
+		case PANGO_ATTR_ABSOLUTE_SIZE:
+			((PangoAttrSize *)attr)->size *= scale;
+			break;
+
+		case PANGO_ATTR_SHAPE:
+		{
+			PangoAttrShape *shape = (PangoAttrShape *)attr;
+
+			shape->ink_rect.x *= scale;
+			shape->ink_rect.y *= scale;
+			shape->ink_rect.width *= scale;
+			shape->ink_rect.height *= scale;
+			shape->logical_rect.x *= scale;
+			shape->logical_rect.y *= scale;
+			shape->logical_rect.width *= scale;
+			shape->logical_rect.height *= scale;
+		}
+			break;
+
+		default:
+			break;
+	}
+	return FALSE;
+}
+
+/*
+ * Set the text, the layout settings, the effects and the glyph cache of
+ * context to a scaled context, sizes in device units are scaled.
+ */
+static void gdPangoCopyScaled(gdPangoContext *scaled, gdPangoContext *context,
+	double scale)
+{
+	PangoLayout *src = context->layout;
+	PangoLayout *dst = scaled->layout;
+	const PangoFontDescription *font_desc;
+	PangoAttrList *attrs;
+	int width;
+
+	font_desc = pango_layout_get_font_description(src);
+	pango_font_description_free(scaled->font_desc);
+	scaled->font_desc = pango_font_description_copy(font_desc ? font_desc : context->font_desc);
+	if (pango_font_description_get_size_is_absolute(scaled->font_desc)) {
+		pango_font_description_set_absolute_size(scaled->font_desc,
+			pango_font_description_get_size(scaled->font_desc) * scale);
+	}
+
+	attrs = pango_layout_get_attributes(src);
+	if (attrs) {
+		attrs = pango_attr_list_copy(attrs);
+		pango_attr_list_filter(attrs, gdPangoScaleAttr, &scale);
+	}
+
+	pango_context_set_base_dir(scaled->context,
+		pango_context_get_base_dir(context->context));
+	pango_layout_set_text(dst, pango_layout_get_text(src), -1);
+	pango_layout_set_attributes(dst, attrs);
+	pango_layout_set_font_description(dst, scaled->font_desc);
+	pango_layout_set_auto_dir(dst, pango_layout_get_auto_dir(src));
+	pango_layout_set_alignment(dst, pango_layout_get_alignment(src));
+	pango_layout_set_wrap(dst, pango_layout_get_wrap(src));
+	pango_layout_set_justify(dst, pango_layout_get_justify(src));
+	pango_layout_set_ellipsize(dst, pango_layout_get_ellipsize(src));
+	pango_layout_set_single_paragraph_mode(dst,
+		pango_layout_get_single_paragraph_mode(src));
+	width = pango_layout_get_width(src);
+	pango_layout_set_width(dst, width < 0 ? -1 : (int)(width * scale));
+	pango_layout_set_indent(dst, pango_layout_get_indent(src) * scale);
+	pango_layout_set_spacing(dst, pango_layout_get_spacing(src) * scale);
+
+	if (attrs) {
+		pango_attr_list_unref(attrs);
+	}
+
+	scaled->default_colors = context->default_colors;
+	scaled->min_width = context->min_width * scale;
+	scaled->min_height = context->min_height * scale;
+
+	scaled->effects = context->effects;
+	scaled->effects.halo_radius = (int)floor(context->effects.halo_radius * scale + 0.5);
+	scaled->effects.shadow_dx = (int)floor(context->effects.shadow_dx * scale + 0.5);
+	scaled->effects.shadow_dy = (int)floor(context->effects.shadow_dy * scale + 0.5);
+	scaled->effects.shadow_radius = (int)floor(context->effects.shadow_radius * scale + 0.5);
+	if (scaled->glyph_cache != context->glyph_cache) {
+		gdPangoSetGlyphCache(scaled, context->glyph_cache);
+	}
+}
+
+/**
+ * Render the text at several scales.
+ *
+ * Each scale is laid out, hinted and rasterized at its own resolution
+ * (the DPI of context times the scale), as with gdPangoSetDpi, but
+ * without touching the layout of context: every scale keeps its own
+ * layout and font map between calls, so fonts, fallbacks and glyph
+ * caches are built once per scale. Attributes, layout settings and
+ * effects in device units (width, indent, rise, halo radius, ...) are
+ * scaled; the glyph cache of context is used at every scale. Contexts
+ * of a font registry render every scale with the registered fonts.
+ * Rotated layouts are not supported.
+ *
+ * @param *context	Context
+ * @param *scales		Scale factors, ie. 1, 2 and 3, all above zero
+ * @param n_scales	Number of scales
+ * @param *surfaces	output of n_scales newly created surfaces, sized as
+ *							gdPangoCreateSurfaceDraw would at each scale
+ * @return GD_SUCCESS on success, otherwise GD_FAILURE.
+ */
+int gdPangoRenderScales(gdPangoContext *context, const double *scales,
+	int n_scales, gdImagePtr *surfaces)
+{
+	int i;
+
+	if (!scales || !surfaces || n_scales <= 0) {
+		return GD_FAILURE;
+	}
+	if (pango_context_get_matrix(context->context) != NULL) {
+		return GD_FAILURE;
+	}
+	for (i = 0; i < n_scales; i++) {
+		if (scales[i] <= 0) {
+			return GD_FAILURE;
+		}
+	}
+
+	for (i = 0; i < n_scales; i++) {
+		gdPangoContext *scaled;
+
+		scaled = gdPangoScaledContext(context, scales[i]);
+		gdPangoCopyScaled(scaled, context, scales[i]);
+		surfaces[i] = gdPangoCreateSurfaceDraw(scaled);
+		if (!surfaces[i]) {
+			break;
+		}
+	}
+
+	if (i < n_scales) {
+		while (--i >= 0) {
+			gdImageDestroy(surfaces[i]);
+			surfaces[i] = NULL;
+		}
+		return GD_FAILURE;
+	}
+	return GD_SUCCESS;
+}
+
+/*
+ * Skyline rectangle packer. The skyline is the top edge of the packed
+ * area, as segments from left to right; each rectangle is placed where
+ * its top is the lowest (bottom-left rule).
+ */
+typedef struct {
+	int x;
+	int y;
+	int width;
+} gdPangoSkylineSegment;
+
+typedef struct {
+	int width;
+	int height;  /* used height */
+	int n;
+	gdPangoSkylineSegment *segments;
+} gdPangoSkyline;
+
+static void gdPangoSkylineInit(gdPangoSkyline *skyline, int width)
+{
+	skyline->width = width;
+	skyline->height = 0;
+	skyline->n = 1;
+	skyline->segments = g_new(gdPangoSkylineSegment, 1);
+	skyline->segments[0].x = 0;
+	skyline->segments[0].y = 0;
+	skyline->segments[0].width = width;
+}
+
+static void gdPangoSkylineFree(gdPangoSkyline *skyline)
+{
+	g_free(skyline->segments);
+}
+
+/*
+ * Place a width x height rectangle, max_height bounds the packed area
+ * (-1 for none). Returns zero if it does not fit.
+ */
+static int gdPangoSkylinePack(gdPangoSkyline *skyline, int width, int height,
+	int max_height, int *x, int *y)
+{
+	gdPangoSkylineSegment *seg = skyline->segments;
+	int i, j, best = -1, best_y = 0, best_width = 0;
+
+	if (width > skyline->width) {
+		return 0;
+	}
+
+	for (i = 0; i < skyline->n; i++) {
+		int top = 0, left = width;
+
+		if (seg[i].x + width > skyline->width) {
+			break;
+		}
+		/* the rectangle rests on the highest segment it spans */
+		for (j = i; j < skyline->n && left > 0; j++) {
+			top = MAX(top, seg[j].y);
+			left -= seg[j].width;
+		}
+		if (max_height >= 0 && top + height > max_height) {
+			continue;
+		}
+		if (best < 0 || top < best_y || (top == best_y && seg[i].width < best_width)) {
+			best = i;
+			best_y = top;
+			best_width = seg[i].width;
+		}
+	}
+	if (best < 0) {
+		return 0;
+	}
+
+	*x = seg[best].x;
+	*y = best_y;
+	skyline->height = MAX(skyline->height, best_y + height);
+	if (width == 0) {
+		return 1;
+	}
+
+	/* insert the new segment, then cut the ones it covers */
+	skyline->segments = seg = g_renew(gdPangoSkylineSegment, seg, skyline->n + 1);
+	memmove(&seg[best + 1], &seg[best], (skyline->n - best) * sizeof(*seg));
+	skyline->n++;
+	seg[best].x = *x;
+	seg[best].y = best_y + height;
+	seg[best].width = width;
+
+	for (i = best + 1; i < skyline->n; ) {
+		int shrink = seg[best].x + seg[best].width - seg[i].x;
+
+		if (shrink <= 0) {
+			break;
+		}
+		if (shrink < seg[i].width) {
+			seg[i].x += shrink;
+			seg[i].width -= shrink;
+			break;
+		}
+		memmove(&seg[i], &seg[i + 1], (skyline->n - i - 1) * sizeof(*seg));
+		skyline->n--;
+	}
+
+	/* merge neighbours at the same height */
+	for (i = 0; i + 1 < skyline->n; ) {
+		if (seg[i].y == seg[i + 1].y) {
+			seg[i].width += seg[i + 1].width;
+			memmove(&seg[i + 1], &seg[i + 2], (skyline->n - i - 2) * sizeof(*seg));
+			skyline->n--;
+		} else {
+			i++;
+		}
+	}
+	return 1;
+}
+
+/* create a transparent surface for packed images */
+static gdImagePtr gdPangoCreateSheet(int width, int height)
+{
+	gdImagePtr sheet = gdImageCreateTrueColor(MAX(width, 1), MAX(height, 1));
+
+	if (!sheet) {
+		return NULL;
+	}
+	gdImageAlphaBlending(sheet, 0);
+	gdImageFilledRectangle(sheet, 0, 0, gdImageSX(sheet) - 1, gdImageSY(sheet) - 1,
+		gdTrueColorAlpha(0, 0, 0, gdAlphaTransparent));
+	gdImageAlphaBlending(sheet, 1);
+	gdImageSaveAlpha(sheet, 1);
+	return sheet;
+}
+
+static int gdPangoCompareAtlasHeight(const void *a, const void *b)
+{
+	const gdPangoAtlasGlyph *g1 = *(const gdPangoAtlasGlyph * const *)a;
+	const gdPangoAtlasGlyph *g2 = *(const gdPangoAtlasGlyph * const *)b;
+
+	if (g1->height != g2->height) {
+		return g2->height - g1->height;
+	}
+	return g2->width - g1->width;
+}
+
+static int gdPangoCompareAtlasGlyph(const void *a, const void *b)
+{
+	const gdPangoAtlasGlyph *g1 = (const gdPangoAtlasGlyph *)a;
+	const gdPangoAtlasGlyph *g2 = (const gdPangoAtlasGlyph *)b;
+
+	return (g1->glyph > g2->glyph) - (g1->glyph < g2->glyph);
+}
+
+#define GD_PANGO_SDF_INF 1e20
+
+/*
+ * One dimensional squared distance transform of f in d, after
+ * Felzenszwalb and Huttenlocher: the lower envelope of the parabolas
+ * rooted at each sample. v and z hold n and n + 1 values.
+ */
+static void gdPangoDistance1D(const double *f, int n, double *d, int *v, double *z)
+{
+	int q, k = 0;
+
+	v[0] = 0;
+	z[0] = -GD_PANGO_SDF_INF;
+	z[1] = GD_PANGO_SDF_INF;
+	for (q = 1; q < n; q++) {
+		double s = ((f[q] + q * q) - (f[v[k]] + v[k] * v[k])) / (2 * (q - v[k]));
+
+		while (k > 0 && s <= z[k]) {
+			k--;
+			s = ((f[q] + q * q) - (f[v[k]] + v[k] * v[k])) / (2 * (q - v[k]));
+		}
+		k++;
+		v[k] = q;
+		z[k] = s;
+		z[k + 1] = GD_PANGO_SDF_INF;
+	}
+	for (k = 0, q = 0; q < n; q++) {
+		while (z[k + 1] < q) {
+			k++;
+		}
+		d[q] = (q - v[k]) * (q - v[k]) + f[v[k]];
+	}
+}
+
+/* exact squared distance transform of a grid, by columns then rows */
+static void gdPangoDistance2D(double *grid, int width, int height,
+	double *f, int *v, double *z)
+{
+	int x, y;
+
+	for (x = 0; x < width; x++) {
+		for (y = 0; y < height; y++) {
+			f[y] = grid[y * width + x];
+		}
+		gdPangoDistance1D(f, height, f + height, v, z);
+		for (y = 0; y < height; y++) {
+			grid[y * width + x] = f[height + y];
+		}
+	}
+	for (y = 0; y < height; y++) {
+		memcpy(f, grid + y * width, width * sizeof(double));
+		gdPangoDistance1D(f, width, grid + y * width, v, z);
+	}
+}
+
+/*
+ * Signed distance field of a coverage bitmap: 128 on the outline, 255
+ * spread pixels or more inside, 0 as far outside. The outline goes
+ * through partly covered pixels according to their coverage.
+ */
+static void gdPangoBitmapSDF(const FT_Bitmap *bitmap, int spread,
+	unsigned char *values)
+{
+	int width = bitmap->width;
+	int height = bitmap->rows;
+	int size = MAX(width, height);
+	int n = width * height;
+	double *outer, *inner, *f, *z;
+	int *v;
+	int x, y, i;
+
+	/* squared distances to the inside and to the outside */
+	outer = g_new(double, 2 * n + 3 * size + 1);
+	inner = outer + n;
+	f = inner + n;
+	z = f + 2 * size;
+	v = g_new(int, size);
+
+	for (y = 0; y < height; y++) {
+		const unsigned char *p = bitmap->buffer + y * bitmap->pitch;
+
+		for (x = 0; x < width; x++) {
+			i = y * width + x;
+			if (p[x] == 255) {
+				outer[i] = 0;
+				inner[i] = GD_PANGO_SDF_INF;
+			} else if (p[x] == 0) {
+				outer[i] = GD_PANGO_SDF_INF;
+				inner[i] = 0;
+			} else {
+				double a = p[x] / 255.0;
+
+				outer[i] = a < 0.5 ? (0.5 - a) * (0.5 - a) : 0;
+				inner[i] = a > 0.5 ? (a - 0.5) * (a - 0.5) : 0;
+			}
+		}
+	}
+	gdPangoDistance2D(outer, width, height, f, v, z);
+	gdPangoDistance2D(inner, width, height, f, v, z);
+
+	for (i = 0; i < n; i++) {
+		double distance = sqrt(outer[i]) - sqrt(inner[i]);
+		double value = 128.5 - distance * 128 / spread;
+
+		values[i] = value <= 0 ? 0 : (value >= 255 ? 255 : (unsigned char)value);
+	}
+	g_free(outer);
+	g_free(v);
+}
+
+/* copy a distance field in place in the atlas, as gray levels */
+static void gdPangoPutSDF(gdImagePtr image, const gdPangoAtlasGlyph *entry,
+	const gdPangoSDFGlyph *sdf)
+{
+	const unsigned char *p = sdf->values;
+	int x, y;
+
+	for (y = 0; y < sdf->height; y++) {
+		for (x = 0; x < sdf->width; x++, p++) {
+			gdImageSetPixel(image, entry->x + x, entry->y + y, gdTrueColor(*p, *p, *p));
+		}
+	}
+}
+
+/* get the distance field cache of the font of context */
+static gdPangoSDFCache *gdPangoContextSDF(gdPangoContext *context, int spread)
+{
+	gdPangoSDFCache *cache;
+	GSList *l;
+
+	for (l = context->sdf; l; l = l->next) {
+		cache = (gdPangoSDFCache *)l->data;
+		if (cache->spread == spread &&
+			pango_font_description_equal(cache->font_desc, context->font_desc)) {
+			return cache;
+		}
+	}
+	cache = (gdPangoSDFCache *)g_malloc(sizeof(gdPangoSDFCache));
+	cache->font_desc = pango_font_description_copy(context->font_desc);
+	cache->spread = spread;
+	cache->glyphs = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+	context->sdf = g_slist_prepend(context->sdf, cache);
+	return cache;
+}
+
+/*
+ * Collect the distinct glyphs of font in the corpus, as atlas glyphs with
+ * only the glyph, character and advance set.
+ */
+static GArray *gdPangoCollectGlyphs(gdPangoContext *context, PangoFont *font,
+	const char *corpus, int length)
+{
+	GHashTable *seen;
+	PangoLayout *layout;
+	PangoLayoutIter *iter;
+	GArray *list;
+	int i;
+
+	layout = pango_layout_new(context->context);
+	pango_layout_set_font_description(layout, context->font_desc);
+	pango_layout_set_text(layout, corpus, length);
+
+	list = g_array_new(FALSE, FALSE, sizeof(gdPangoAtlasGlyph));
+	seen = g_hash_table_new(g_direct_hash, g_direct_equal);
+	iter = pango_layout_get_iter(layout);
+	do {
+		PangoLayoutRun *run = pango_layout_iter_get_run_readonly(iter);
+		const char *text = pango_layout_get_text(layout);
+
+		if (!run || run->item->analysis.font != font) {
+			continue;
+		}
+		for (i = 0; i < run->glyphs->num_glyphs; i++) {
+			PangoGlyphInfo *info = &run->glyphs->glyphs[i];
+			gdPangoAtlasGlyph entry;
+
+			if ((info->glyph & PANGO_GLYPH_UNKNOWN_FLAG) ||
+				info->glyph == PANGO_GLYPH_EMPTY ||
+				g_hash_table_lookup_extended(seen, GUINT_TO_POINTER(info->glyph), NULL, NULL)) {
+				continue;
+			}
+			g_hash_table_insert(seen, GUINT_TO_POINTER(info->glyph), NULL);
+
+			memset(&entry, 0, sizeof(entry));
+			entry.glyph = info->glyph;
+			if (info->attr.is_cluster_start) {
+				entry.codepoint = g_utf8_get_char(text + run->item->offset +
+					run->glyphs->log_clusters[i]);
+			}
+			entry.advance = info->geometry.width;
+			g_array_append_val(list, entry);
+		}
+	} while (pango_layout_iter_next_run(iter));
+	pango_layout_iter_free(iter);
+	g_hash_table_destroy(seen);
+	g_object_unref(layout);
+	return list;
+}
+
+/*
+ * Build an atlas of coverage masks, or of distance fields when spread is
+ * not 0. Distance fields are bigger than the glyphs by spread pixels on
+ * each side.
+ */
+static gdPangoAtlas* gdPangoBuildAtlasMode(gdPangoContext *context,
+	const char *corpus, int length, int width, int padding, int spread,
+	int *error)
+{
+	gdPangoColors colors = {0xFFFFFF, 0x0, 0x0};
+	PangoFontMetrics *font_metrics;
+	gdPangoAtlasGlyph **order;
+	gdPangoSDFCache *cache = NULL;
+	PangoGlyphString *glyphs;
+	PangoFont *font;
+	gdPangoAtlas *atlas;
+	gdPangoSkyline skyline;
+	FT_Bitmap *bitmap = NULL;
+	GArray *list;
+	int i;
+
+	if (!corpus || width <= 0 || padding < 0 || spread < 0) {
+		if (error) *error = GD_PANGO_ERROR_FORMAT;
+		return NULL;
+	}
+	font = pango_context_load_font(context->context, context->font_desc);
+	if (!font) {
+		if (error) *error = GD_PANGO_ERROR_FONT;
+		return NULL;
+	}
+
+	list = gdPangoCollectGlyphs(context, font, corpus, length);
+
+	atlas = (gdPangoAtlas *)g_malloc(sizeof(gdPangoAtlas));
+	atlas->n_glyphs = list->len;
+	atlas->glyphs = (gdPangoAtlasGlyph *)g_array_free(list, FALSE);
+	atlas->image = NULL;
+
+	font_metrics = pango_font_get_metrics(font, pango_context_get_language(context->context));
+	atlas->ascent = pango_font_metrics_get_ascent(font_metrics);
+	atlas->descent = pango_font_metrics_get_descent(font_metrics);
+	atlas->spread = spread;
+	pango_font_metrics_unref(font_metrics);
+
+	/* measure, then pack the tallest glyphs first */
+	order = g_new(gdPangoAtlasGlyph *, atlas->n_glyphs + 1);
+	for (i = 0; i < atlas->n_glyphs; i++) {
+		gdPangoAtlasGlyph *entry = &atlas->glyphs[i];
+		PangoRectangle ink_rect;
+
+		pango_font_get_glyph_extents(font, entry->glyph, &ink_rect, NULL);
+		pango_extents_to_pixels(&ink_rect, NULL);
+		entry->bearing_x = ink_rect.x;
+		entry->bearing_y = ink_rect.y;
+		entry->width = MAX(ink_rect.width, 0);
+		entry->height = MAX(ink_rect.height, 0);
+		if (spread > 0 && entry->width > 0 && entry->height > 0) {
+			entry->bearing_x -= spread;
+			entry->bearing_y -= spread;
+			entry->width += 2 * spread;
+			entry->height += 2 * spread;
+		}
+		order[i] = entry;
+	}
+	qsort(order, atlas->n_glyphs, sizeof(gdPangoAtlasGlyph *), gdPangoCompareAtlasHeight);
+
+	gdPangoSkylineInit(&skyline, width);
+	for (i = 0; i < atlas->n_glyphs; i++) {
+		gdPangoAtlasGlyph *entry = order[i];
+
+		if (entry->width == 0 || entry->height == 0) {
+			continue;
+		}
+		if (!gdPangoSkylinePack(&skyline, entry->width + 2 * padding,
+				entry->height + 2 * padding, -1, &entry->x, &entry->y)) {
+			break;
+		}
+		entry->x += padding;
+		entry->y += padding;
+	}
+	if (i < atlas->n_glyphs) {
+		/* a glyph wider than the atlas */
+		gdPangoSkylineFree(&skyline);
+		g_free(order);
+		gdPangoFreeAtlas(atlas);
+		g_object_unref(font);
+		if (error) *error = GD_PANGO_ERROR_FORMAT;
+		return NULL;
+	}
+
+	if (spread > 0) {
+		/* opaque black, ie. far outside */
+		atlas->image = gdImageCreateTrueColor(width, MAX(skyline.height, 1));
+		cache = gdPangoContextSDF(context, spread);
+	} else {
+		atlas->image = gdPangoCreateSheet(width, skyline.height);
+	}
+	gdPangoSkylineFree(&skyline);
+
+	/* rasterize each glyph in place */
+	glyphs = pango_glyph_string_new();
+	pango_glyph_string_set_size(glyphs, 1);
+	glyphs->glyphs[0].geometry.width = 0;
+	glyphs->glyphs[0].geometry.x_offset = 0;
+	glyphs->glyphs[0].geometry.y_offset = 0;
+	glyphs->glyphs[0].attr.is_cluster_start = 1;
+	glyphs->log_clusters[0] = 0;
+	for (i = 0; atlas->image && i < atlas->n_glyphs; i++) {
+		gdPangoAtlasGlyph *entry = order[i];
+		gdPangoSDFGlyph *sdf;
+		gdRect rect;
+
+		if (entry->width == 0 || entry->height == 0) {
+			continue;
+		}
+		if (cache) {
+			sdf = (gdPangoSDFGlyph *)g_hash_table_lookup(cache->glyphs,
+				GUINT_TO_POINTER(entry->glyph));
+			if (sdf && sdf->width == entry->width && sdf->height == entry->height) {
+				gdPangoPutSDF(atlas->image, entry, sdf);
+				continue;
+			}
+		}
+		if (bitmap) {
+			gdPangoModifyFTBitmap(bitmap, entry->width, entry->height);
+		} else {
+			bitmap = gdPangoCreateFTBitmap(entry->width, entry->height);
+		}
+		glyphs->glyphs[0].glyph = entry->glyph;
+		pango_ft2_render(bitmap, font, glyphs, -entry->bearing_x, -entry->bearing_y);
+
+		if (cache) {
+			sdf = (gdPangoSDFGlyph *)g_malloc(sizeof(gdPangoSDFGlyph) +
+				entry->width * entry->height);
+			sdf->width = entry->width;
+			sdf->height = entry->height;
+			gdPangoBitmapSDF(bitmap, spread, sdf->values);
+			g_hash_table_replace(cache->glyphs, GUINT_TO_POINTER(entry->glyph), sdf);
+			gdPangoPutSDF(atlas->image, entry, sdf);
+			continue;
+		}
+		rect.x = entry->x;
+		rect.y = entry->y;
+		rect.width = entry->width;
+		rect.height = entry->height;
+		gdPangoBlitFTBitmap(bitmap, atlas->image, &colors, &rect, NULL);
+	}
+	pango_glyph_string_free(glyphs);
+	gdPangoFreeFTBitmap(bitmap);
+	g_free(order);
+	g_object_unref(font);
+
+	if (!atlas->image) {
+		gdPangoFreeAtlas(atlas);
+		if (error) *error = GD_PANGO_ERROR_FORMAT;
+		return NULL;
+	}
+
+	qsort(atlas->glyphs, atlas->n_glyphs, sizeof(gdPangoAtlasGlyph), gdPangoCompareAtlasGlyph);
+	return atlas;
+}
+
+/**
+ * Build a glyph atlas.
+ *
+ * The corpus is shaped with the font of context; every distinct glyph of
+ * that font found in it (ligatures included) is rasterized once and
+ * packed with a skyline packer in a surface of the given width, as white
+ * with the coverage in the alpha channel. The glyphs of fallback fonts
+ * are not included. Glyphs are sorted by glyph id, see gdPangoAtlasFind
+ * and gdPangoAtlasWriteTable.
+ *
+ * @param *context	Context
+ * @param *corpus		utf-8 text giving the glyph set
+ * @param length		Text length. -1 means NULL-terminated text.
+ * @param width		Width of the atlas surface
+ * @param padding		Free pixels around each glyph, for texture filtering
+ * @param *error		output of error code on failure; simply ignored if
+ *							error = NULL
+ * @return A pointer to the atlas as a gdPangoAtlas*, or NULL on failure.
+ */
+gdPangoAtlas* gdPangoBuildAtlas(gdPangoContext *context, const char *corpus,
+	int length, int width, int padding, int *error)
+{
+	return gdPangoBuildAtlasMode(context, corpus, length, width, padding, 0, error);
+}
+
+/**
+ * Build a signed distance field glyph atlas.
+ *
+ * Same as gdPangoBuildAtlas, but each glyph is stored as its distance
+ * field, in opaque gray levels: 128 on the outline, up to 255 inside and
+ * down to 0 outside, reached at spread pixels from the outline. Glyph
+ * boxes include the spread on each side. Fields are cached in the
+ * context by font and spread, so building another atlas of the same
+ * font only packs them again.
+ *
+ * @param *context	Context
+ * @param *corpus		utf-8 text giving the glyph set
+ * @param length		Text length. -1 means NULL-terminated text.
+ * @param width		Width of the atlas surface
+ * @param padding		Free pixels around each glyph box
+ * @param spread		Distance range in pixels, 1 or more
+ * @param *error		output of error code on failure; simply ignored if
+ *							error = NULL
+ * @return A pointer to the atlas as a gdPangoAtlas*, or NULL on failure.
+ */
+gdPangoAtlas* gdPangoBuildAtlasSDF(gdPangoContext *context, const char *corpus,
+	int length, int width, int padding, int spread, int *error)
+{
+	if (spread <= 0) {
+		if (error) *error = GD_PANGO_ERROR_FORMAT;
+		return NULL;
+	}
+	return gdPangoBuildAtlasMode(context, corpus, length, width, padding, spread, error);
+}
+
+/**
+ * Build a glyph atlas of a range of characters.
+ *
+ * Same as gdPangoBuildAtlas with a corpus made of the characters from
+ * first to last; control characters are skipped.
+ *
+ * @param *context	Context
+ * @param first		First character of the range
+ * @param last			Last character of the range
+ * @param width		Width of the atlas surface
+ * @param padding		Free pixels around each glyph
+ * @param *error		output of error code on failure; simply ignored if
+ *							error = NULL
+ * @return A pointer to the atlas as a gdPangoAtlas*, or NULL on failure.
+ */
+gdPangoAtlas* gdPangoBuildAtlasRange(gdPangoContext *context,
+	unsigned int first, unsigned int last, int width, int padding, int *error)
+{
+	gdPangoAtlas *atlas;
+	GString *corpus;
+	gunichar c;
+
+	if (first > last || last > 0x10FFFF) {
+		if (error) *error = GD_PANGO_ERROR_FORMAT;
+		return NULL;
+	}
+
+	corpus = g_string_new(NULL);
+	for (c = first; c <= last; c++) {
+		if (!g_unichar_iscntrl(c) && g_unichar_validate(c)) {
+			g_string_append_unichar(corpus, c);
+			/* keep the characters from combining or forming ligatures */
+			g_string_append_c(corpus, '\n');
+		}
+	}
+	atlas = gdPangoBuildAtlas(context, corpus->str, corpus->len, width, padding, error);
+	g_string_free(corpus, TRUE);
+	return atlas;
+}
+
+/**
+ * Free an atlas.
+ *
+ * @param *atlas	Atlas to be freed
+ */
+void gdPangoFreeAtlas(gdPangoAtlas *atlas)
+{
+	if (atlas->image) {
+		gdImageDestroy(atlas->image);
+	}
+	g_free(atlas->glyphs);
+	g_free(atlas);
+}
+
+/**
+ * Find a glyph in an atlas.
+ *
+ * @param *atlas	Atlas
+ * @param glyph	Glyph id, as given by gdPangoGetLayoutGlyphs
+ * @return The glyph entry, or NULL if the glyph is not in the atlas.
+ */
+const gdPangoAtlasGlyph* gdPangoAtlasFind(const gdPangoAtlas *atlas,
+	unsigned int glyph)
+{
+	gdPangoAtlasGlyph key;
+
+	key.glyph = glyph;
+	return (const gdPangoAtlasGlyph *)bsearch(&key, atlas->glyphs, atlas->n_glyphs,
+		sizeof(gdPangoAtlasGlyph), gdPangoCompareAtlasGlyph);
+}
+
+static unsigned char *gdPangoPut16(unsigned char *p, int value)
+{
+	p[0] = value & 0xFF;
+	p[1] = (value >> 8) & 0xFF;
+	return p + 2;
+}
+
+static unsigned char *gdPangoPut32(unsigned char *p, int value)
+{
+	p = gdPangoPut16(p, value & 0xFFFF);
+	return gdPangoPut16(p, (value >> 16) & 0xFFFF);
+}
+
+/**
+ * Write the glyph table of an atlas.
+ *
+ * All values are little endian. The header is the magic "GDPA", the
+ * format version (16 bits, GD_PANGO_ATLAS_VERSION), the atlas width and
+ * height (16 bits each), the number of glyphs (32 bits), the font
+ * ascent and descent (32 bits, Pango units) and the distance field
+ * spread (16 bits, 0 for coverage atlases). Then for each glyph
+ * (GD_PANGO_ATLAS_ENTRY_SIZE bytes): glyph id and character (32 bits),
+ * x, y, width and height in the atlas (16 bits), bearing x and y from
+ * the pen position on the baseline (signed 16 bits) and the advance
+ * (signed 32 bits, Pango units).
+ *
+ * @param *atlas	Atlas
+ * @param *size	output of the table size in bytes
+ * @return The table, to be freed with g_free.
+ */
+unsigned char* gdPangoAtlasWriteTable(const gdPangoAtlas *atlas, int *size)
+{
+	unsigned char *table, *p;
+	int i;
+
+	*size = GD_PANGO_ATLAS_HEADER_SIZE + atlas->n_glyphs * GD_PANGO_ATLAS_ENTRY_SIZE;
+	table = p = (unsigned char *)g_malloc(*size);
+
+	memcpy(p, "GDPA", 4);
+	p = gdPangoPut16(p + 4, GD_PANGO_ATLAS_VERSION);
+	p = gdPangoPut16(p, gdImageSX(atlas->image));
+	p = gdPangoPut16(p, gdImageSY(atlas->image));
+	p = gdPangoPut32(p, atlas->n_glyphs);
+	p = gdPangoPut32(p, atlas->ascent);
+	p = gdPangoPut32(p, atlas->descent);
+	p = gdPangoPut16(p, atlas->spread);
+
+	for (i = 0; i < atlas->n_glyphs; i++) {
+		const gdPangoAtlasGlyph *entry = &atlas->glyphs[i];
+
+		p = gdPangoPut32(p, entry->glyph);
+		p = gdPangoPut32(p, entry->codepoint);
+		p = gdPangoPut16(p, entry->x);
+		p = gdPangoPut16(p, entry->y);
+		p = gdPangoPut16(p, entry->width);
+		p = gdPangoPut16(p, entry->height);
+		p = gdPangoPut16(p, entry->bearing_x);
+		p = gdPangoPut16(p, entry->bearing_y);
+		p = gdPangoPut32(p, entry->advance);
+	}
+	return table;
+}
+
+/* render the masks of the glyphs of a font, as in a glyph cache file */
+static void gdPangoWriteCacheFont(GString *out, PangoFont *font, GArray *list)
+{
+	PangoGlyphString *glyphs;
+	FT_Bitmap *bitmap = NULL;
+	unsigned char *entries, *p;
+	GString *masks;
+	int i, size;
+
+	size = list->len * GD_PANGO_GLYPH_CACHE_ENTRY_SIZE;
+	entries = p = (unsigned char *)g_malloc(MAX(size, 1));
+	masks = g_string_new(NULL);
+
+	glyphs = pango_glyph_string_new();
+	pango_glyph_string_set_size(glyphs, 1);
+	glyphs->glyphs[0].geometry.width = 0;
+	glyphs->glyphs[0].geometry.x_offset = 0;
+	glyphs->glyphs[0].geometry.y_offset = 0;
+	glyphs->glyphs[0].attr.is_cluster_start = 1;
+	glyphs->log_clusters[0] = 0;
+	for (i = 0; i < (int)list->len; i++) {
+		gdPangoAtlasGlyph *entry = &g_array_index(list, gdPangoAtlasGlyph, i);
+		PangoRectangle ink_rect;
+		gdRect box;
+		int x, y, pad, left = 0, top = 0;
+
+		pango_font_get_glyph_extents(font, entry->glyph, &ink_rect, NULL);
+		pango_extents_to_pixels(&ink_rect, NULL);
+		if (ink_rect.width > 0 && ink_rect.height > 0) {
+			/* render with room for hinting and emboldening, then keep the
+			   box of the coverage actually drawn */
+			pad = 2 + MAX(ink_rect.width, ink_rect.height) / 4;
+			left = ink_rect.x - pad;
+			top = ink_rect.y - pad;
+			if (bitmap) {
+				gdPangoModifyFTBitmap(bitmap, ink_rect.width + 2 * pad,
+					ink_rect.height + 2 * pad);
+			} else {
+				bitmap = gdPangoCreateFTBitmap(ink_rect.width + 2 * pad,
+					ink_rect.height + 2 * pad);
+			}
+			glyphs->glyphs[0].glyph = entry->glyph;
+			pango_ft2_render(bitmap, font, glyphs, -left, -top);
+
+			box.x = box.y = box.width = box.height = 0;
+			for (y = 0; y < (int)bitmap->rows; y++) {
+				const unsigned char *row = bitmap->buffer + y * bitmap->pitch;
+				int first = -1, last = -1;
+
+				for (x = 0; x < (int)bitmap->width; x++) {
+					if (row[x]) {
+						if (first < 0) {
+							first = x;
+						}
+						last = x;
+					}
+				}
+				if (first >= 0) {
+					gdPangoRectUnion(&box, first, y, last - first + 1, 1);
+				}
+			}
+			entry->bearing_x = left + box.x;
+			entry->bearing_y = top + box.y;
+			entry->width = box.width;
+			entry->height = box.height;
+			left = box.x;
+			top = box.y;
+		}
+		p = gdPangoPut32(p, entry->glyph);
+		p = gdPangoPut16(p, entry->bearing_x);
+		p = gdPangoPut16(p, entry->bearing_y);
+		p = gdPangoPut16(p, entry->width);
+		p = gdPangoPut16(p, entry->height);
+		p = gdPangoPut32(p, size + masks->len);
+		for (y = 0; y < entry->height; y++) {
+			g_string_append_len(masks,
+				(const char *)bitmap->buffer + (top + y) * bitmap->pitch + left,
+				entry->width);
+		}
+	}
+	pango_glyph_string_free(glyphs);
+	gdPangoFreeFTBitmap(bitmap);
+
+	g_string_append_len(out, (const char *)entries, size);
+	g_string_append_len(out, masks->str, masks->len);
+	g_free(entries);
+	g_string_free(masks, TRUE);
+}
+
+/**
+ * Write a glyph cache file.
+ *
+ * The distinct glyphs of the font of context found in the corpus are
+ * rendered and stored in the file, keyed by the font file contents, face,
+ * pixel size (the point size at the dpi) and hinting options. The glyphs
+ * of other fonts already in the file are kept, the ones of this font are
+ * replaced. The file is written to a temporary file then renamed, so
+ * that processes using the old one are not disturbed; they get the new
+ * glyphs by opening it again.
+ *
+ * @param *context	Context
+ * @param *path		Cache file
+ * @param *corpus		utf-8 text giving the glyph set
+ * @param length		Text length. -1 means NULL-terminated text.
+ * @param *error		output of error code on failure; simply ignored if
+ *							error = NULL
+ * @return GD_SUCCESS on success, GD_FAILURE on failure.
+ */
+int gdPangoWriteGlyphCache(gdPangoContext *context, const char *path,
+	const char *corpus, int length, int *error)
+{
+	const unsigned char *old_data = NULL;
+	GMappedFile *old_file;
+	unsigned char *table, *p;
+	gdPangoFontKey key;
+	PangoFont *font;
+	GString *out;
+	GArray *list;
+	int i, n_old = 0, n_fonts = 1, table_size, start, done;
+
+	if (!path || !corpus) {
+		if (error) *error = GD_PANGO_ERROR_FORMAT;
+		return GD_FAILURE;
+	}
+	font = pango_context_load_font(context->context, context->font_desc);
+	if (!font || !gdPangoGetFontKey(font, &key)) {
+		if (font) {
+			g_object_unref(font);
+		}
+		if (error) *error = GD_PANGO_ERROR_FONT;
+		return GD_FAILURE;
+	}
+	list = gdPangoCollectGlyphs(context, font, corpus, length);
+	g_array_sort(list, gdPangoCompareAtlasGlyph);
+
+	/* keep the other fonts of a valid file */
+	old_file = g_mapped_file_new(path, FALSE, NULL);
+	if (old_file) {
+		old_data = (const unsigned char *)g_mapped_file_get_contents(old_file);
+		n_old = gdPangoCheckGlyphCache(old_data, g_mapped_file_get_length(old_file));
+	}
+	for (i = 0; i < n_old && n_fonts < 0xFFFF; i++) {
+		if (!gdPangoFontKeyEqual(old_data + GD_PANGO_GLYPH_CACHE_HEADER_SIZE +
+				i * GD_PANGO_GLYPH_CACHE_FONT_SIZE, &key)) {
+			n_fonts++;
+		}
+	}
+	table_size = GD_PANGO_GLYPH_CACHE_HEADER_SIZE + n_fonts * GD_PANGO_GLYPH_CACHE_FONT_SIZE;
+	table = (unsigned char *)g_malloc0(table_size);
+	out = g_string_new(NULL);
+	g_string_append_len(out, (const char *)table, table_size);
+
+	memcpy(table, "GDPC", 4);
+	p = gdPangoPut16(table + 4, GD_PANGO_GLYPH_CACHE_VERSION);
+	p = gdPangoPut16(p, n_fonts);
+	p += 4;  /* file length, once known */
+
+	/* copy the kept fonts with their data */
+	for (i = 0, done = 1; i < n_old && done < n_fonts; i++) {
+		const unsigned char *old = old_data + GD_PANGO_GLYPH_CACHE_HEADER_SIZE +
+			i * GD_PANGO_GLYPH_CACHE_FONT_SIZE;
+
+		if (gdPangoFontKeyEqual(old, &key)) {
+			continue;
+		}
+		memcpy(p, old, 24);
+		p = gdPangoPut32(p + 24, out->len);
+		p = gdPangoPut32(p, gdPangoGet32(old + 28));
+		g_string_append_len(out, (const char *)old_data + gdPangoGet32(old + 24),
+			gdPangoGet32(old + 28));
+		done++;
+	}
+
+	p = gdPangoPut32(p, key.hash[0]);
+	p = gdPangoPut32(p, key.hash[1]);
+	p = gdPangoPut32(p, key.index);
+	p = gdPangoPut32(p, key.size);
+	p = gdPangoPut32(p, key.flags);
+	p = gdPangoPut32(p, list->len);
+	p = gdPangoPut32(p, out->len);
+	start = out->len;
+	gdPangoWriteCacheFont(out, font, list);
+	gdPangoPut32(p, out->len - start);
+
+	gdPangoPut32(table + 8, out->len);
+	memcpy(out->str, table, table_size);
+
+	if (old_file) {
+		g_mapped_file_unref(old_file);
+	}
+	g_free(table);
+	g_array_free(list, TRUE);
+	g_object_unref(font);
+
+	done = g_file_set_contents(path, out->str, out->len, NULL);
+	g_string_free(out, TRUE);
+	if (!done) {
+		if (error) *error = GD_PANGO_ERROR_CACHE;
+		return GD_FAILURE;
+	}
+	return GD_SUCCESS;
+}
+
+/**
+ * Open a glyph cache file.
+ *
+ * The file is mapped read-only, so that every process using it shares
+ * the same memory. It can be used by any number of contexts, see
+ * gdPangoSetGlyphCache.
+ *
+ * @param *path		Cache file written by gdPangoWriteGlyphCache
+ * @param *error		output of error code on failure; simply ignored if
+ *							error = NULL
+ * @return The cache, or NULL if the file is missing, from another
+ *         version or damaged. It should then be written again.
+ */
+gdPangoGlyphCache* gdPangoOpenGlyphCache(const char *path, int *error)
+{
+	gdPangoGlyphCache *cache;
+	GMappedFile *file;
+	int n_fonts;
+
+	file = g_mapped_file_new(path, FALSE, NULL);
+	if (!file) {
+		if (error) *error = GD_PANGO_ERROR_CACHE;
+		return NULL;
+	}
+	n_fonts = gdPangoCheckGlyphCache((const unsigned char *)g_mapped_file_get_contents(file),
+		g_mapped_file_get_length(file));
+	if (n_fonts < 0) {
+		g_mapped_file_unref(file);
+		if (error) *error = GD_PANGO_ERROR_CACHE;
+		return NULL;
+	}
+	cache = (gdPangoGlyphCache *)g_malloc(sizeof(gdPangoGlyphCache));
+	cache->file = file;
+	cache->data = (const unsigned char *)g_mapped_file_get_contents(file);
+	cache->length = g_mapped_file_get_length(file);
+	cache->n_fonts = n_fonts;
+	return cache;
+}
+
+/**
+ * Free a glyph cache. It must not be used by a context anymore.
+ *
+ * @param *cache	Cache to be freed
+ */
+void gdPangoFreeGlyphCache(gdPangoGlyphCache *cache)
+{
+	g_mapped_file_unref(cache->file);
+	g_free(cache);
+}
+
+/**
+ * Set the glyph cache of a context.
+ *
+ * Runs whose glyphs are all in the cache are drawn from it instead of
+ * being rasterized. Rotated text is always rasterized.
+ *
+ * @param *context	Context
+ * @param *cache		Cache, or NULL to stop using one
+ */
+void gdPangoSetGlyphCache(gdPangoContext *context, gdPangoGlyphCache *cache)
+{
+	if (context->cache_fonts) {
+		g_hash_table_destroy(context->cache_fonts);
+		context->cache_fonts = NULL;
+	}
+	context->glyph_cache = cache;
+	if (cache) {
+		context->cache_fonts = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+			g_object_unref, NULL);
+	}
+}
+
+/**
+ * Get the positioned glyphs of the layout.
+ *
+ * Glyphs are given in visual order with their pen position on the
+ * baseline, in Pango units from the top-left corner of the layout, so
+ * that a client can draw them from an atlas (see gdPangoBuildAtlas).
+ * Rotated layouts are given untransformed.
+ *
+ * @param *context	Context
+ * @param *n_glyphs	output of the number of glyphs
+ * @return The glyphs, to be freed with g_free, or NULL if there is none.
+ */
+gdPangoPositionedGlyph* gdPangoGetLayoutGlyphs(gdPangoContext *context,
+	int *n_glyphs)
+{
+	gdPangoPositionedGlyph glyph;
+	gdPangoMetrics *metrics;
+	PangoLayoutIter *iter;
+	GArray *list;
+	int i;
+
+	list = g_array_new(FALSE, FALSE, sizeof(gdPangoPositionedGlyph));
+
+	metrics = gdPangoSimpleShape(context);
+	if (metrics) {
+		int x = 0;
+
+		for (i = 0; i < context->glyphs->num_glyphs; i++) {
+			glyph.glyph = context->glyphs->glyphs[i].glyph;
+			glyph.font = metrics->font;
+			glyph.x = x;
+			glyph.y = metrics->baseline;
+			g_array_append_val(list, glyph);
+			x += context->glyphs->glyphs[i].geometry.width;
+		}
+	} else {
+		iter = pango_layout_get_iter(context->layout);
+		do {
+			PangoLayoutRun *run = pango_layout_iter_get_run_readonly(iter);
+			PangoRectangle run_logical_rect;
+			int x, baseline;
+
+			if (!run) {
+				continue;
+			}
+			pango_layout_iter_get_run_extents(iter, NULL, &run_logical_rect);
+			baseline = pango_layout_iter_get_baseline(iter);
+			x = run_logical_rect.x;
+			for (i = 0; i < run->glyphs->num_glyphs; i++) {
+				PangoGlyphInfo *info = &run->glyphs->glyphs[i];
+
+				if (info->glyph != PANGO_GLYPH_EMPTY) {
+					glyph.glyph = info->glyph;
+					glyph.font = run->item->analysis.font;
+					glyph.x = x + info->geometry.x_offset;
+					glyph.y = baseline + info->geometry.y_offset;
+					g_array_append_val(list, glyph);
+				}
+				x += info->geometry.width;
+			}
+		} while (pango_layout_iter_next_run(iter));
+		pango_layout_iter_free(iter);
+	}
+
+	*n_glyphs = list->len;
+	if (list->len == 0) {
+		g_array_free(list, TRUE);
+		return NULL;
+	}
+	return (gdPangoPositionedGlyph *)g_array_free(list, FALSE);
+}
+
+static int gdPangoCompareLabelHeight(const void *a, const void *b)
+{
+	const gdPangoLabelRect *r1 = *(const gdPangoLabelRect * const *)a;
+	const gdPangoLabelRect *r2 = *(const gdPangoLabelRect * const *)b;
+
+	if (r1->height != r2->height) {
+		return r2->height - r1->height;
+	}
+	return r2->width - r1->width;
+}
+
+/**
+ * Render a batch of labels packed in sprite sheets.
+ *
+ * Every label is laid out and measured once, then the labels are
+ * packed, tallest first, with a skyline packer into as few sheets as
+ * needed and each layout is rendered in place. Sheets are transparent,
+ * sized sheet_width by at most sheet_height, and are cropped to their
+ * used height. Each label gets the same size as with
+ * gdPangoCreateSurfaceDraw. Each label is set to context with
+ * gdPangoSetText, so its text, wrapping width and alignment are
+ * overwritten: on return it holds the last label. Rotated layouts are
+ * not supported.
+ *
+ * @param *context	Context
+ * @param **labels	Plain utf-8 texts, n_labels of them
+ * @param n_labels	Number of labels
+ * @param sheet_width	Width of a sheet
+ * @param sheet_height	Maximum height of a sheet, -1 to pack everything
+ *							in one sheet
+ * @param padding		Free pixels around each label
+ * @param **sheets	output of the newly created sheets, the array is to
+ *							be freed with g_free
+ * @param *n_sheets	output of the number of sheets
+ * @param *rects		output of n_labels label positions
+ * @return GD_SUCCESS on success, GD_FAILURE if a label does not fit in a
+ *			sheet or on invalid arguments.
+ */
+int gdPangoPackLabels(gdPangoContext *context, const char **labels,
+	int n_labels, int sheet_width, int sheet_height, int padding,
+	gdImagePtr **sheets, int *n_sheets, gdPangoLabelRect *rects)
+{
+	gdPangoSkyline *skylines = NULL;
+	gdPangoLabelRect **order;
+	PangoLayout **layouts;
+	int i, n = 0, r = GD_SUCCESS;
+
+	*sheets = NULL;
+	*n_sheets = 0;
+	if (!labels || n_labels <= 0 || sheet_width <= 0 || padding < 0) {
+		return GD_FAILURE;
+	}
+	if (pango_context_get_matrix(context->context) != NULL) {
+		return GD_FAILURE;
+	}
+
+	/* measure, the shaped layouts are kept for rendering */
+	order = g_new(gdPangoLabelRect *, n_labels);
+	layouts = g_new(PangoLayout *, n_labels);
+	for (i = 0; i < n_labels; i++) {
+		PangoRectangle logical_rect;
+
+		gdPangoSetText(context, labels[i], -1);
+		layouts[i] = pango_layout_copy(context->layout);
+		pango_layout_get_extents(layouts[i], NULL, &logical_rect);
+		pango_extents_to_pixels(&logical_rect, NULL);
+		rects[i].sheet = -1;
+		rects[i].x = rects[i].y = 0;
+		rects[i].width = logical_rect.width;
+		rects[i].height = logical_rect.height;
+		order[i] = &rects[i];
+	}
+	qsort(order, n_labels, sizeof(gdPangoLabelRect *), gdPangoCompareLabelHeight);
+
+	/* pack, first sheet with room */
+	for (i = 0; i < n_labels; i++) {
+		gdPangoLabelRect *rect = order[i];
+		int sheet, width = rect->width + 2 * padding, height = rect->height + 2 * padding;
+
+		for (sheet = 0; sheet < n; sheet++) {
+			if (gdPangoSkylinePack(&skylines[sheet], width, height, sheet_height,
+					&rect->x, &rect->y)) {
+				break;
+			}
+		}
+		if (sheet == n) {
+			skylines = g_renew(gdPangoSkyline, skylines, n + 1);
+			gdPangoSkylineInit(&skylines[n], sheet_width);
+			n++;
+			if (!gdPangoSkylinePack(&skylines[sheet], width, height, sheet_height,
+					&rect->x, &rect->y)) {
+				r = GD_FAILURE;
+				break;
+			}
+		}
+		rect->sheet = sheet;
+		rect->x += padding;
+		rect->y += padding;
+	}
+
+	if (r == GD_SUCCESS) {
+		*sheets = g_new0(gdImagePtr, n);
+		for (i = 0; i < n; i++) {
+			(*sheets)[i] = gdPangoCreateSheet(sheet_width, skylines[i].height);
+			if (!(*sheets)[i]) {
+				r = GD_FAILURE;
+			}
+		}
+	}
+
+	/* render in place */
+	for (i = 0; r == GD_SUCCESS && i < n_labels; i++) {
+		gdPangoTarget target;
+
+		if (rects[i].width == 0 || rects[i].height == 0) {
+			continue;
+		}
+		target.surface = (*sheets)[rects[i].sheet];
+		target.x = rects[i].x;
+		target.y = rects[i].y;
+		target.damage = NULL;
+		gdPangoRenderLayout(context, layouts[i], &target, 1);
+	}
+	if (context->stats) {
+		gdPangoFlushStats(context);
+	}
+	for (i = 0; i < n_labels; i++) {
+		g_object_unref(layouts[i]);
+	}
+	g_free(layouts);
+
+	for (i = 0; i < n; i++) {
+		gdPangoSkylineFree(&skylines[i]);
+		if (r != GD_SUCCESS && *sheets && (*sheets)[i]) {
+			gdImageDestroy((*sheets)[i]);
+		}
+	}
+	g_free(skylines);
+	g_free(order);
+
+	if (r != GD_SUCCESS) {
+		g_free(*sheets);
+		*sheets = NULL;
+		return GD_FAILURE;
+	}
+	*n_sheets = n;
+	return GD_SUCCESS;
+}
+
+/*
+ * Test whether the layout fits in a box with the font at size points.
+ */
+static int gdPangoFitsBox(PangoLayout *layout, PangoFontDescription *font_desc,
+	double size, int width, int height)
+{
+	PangoRectangle logical_rect;
+
+	pango_font_description_set_size(font_desc, (gint)(size * PANGO_SCALE));
+	pango_layout_set_font_description(layout, font_desc);
+	pango_layout_get_extents(layout, NULL, &logical_rect);
+	pango_extents_to_pixels(&logical_rect, NULL);
+
+	return (logical_rect.x >= 0 && logical_rect.x + logical_rect.width <= width &&
+		logical_rect.y >= 0 && logical_rect.y + logical_rect.height <= height);
+}
+
+/**
+ * Find the largest font size fitting the text in a box.
+ *
+ * The text is laid out once unwrapped at max_pt; its extents scaled to
+ * the box give the starting guess and, when lines can be wrapped, the
+ * sum of the areas of its lines gives the first upper bound, searched
+ * past when the text still fits there. The size is then searched by bisection in
+ * half point steps, so only a few layouts are computed. The text is
+ * left laid out at the chosen size, which becomes the font size of the
+ * context, with the box width as wrapping width.
+ *
+ * @param *context	Context
+ * @param width		Box width in pixels
+ * @param height		Box height in pixels
+ * @param min_pt		Smallest size in points
+ * @param max_pt		Largest size in points
+ * @param wrap			How to wrap the lines at the box width
+ * @param *size		output of the chosen size in points; simply ignored
+ *							if size = NULL
+ * @return GD_SUCCESS if the text fits, GD_FAILURE if it does not fit even
+ *			at min_pt (it is then laid out at min_pt) or on invalid
+ *			arguments.
+ */
+int gdPangoFitToBox(gdPangoContext *context, int width, int height,
+	double min_pt, double max_pt, PangoWrapMode wrap, double *size)
+{
+	PangoLayout *layout = context->layout;
+	PangoRectangle logical_rect, line_rect;
+	PangoLayoutIter *iter;
+	double chosen, guess, bound, scale, area;
+	int lo_step, hi_step, step, bound_step, max_step, fits;
+
+	if (width <= 0 || height <= 0 || min_pt <= 0 || max_pt < min_pt) {
+		return GD_FAILURE;
+	}
+
+	/* one unwrapped layout at the largest size */
+	pango_layout_set_width(layout, -1);
+	pango_font_description_set_size(context->font_desc, (gint)(max_pt * PANGO_SCALE));
+	pango_layout_set_font_description(layout, context->font_desc);
+	pango_layout_get_extents(layout, NULL, &logical_rect);
+
+	/* wrapped lines keep the area of the text lines at best */
+	area = 0;
+	iter = pango_layout_get_iter(layout);
+	do {
+		pango_layout_iter_get_line_extents(iter, NULL, &line_rect);
+		area += (double)line_rect.width * line_rect.height;
+	} while (pango_layout_iter_next_line(iter));
+	pango_layout_iter_free(iter);
+
+	pango_layout_set_width(layout, width * PANGO_SCALE);
+	pango_layout_set_wrap(layout, wrap);
+
+	if (logical_rect.width <= 0 || logical_rect.height <= 0) {
+		chosen = max_pt;
+		fits = gdPangoFitsBox(layout, context->font_desc, chosen, width, height);
+		goto done;
+	}
+
+	scale = MIN((double)width * PANGO_SCALE / logical_rect.width,
+		(double)height * PANGO_SCALE / logical_rect.height);
+	if (scale >= 1.0) {
+		/* no line is wider than the box, nothing wraps */
+		chosen = max_pt;
+		fits = 1;
+		goto done;
+	}
+	guess = max_pt * scale;
+
+	bound = max_pt;
+	if (area > 0) {
+		bound = max_pt * sqrt((double)width * height * PANGO_SCALE * PANGO_SCALE / area);
+		bound = MIN(bound, max_pt);
+	}
+
+	/* largest fitting half point step from min_pt, lo_step fits */
+	max_step = (int)((max_pt - min_pt) * 2);
+	bound_step = CLAMP((int)((bound - min_pt) * 2), 0, max_step);
+	lo_step = -1;
+	hi_step = bound_step;
+	step = CLAMP((int)((guess - min_pt) * 2), 0, hi_step);
+	for (;;) {
+		while (lo_step < hi_step) {
+			if (gdPangoFitsBox(layout, context->font_desc, min_pt + step * 0.5,
+					width, height)) {
+				lo_step = step;
+			} else {
+				hi_step = step - 1;
+			}
+			step = (lo_step + hi_step + 1) / 2;
+		}
+		/* spaces dropped at wrap points may let the text fit above the bound */
+		if (lo_step != bound_step || bound_step == max_step) {
+			break;
+		}
+		hi_step = bound_step = max_step;
+		step = (lo_step + hi_step + 1) / 2;
+	}
+	fits = (lo_step >= 0);
+	chosen = min_pt + MAX(lo_step, 0) * 0.5;
+
+ done:
+	/* lay out at the chosen size */
+	pango_font_description_set_size(context->font_desc, (gint)(chosen * PANGO_SCALE));
+	pango_layout_set_font_description(layout, context->font_desc);
+	if (size) {
+		*size = chosen;
+	}
+	return fits ? GD_SUCCESS : GD_FAILURE;
+}
+
+/**
+ * Get the metrics of a font.
+ *
+ * The metrics hold the glyph advances of the characters measured so far
+ * and their kerning pairs, filled on demand, so that simple strings can
+ * be measured without a layout. They are owned by the context and stay
+ * valid until it is freed or its DPI is changed.
+ *
+ * @param *context	Context
+ * @param *font_desc	Font description, NULL for the font of context
+ * @return The metrics as a gdPangoMetrics*.
+ */
+gdPangoMetrics* gdPangoGetMetrics(gdPangoContext *context,
+	const PangoFontDescription *font_desc)
+{
+	return gdPangoContextMetrics(context,
+		font_desc ? font_desc : context->font_desc);
+}
+
+/**
+ * Tell whether a text needs full shaping to be measured.
+ *
+ * Text using anything but the simple scripts (Latin, Greek, Cyrillic
+ * and common characters), or characters and pairs which the font does
+ * not draw one glyph per character (fallback fonts, ligatures, marks),
+ * needs shaping; measure it with a layout instead. So does any text in
+ * a font with ligatures of three characters or more, or contextual
+ * substitution or positioning.
+ *
+ * @param *metrics	Metrics
+ * @param *text		utf-8 text
+ * @param length		Text length. -1 means NULL-terminated text.
+ * @return non-zero if the text needs full shaping, otherwise zero.
+ */
+int gdPangoMetricsNeedsShaping(gdPangoMetrics *metrics, const char *text,
+	int length)
+{
+	return !gdPangoMetricsPlace(metrics, text, length, NULL, NULL);
+}
+
+/**
+ * Measure the width of a single line of text without a layout.
+ *
+ * @param *metrics	Metrics
+ * @param *text		utf-8 text
+ * @param length		Text length. -1 means NULL-terminated text.
+ * @param *width		output of the logical width in Pango units, as
+ *							given by the layout of the same text
+ * @return GD_SUCCESS on success, GD_FAILURE if the text needs full
+ *			shaping (see gdPangoMetricsNeedsShaping).
+ */
+int gdPangoMetricsGetWidth(gdPangoMetrics *metrics, const char *text,
+	int length, int *width)
+{
+	if (!gdPangoMetricsPlace(metrics, text, length, NULL, width)) {
+		return GD_FAILURE;
+	}
+	return GD_SUCCESS;
+}
+
+/**
+ * Get the line metrics of a font.
+ *
+ * @param *metrics	Metrics
+ * @param *ascent		output of the distance from the top of a line to
+ *							its baseline in Pango units; simply ignored if NULL
+ * @param *descent	output of the distance from the baseline to the
+ *							bottom of a line; simply ignored if NULL
+ * @param *height		output of the line height; simply ignored if NULL
+ * @return GD_SUCCESS on success, otherwise GD_FAILURE.
+ */
+int gdPangoMetricsGetLine(gdPangoMetrics *metrics, int *ascent,
+	int *descent, int *height)
+{
+	if (metrics->height < 0) {
+		/* any simple glyph gives the line metrics of the font */
+		gdPangoMetricsGlyph(metrics, ' ');
+	}
+	if (metrics->height < 0 && metrics->font) {
+		PangoFontMetrics *font_metrics = pango_font_get_metrics(metrics->font,
+			pango_context_get_language(pango_layout_get_context(metrics->layout)));
+
+		metrics->baseline = pango_font_metrics_get_ascent(font_metrics);
+		metrics->height = metrics->baseline +
+			pango_font_metrics_get_descent(font_metrics);
+		pango_font_metrics_unref(font_metrics);
+	}
+	if (metrics->height < 0) {
+		return GD_FAILURE;
+	}
+
+	if (ascent) *ascent = metrics->baseline;
+	if (descent) *descent = metrics->height - metrics->baseline;
+	if (height) *height = metrics->height;
+	return GD_SUCCESS;
+}
+
+/**
+ * Specify minimum size of drawing rect.
+ *
+ * @param *context	Context
+ * @param width		Width. -1 means no wrapping mode.
+ * @param height		Height. zero/minus value means non-specified.
+ */
+void gdPangoSetMinimumSize(gdPangoContext *context, int width, int height)
+{
+	int pango_width;
+	if (width > 0) {
+		pango_width = width * PANGO_SCALE;
+	} else {
+		pango_width = -1;
+	}
+
+	pango_layout_set_width(context->layout, pango_width);
+
+	context->min_width = width;
+	context->min_height = height;
+}
+
+/**
+ * Specify default color.
+ *
+ * Define the default foreground, background and alpha component.
+ *
+ * @param *context	gdPangoContext context
+ * @param *colors		a gdPangoColors ptr, defines fg, bg or alpha default
+ */
+void gdPangoSetDefaultColor(gdPangoContext *context,
+	const gdPangoColors  *colors)
+{
+	context->default_colors = *colors;
+}
+
+/**
+ * Get layout width.
+ *
+ * @param *context gdPangoContext context
+ * @return Width
+ */
+int gdPangoGetLayoutWidth(gdPangoContext *context)
+{
+	PangoRectangle logical_rect;
+
+	gdPangoGetExtents(context, NULL, &logical_rect);
+	return PANGO_PIXELS(logical_rect.width);
+}
+
+/**
+ * Get layout height.
+ *
+ * @param *context	Context
+ * @return Height
+ */
+int gdPangoGetLayoutHeight(gdPangoContext *context)
+{
+	PangoRectangle logical_rect;
+
+	gdPangoGetExtents(context, NULL, &logical_rect);
+	return PANGO_PIXELS (logical_rect.height);
+}
+
+/*
+ * Set text and attributes to the layout, or record them until the update
+ * is committed. attrs is not taken, NULL means no attributes.
+ */
+static void gdPangoApplyText(gdPangoContext *context, const char *text,
+	int length, PangoAttrList *attrs)
+{
+	gdPangoPending *pending = &context->pending;
+
+	if (!context->updating) {
+		pango_layout_set_text(context->layout, text, length);
+		pango_layout_set_attributes(context->layout, attrs);
+		pango_layout_set_auto_dir(context->layout, TRUE);
+		pango_layout_set_font_description(context->layout, context->font_desc);
+		gdPangoResolveFallback(context);
+		return;
+	}
+
+	if (length < 0) {
+		length = strlen(text);
+	}
+	g_free(pending->text);
+	pending->text = g_strndup(text, length);
+	pending->length = length;
+	if (pending->attrs) {
+		pango_attr_list_unref(pending->attrs);
+	}
+	pending->attrs = attrs ? pango_attr_list_ref(attrs) : NULL;
+	pending->flags |= GD_PANGO_PENDING_TEXT | GD_PANGO_PENDING_FONT;
+}
+
+/**
+ * Set markup text to context.
+ * Text must be utf-8.
+ * Markup format is same as pango.
+ *
+ * The markup is parsed on each call, use gdPangoCompileMarkup and
+ * gdPangoSetCompiledMarkup for a text set more than once.
+ *
+ * @param *context 	gdPangoContex ptr
+ * @param *markup		const char Markup text
+ * @param length	 	Text length. -1 means NULL-terminated text.
+ */
+void gdPangoSetMarkup(gdPangoContext *context, const char *markup,
+	const int length)
+{
+	gdPangoMarkup *compiled;
+
+	if (!context->updating) {
+		pango_layout_set_markup(context->layout, markup, length);
+		pango_layout_set_auto_dir(context->layout, TRUE);
+		pango_layout_set_font_description(context->layout, context->font_desc);
+		gdPangoResolveFallback(context);
+		return;
+	}
+
+	compiled = gdPangoCompileMarkup(markup, length, NULL);
+	if (compiled) {
+		gdPangoSetCompiledMarkup(context, compiled);
+		gdPangoFreeMarkup(compiled);
+	}
+}
+
+/**
+ * Set plain text to context.
+ * Text must be utf-8.
+ *
+ * @param *context	Context
+ * @param *text		Plain text
+ * @param length		Text length. -1 means NULL-terminated text.
+ */
+void gdPangoSetText(gdPangoContext *context, const char *text,
+	int length)
+{
+	gdPangoApplyText(context, text, length, NULL);
+	gdPangoSetAlignment(context, PANGO_ALIGN_LEFT);
+}
+
+/**
+ * Compile a markup text.
+ *
+ * The markup is parsed once, the result can be set to any number of
+ * contexts with gdPangoSetCompiledMarkup.
+ *
+ * @param *markup		Markup text
+ * @param length		Text length. -1 means NULL-terminated text.
+ * @param *error		output of error code on failure; simply ignored if
+ *							error = NULL
+ * @return A pointer to the compiled markup as a gdPangoMarkup*, or NULL
+ *			on failure.
+ */
+gdPangoMarkup* gdPangoCompileMarkup(const char *markup, int length,
+	int *error)
+{
+	gdPangoMarkup *compiled;
+	PangoAttrList *attrs;
+	char *text;
+
+	if (!markup || !pango_parse_markup(markup, length, 0, &attrs, &text, NULL, NULL)) {
+		if (error) *error = GD_PANGO_ERROR_MARKUP;
+		return NULL;
+	}
+
+	compiled = (gdPangoMarkup *)g_malloc(sizeof(gdPangoMarkup));
+	compiled->text = text;
+	compiled->length = strlen(text);
+	compiled->attrs = attrs;
+	return compiled;
+}
+
+/**
+ * Free a compiled markup.
+ *
+ * @param *markup	Compiled markup to be freed
+ */
+void gdPangoFreeMarkup(gdPangoMarkup *markup)
+{
+	pango_attr_list_unref(markup->attrs);
+	g_free(markup->text);
+	g_free(markup);
+}
+
+/**
+ * Set a compiled markup to context.
+ *
+ * Same as gdPangoSetMarkup without parsing the markup. The attributes
+ * are shared with the layout, the compiled markup can be freed at once.
+ *
+ * @param *context	Context
+ * @param *markup		Compiled markup
+ */
+void gdPangoSetCompiledMarkup(gdPangoContext *context,
+	const gdPangoMarkup *markup)
+{
+	gdPangoApplyText(context, markup->text, markup->length, markup->attrs);
+}
+
+/**
+ * Set the font description of context.
+ *
+ * @param *context	Context
+ * @param *font_desc	Font description, copied
+ */
+void gdPangoSetFontDescription(gdPangoContext *context,
+	const PangoFontDescription *font_desc)
+{
+	pango_font_description_free(context->font_desc);
+	context->font_desc = pango_font_description_copy(font_desc);
+
+	if (context->updating) {
+		context->pending.flags |= GD_PANGO_PENDING_FONT;
+	} else {
+		pango_layout_set_font_description(context->layout, context->font_desc);
+	}
+}
+
+/**
+ * Set the wrapping width of context.
+ *
+ * @param *context	Context
+ * @param width		Width in pixels, -1 for no wrapping
+ */
+void gdPangoSetWidth(gdPangoContext *context, int width)
+{
+	width = width < 0 ? -1 : width * PANGO_SCALE;
+
+	if (context->updating) {
+		context->pending.width = width;
+		context->pending.flags |= GD_PANGO_PENDING_WIDTH;
+	} else {
+		pango_layout_set_width(context->layout, width);
+	}
+}
+
+/**
+ * Set the alignment of context.
+ *
+ * @param *context	Context
+ * @param alignment	Alignment of the lines
+ */
+void gdPangoSetAlignment(gdPangoContext *context, PangoAlignment alignment)
+{
+	if (context->updating) {
+		context->pending.alignment = alignment;
+		context->pending.flags |= GD_PANGO_PENDING_ALIGNMENT;
+	} else {
+		pango_layout_set_alignment(context->layout, alignment);
+	}
+}
+
+/**
+ * Start grouping the setters of context.
+ *
+ * Until gdPangoCommitUpdate, text, markup, font, width, alignment and
+ * base direction are recorded without touching the layout, so that the
+ * layout is invalidated once instead of once per setter. Calls can be
+ * nested, the update is applied by the outermost commit.
+ *
+ * @param *context	Context
+ */
+void gdPangoBeginUpdate(gdPangoContext *context)
+{
+	context->updating++;
+}
+
+/**
+ * Apply the setters recorded since gdPangoBeginUpdate.
+ *
+ * @param *context	Context
+ */
+void gdPangoCommitUpdate(gdPangoContext *context)
+{
+	gdPangoPending *pending = &context->pending;
+	PangoLayout *layout = context->layout;
+
+	if (context->updating == 0 || --context->updating > 0) {
+		return;
+	}
+
+	if (pending->flags & GD_PANGO_PENDING_DIRECTION) {
+		pango_context_set_base_dir(context->context, pending->direction);
+		pango_layout_context_changed(layout);
+	}
+	if (pending->flags & GD_PANGO_PENDING_TEXT) {
+		pango_layout_set_text(layout, pending->text, pending->length);
+		pango_layout_set_attributes(layout, pending->attrs);
+		pango_layout_set_auto_dir(layout, TRUE);
+		g_free(pending->text);
+		pending->text = NULL;
+		if (pending->attrs) {
+			pango_attr_list_unref(pending->attrs);
+			pending->attrs = NULL;
+		}
+	}
+	if (pending->flags & GD_PANGO_PENDING_FONT) {
+		pango_layout_set_font_description(layout, context->font_desc);
+	}
+	if (pending->flags & GD_PANGO_PENDING_WIDTH) {
+		pango_layout_set_width(layout, pending->width);
+	}
+	if (pending->flags & GD_PANGO_PENDING_ALIGNMENT) {
+		pango_layout_set_alignment(layout, pending->alignment);
+	}
+	if (pending->flags & (GD_PANGO_PENDING_TEXT | GD_PANGO_PENDING_FONT)) {
+		gdPangoResolveFallback(context);
+	}
+	pending->flags = 0;
+}
+
+/**
+ * Create a text template.
+ *
+ * The markup is parsed once. Fields are written {name} in the text,
+ * name being made of letters, digits and underscores; the attributes
+ * (spans, colors, ...) covering a field apply to its substituted value.
+ * Use gdPangoSetTemplate to fill the fields and set the result to a
+ * context.
+ *
+ * @param *markup		Markup text with fields
+ * @param length		Text length. -1 means NULL-terminated text.
+ * @param *error		output of error code on failure; simply ignored if
+ *							error = NULL
+ * @return A pointer to the template as a gdPangoTemplate*, or NULL on
+ *			failure.
+ */
+gdPangoTemplate* gdPangoCreateTemplate(const char *markup, int length,
+	int *error)
+{
+	gdPangoTemplate *tmpl;
+	PangoAttrList *attrs;
+	char *text, *p;
+	int n;
+
+	if (!markup || !pango_parse_markup(markup, length, 0, &attrs, &text, NULL, NULL)) {
+		if (error) *error = GD_PANGO_ERROR_MARKUP;
+		return NULL;
+	}
+
+	tmpl = (gdPangoTemplate *)g_malloc(sizeof(gdPangoTemplate));
+	tmpl->text = text;
+	tmpl->length = strlen(text);
+	tmpl->attrs = attrs;
+	tmpl->n_fields = 0;
+
+	/* count the fields first, then record them */
+	for (n = 0; n < 2; n++) {
+		int i = 0;
+
+		for (p = text; (p = strchr(p, '{')); ) {
+			char *end = p + 1;
+
+			while (g_ascii_isalnum(*end) || *end == '_') {
+				end++;
+			}
+			if (*end != '}' || end == p + 1) {
+				p++;
+				continue;
+			}
+			if (n == 1) {
+				tmpl->names[i] = g_strndup(p + 1, end - p - 1);
+				tmpl->starts[i] = p - text;
+				tmpl->ends[i] = end + 1 - text;
+			}
+			i++;
+			p = end + 1;
+		}
+
+		if (n == 0) {
+			tmpl->n_fields = i;
+			tmpl->names = g_new(char *, i + 1);
+			tmpl->starts = g_new(int, i + 1);
+			tmpl->ends = g_new(int, i + 1);
+		}
+	}
+
+	return tmpl;
+}
+
+/**
+ * Free a template.
+ *
+ * @param *tmpl		Template to be freed
+ */
+void gdPangoFreeTemplate(gdPangoTemplate *tmpl)
+{
+	int i;
+
+	for (i = 0; i < tmpl->n_fields; i++) {
+		g_free(tmpl->names[i]);
+	}
+	g_free(tmpl->names);
+	g_free(tmpl->starts);
+	g_free(tmpl->ends);
+	pango_attr_list_unref(tmpl->attrs);
+	g_free(tmpl->text);
+	g_free(tmpl);
+}
+
+/**
+ * Get the position of a field in a template.
+ *
+ * @param *tmpl		Template
+ * @param *name		Field name, without braces
+ * @return The index of the field in the values given to
+ *			gdPangoSetTemplate, or -1 if there is no such field.
+ */
+int gdPangoTemplateGetField(gdPangoTemplate *tmpl, const char *name)
+{
+	int i;
+
+	for (i = 0; i < tmpl->n_fields; i++) {
+		if (strcmp(tmpl->names[i], name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+typedef struct {
+	gdPangoTemplate *tmpl;
+	const int *shifts;  /* size change of the text after each field */
+	const int *lengths; /* value lengths */
+	PangoAttrList *attrs;
+} gdPangoTemplateApply;
+
+/*
+ * Map a byte index of the template text to the filled text. An index
+ * inside a field moves to the start of the value, or to its end for
+ * the end of a range.
+ */
+static guint gdPangoTemplateMapIndex(const gdPangoTemplateApply *apply,
+	guint index, int is_end)
+{
+	gdPangoTemplate *tmpl = apply->tmpl;
+	int i, shift = 0;
+
+	if (index == PANGO_ATTR_INDEX_TO_TEXT_END) {
+		return index;
+	}
+	for (i = 0; i < tmpl->n_fields; i++) {
+		if ((int)index <= tmpl->starts[i]) {
+			break;
+		}
+		if ((int)index < tmpl->ends[i]) {
+			return tmpl->starts[i] + shift + (is_end ? apply->lengths[i] : 0);
+		}
+		shift = apply->shifts[i];
+	}
+	return index + shift;
+}
+
+static gboolean gdPangoTemplateCopyAttr(PangoAttribute *attr, gpointer data)
+{
+	gdPangoTemplateApply *apply = (gdPangoTemplateApply *)data;
+	PangoAttribute *copy = pango_attribute_copy(attr);
+
+	copy->start_index = gdPangoTemplateMapIndex(apply, attr->start_index, 0);
+	copy->end_index = gdPangoTemplateMapIndex(apply, attr->end_index, 1);
+	pango_attr_list_insert(apply->attrs, copy);
+
+	/* keep the attribute in the template */
+	return FALSE;
+}
+
+/**
+ * Fill the fields of a template and set the result to context.
+ *
+ * No markup is parsed, the attributes of the template are moved to the
+ * substituted values.
+ *
+ * @param *context	Context
+ * @param *tmpl		Template
+ * @param **values	Plain utf-8 text of each field, in the order of the
+ *							fields (see gdPangoTemplateGetField). A NULL value
+ *							is an empty string.
+ * @param n_values	Number of values, missing values are empty strings
+ * @return GD_SUCCESS on success, otherwise GD_FAILURE.
+ */
+int gdPangoSetTemplate(gdPangoContext *context, gdPangoTemplate *tmpl,
+	const char **values, int n_values)
+{
+	gdPangoTemplateApply apply;
+	GString *text;
+	int *shifts, *lengths;
+	int i, last = 0, shift = 0;
+
+	if (!tmpl) {
+		return GD_FAILURE;
+	}
+
+	shifts = g_new(int, tmpl->n_fields + 1);
+	lengths = g_new(int, tmpl->n_fields + 1);
+	text = g_string_sized_new(tmpl->length + 64);
+
+	for (i = 0; i < tmpl->n_fields; i++) {
+		const char *value = (values && i < n_values && values[i]) ? values[i] : "";
+
+		lengths[i] = strlen(value);
+		g_string_append_len(text, tmpl->text + last, tmpl->starts[i] - last);
+		g_string_append_len(text, value, lengths[i]);
+		last = tmpl->ends[i];
+		shift += lengths[i] - (tmpl->ends[i] - tmpl->starts[i]);
+		shifts[i] = shift;
+	}
+	g_string_append_len(text, tmpl->text + last, tmpl->length - last);
+
+	apply.tmpl = tmpl;
+	apply.shifts = shifts;
+	apply.lengths = lengths;
+	apply.attrs = pango_attr_list_new();
+	pango_attr_list_filter(tmpl->attrs, gdPangoTemplateCopyAttr, &apply);
+
+	gdPangoApplyText(context, text->str, text->len, apply.attrs);
+
+	pango_attr_list_unref(apply.attrs);
+	g_string_free(text, TRUE);
+	g_free(lengths);
+	g_free(shifts);
+
+	return GD_SUCCESS;
+}
+
+/**
+ * Draw a halo around the text.
+ *
+ * The coverage of each run is dilated once by radius pixels and the halo
+ * is composited under the text in the same pass. Map labels usually use
+ * a radius of 1 to 3 pixels. The halo is not clipped to the layout
+ * size, see gdPangoCreateSurfaceDrawInk for a surface with room for it.
+ *
+ * @param *context	Context
+ * @param radius		Halo width in pixels, 0 to disable the halo
+ * @param color		Halo color, as returned by gdTrueColor(r,g,b)
+ */
+void gdPangoSetHalo(gdPangoContext *context, int radius, int color)
+{
+	context->effects.halo_radius = MAX(radius, 0);
+	context->effects.halo_color = color & 0xFFFFFF;
+}
+
+/**
+ * Draw a drop shadow under the text.
+ *
+ * The coverage of each run is moved by the offset and blurred with three
+ * box blurs, an approximation of a gaussian blur costing the same for
+ * any radius. Only the area around the ink is processed and the shadow
+ * is composited under the text in the same pass.
+ *
+ * @param *context	Context
+ * @param dx			Horizontal offset in pixels
+ * @param dy			Vertical offset in pixels
+ * @param radius		Blur radius in pixels, 0 for a sharp shadow
+ * @param color		Shadow color, as returned by gdTrueColor(r,g,b)
+ */
+void gdPangoSetShadow(gdPangoContext *context, int dx, int dy, int radius,
+	int color)
+{
+	context->effects.shadow_dx = dx;
+	context->effects.shadow_dy = dy;
+	context->effects.shadow_radius = MAX(radius, 0);
+	context->effects.shadow_color = color & 0xFFFFFF;
+}
+
+/**
+ * Set DPI to context.
+ *
+ * @param *context	Context
+ * @param dpi_x 	Horizontal dpi
+ * @param dpi_y 	Vertical dpi
+ */
+void gdPangoSetDpi(gdPangoContext *context,
+	double dpi_x, double dpi_y)
+{
+	if (context->shared) {
+		/* the other contexts of the thread keep their resolution */
+		gdPangoUseSharedMap(context, gdPangoGetSharedMap(dpi_x, dpi_y, context->quality));
+		g_object_unref(context->font_map);
+		context->font_map = g_object_ref(context->shared->font_map);
+		pango_context_set_font_map(context->context, context->font_map);
+		pango_layout_context_changed(context->layout);
+	} else {
+		pango_ft2_font_map_set_resolution(PANGO_FT2_FONT_MAP(context->font_map),
+			dpi_x, dpi_y);
+	}
+	context->dpi_x = dpi_x;
+	context->dpi_y = dpi_y;
+	/* the fonts are not the same anymore */
+	gdPangoContextFreeMetrics(context);
+	gdPangoFreeScaled(context);
+	gdPangoFreeSDF(context);
+}
+
+/**
+ * Set the rendering quality of a context.
+ *
+ * GD_PANGO_QUALITY_DRAFT draws monochrome glyphs with full hinting on
+ * whole pixel positions, for thumbnails and previews; halos and shadows
+ * keep their soft edges.
+ * GD_PANGO_QUALITY_HIGH draws antialiased glyphs with slight hinting on
+ * subpixel positions. GD_PANGO_QUALITY_NORMAL, the default, keeps the
+ * fontconfig settings of the system.
+ *
+ * The tiers use different fonts, so glyph cache files keep the glyphs
+ * of each tier apart.
+ *
+ * @param *context	Context
+ * @param quality	GD_PANGO_QUALITY_*
+ */
+void gdPangoSetQuality(gdPangoContext *context, int quality)
+{
+	if (quality < GD_PANGO_QUALITY_DRAFT || quality > GD_PANGO_QUALITY_HIGH ||
+		quality == context->quality) {
+		return;
+	}
+	context->quality = quality;
+	if (context->shared) {
+		gdPangoUseSharedMap(context, gdPangoGetSharedMap(context->dpi_x, context->dpi_y, quality));
+		g_object_unref(context->font_map);
+		context->font_map = g_object_ref(context->shared->font_map);
+		pango_context_set_font_map(context->context, context->font_map);
+	} else {
+		gdPangoSetMapQuality(context->font_map, quality);
+	}
+#if PANGO_VERSION_CHECK(1, 44, 0)
+	/* metrics hinting, or subpixel positioning */
+	pango_context_set_round_glyph_positions(context->context,
+		quality != GD_PANGO_QUALITY_HIGH);
+#endif
+	pango_layout_context_changed(context->layout);
+	gdPangoContextFreeMetrics(context);
+	gdPangoFreeScaled(context);
+	gdPangoFreeSDF(context);
+	if (context->cache_fonts) {
+		g_hash_table_remove_all(context->cache_fonts);
+	}
+}
+
+/**
+ * Get the rendering quality of a context.
+ *
+ * @param *context	Context
+ * @return GD_PANGO_QUALITY_*
+ */
+int gdPangoGetQuality(gdPangoContext *context)
+{
+	return context->quality;
+}
+
+/**
+ * Enable or disable the counters of a context.
+ *
+ * While enabled, the drawing functions count the lines, runs, glyphs
+ * and pixels they draw and gdPangoRenderTo times its layout,
+ * rasterization and blit phases, see gdPangoStats. The counts are added
+ * to the global statistics after each call drawing the text (render,
+ * tiles, bands, labels and documents), when they are read and when the
+ * counters are disabled. Disabled counters, the
+ * default, cost a pointer test.
+ *
+ * @param *context	Context
+ * @param enable	Non-zero to enable the counters, zero to disable them
+ */
+void gdPangoEnableStats(gdPangoContext *context, int enable)
+{
+	if (enable && !context->stats) {
+		context->stats = g_new0(gdPangoStats, 2);
+	} else if (!enable && context->stats) {
+		gdPangoFlushStats(context);
+		g_free(context->stats);
+		context->stats = NULL;
+	}
+}
+
+/**
+ * Get the counters of a context since they were enabled or reset.
+ *
+ * @param *context	Context
+ * @param *stats	Output of the counters, all zero when disabled
+ */
+void gdPangoGetStats(gdPangoContext *context, gdPangoStats *stats)
+{
+	if (context->stats) {
+		gdPangoFlushStats(context);
+		*stats = context->stats[0];
+	} else {
+		memset(stats, 0, sizeof(gdPangoStats));
+	}
+}
+
+/**
+ * Set the counters of a context back to zero. The global statistics
+ * keep the counts.
+ *
+ * @param *context	Context
+ */
+void gdPangoResetStats(gdPangoContext *context)
+{
+	if (context->stats) {
+		gdPangoFlushStats(context);
+		memset(context->stats, 0, 2 * sizeof(gdPangoStats));
+	}
+}
+
+/**
+ * Get the sum of the counters of all the contexts, which can be read
+ * from any thread.
+ *
+ * @param *stats	Output of the counters
+ */
+void gdPangoGetGlobalStats(gdPangoStats *stats)
+{
+	G_LOCK(gdPangoGlobalStats);
+	*stats = gdPangoGlobalStats;
+	G_UNLOCK(gdPangoGlobalStats);
+}
 
-	context->ft2bmp = NULL;
+/**
+ * Set the global statistics back to zero.
+ */
+void gdPangoResetGlobalStats(void)
+{
+	G_LOCK(gdPangoGlobalStats);
+	memset(&gdPangoGlobalStats, 0, sizeof(gdPangoStats));
+	G_UNLOCK(gdPangoGlobalStats);
+}
 
-	context->min_height = 0;
-	context->min_width = 0;
-	context->angle = 0.0;
+/**
+ * Set base direction to context.
+ *
+ * @param *context	Context
+ * @param direction	Direction
+ */
+void gdPangoSetBaseDirection(gdPangoContext *context,
+	PangoDirection direction)
+{
+	if (context->updating) {
+		context->pending.direction = direction;
+		context->pending.flags |= GD_PANGO_PENDING_DIRECTION;
+	} else {
+		pango_context_set_base_dir (context->context, direction);
+	}
+}
 
-	return context;
+/**
+ * Set font description from a ttf file.
+ *
+ * @param *context Context
+ * @param *fontlist path to ttf file
+ * @param ptsize font size in points
+ * @param *error output of error code on failure; simply ignored if error = NULL
+ * @return GD_SUCCESS on success, otherwise GD_FAILURE.
+ */
+int gdPangoSetPangoFontDescriptionFromFile(gdPangoContext *context, const char
+		*fontlist, double ptsize, int *error)
+{
+	FcPattern *fcPattern;
+	FcBlanks *fcBlanks;
+	FcValue fcFamilyName;
+	FcResult fcResult;
+	int numFonts;
+	char *font_desc;
+	int n, r = GD_FAILURE;
+
+	fcBlanks = FcBlanksCreate();
+	fcPattern = FcFreeTypeQuery((FcChar8 *)fontlist, 0, fcBlanks, &numFonts);
+	if (!fcPattern) {
+		if (error) *error = GD_PANGO_ERROR_FC_FT;
+		goto fail0;
+	}
+	fcResult = FcPatternGet(fcPattern, FC_FAMILY, 0, &fcFamilyName);
+	if (fcResult != FcResultMatch) {
+		if (error) *error = GD_PANGO_ERROR_FC_PAT;
+		goto fail1;
+	}
+
+	n = snprintf(NULL, 0, "%s %f", fcFamilyName.u.s, ptsize);
+	if (n <= 0) {
+		if (error) *error = GD_PANGO_ERROR_FORMAT;
+		goto fail1;
+	}
+	font_desc = (char *)g_malloc(n + 1);
+	n = snprintf(font_desc, n + 1, "%s %f", fcFamilyName.u.s, ptsize);
+	if (n <= 0) {
+		if (error) *error = GD_PANGO_ERROR_FORMAT;
+		goto fail2;
+	}
+	context->font_desc = pango_font_description_from_string(font_desc);
+	r = GD_SUCCESS;
+ fail2:
+	g_free(font_desc);
+ fail1:
+	FcPatternDestroy(fcPattern);
+ fail0:
+	FcBlanksDestroy(fcBlanks);
+	return r;
+}
+
+/*
+ * Private font registry.
+ *
+ * The fonts live in a fontconfig configuration of their own: no system
+ * font is scanned, and a font can only resolve to a registered face.
+ * Fonts given in memory are written to a memory file (memfd) where the
+ * system has it, so that FreeType and fontconfig can open them by path.
+ * Each face also answers to a family of its own, so that a handle
+ * resolves to its face even when several faces share a family and style.
+ */
+struct gdPangoFontRegistry {
+	int refs;
+	GMutex lock;       /* guards faces and the fonts of config */
+	FcConfig *config;
+	GPtrArray *faces;  /* FcPattern of each handle */
+	GArray *fds;       /* memory files, open as long as the registry */
+	GPtrArray *paths;  /* temporary files without memfd */
+};
+
+/* the family only the face of a handle answers to */
+static void gdPangoFaceFamily(int handle, char *family, int size)
+{
+	g_snprintf(family, size, "gd-pango-face-%d", handle);
 }
 
 /**
- * Free a context.
+ * Create a private font registry.
  *
- * @param *context	Context to be freed
+ * @return The registry, to be freed with gdPangoFreeFontRegistry.
  */
-void gdPangoFreeContext(gdPangoContext *context)
+gdPangoFontRegistry* gdPangoCreateFontRegistry(void)
 {
-	gdPangoFreeFTBitmap(context->ft2bmp);
-	g_object_unref(context->layout);
-	pango_font_description_free(context->font_desc);
-	g_object_unref(context->context);
-	g_object_unref(context->font_map);
-	g_free(context);
+	gdPangoFontRegistry *registry = g_new(gdPangoFontRegistry, 1);
+
+	registry->refs = 1;
+	g_mutex_init(&registry->lock);
+	registry->config = FcConfigCreate();
+	registry->faces = g_ptr_array_new_with_free_func((GDestroyNotify)FcPatternDestroy);
+	registry->fds = g_array_new(FALSE, FALSE, sizeof(int));
+	registry->paths = g_ptr_array_new_with_free_func(g_free);
+	return registry;
 }
 
-/*!
-    Create a surface and draw text on it.
-    The size of surface is same as layout size.
+static gdPangoFontRegistry *gdPangoRefFontRegistry(gdPangoFontRegistry *registry)
+{
+	g_atomic_int_inc(&registry->refs);
+	return registry;
+}
 
-    @param *context [in] Context
-    @return A newly created surface
-*/
-gdImagePtr gdPangoCreateSurfaceDraw(gdPangoContext *context)
+/**
+ * Free a font registry. Contexts created from it keep it until they are
+ * freed.
+ *
+ * @param *registry	Registry to be freed
+ */
+void gdPangoFreeFontRegistry(gdPangoFontRegistry *registry)
 {
-	gdImagePtr surface = NULL;
+	guint i;
 
-	surface = gdPangoRenderTo(context, surface, 0, 0);
-	return surface;
+	if (!g_atomic_int_dec_and_test(&registry->refs)) {
+		return;
+	}
+	FcConfigDestroy(registry->config);
+	for (i = 0; i < registry->fds->len; i++) {
+		close(g_array_index(registry->fds, int, i));
+	}
+	for (i = 0; i < registry->paths->len; i++) {
+		g_unlink((const char *)g_ptr_array_index(registry->paths, i));
+	}
+	g_ptr_array_free(registry->faces, TRUE);
+	g_array_free(registry->fds, TRUE);
+	g_ptr_array_free(registry->paths, TRUE);
+	g_mutex_clear(&registry->lock);
+	g_free(registry);
 }
 
 /**
- * Render the text to the given image.
+ * Register a font file.
  *
- * Render the text to the given image. The (x,y) coordinate set the top
- * left corner of the text rectangle.
+ * The file is used in place, it can be a file mapped by the application.
+ * Contexts created from the registry afterwards can use the font. Every
+ * face of a font collection (TTC) is registered, with consecutive
+ * handles from the returned one.
  *
- * @param *context	Context
- * @param *surface	Surface to draw on it
- * @param x				X of left-top of drawing area
- * @param y				Y of left-top of drawing area
+ * Registering is guarded by a lock, but fontconfig does not guard its
+ * configuration against lookups made meanwhile: register the fonts
+ * before contexts of the registry draw on other threads.
+ *
+ * @param *registry	Registry
+ * @param *path		Font file
+ * @param *error		output of error code on failure; simply ignored if
+ *							error = NULL
+ * @return The handle of the first face of the font, or GD_FAILURE.
  */
-gdImagePtr gdPangoRenderTo(gdPangoContext *context, gdImage* surface, int x, int y)
+int gdPangoRegisterFontFile(gdPangoFontRegistry *registry, const char *path,
+	int *error)
 {
-	PangoRectangle logical_rect, brect;
-	int rotated;
-	double angle = 0;
-	int new_w, new_h;
+	FcFontSet *fonts;
+	FcPattern *pattern;
+	int *handles;
+	int i, count, first, index, scanned = 0;
+	char family[32];
 
-	pango_layout_get_extents(context->layout, NULL, &logical_rect);
+	pattern = FcFreeTypeQuery((const FcChar8 *)path, 0, NULL, &count);
+	if (!pattern) {
+		if (error) *error = GD_PANGO_ERROR_FC_FT;
+		return GD_FAILURE;
+	}
 
-	brect = logical_rect; /* copy in pango units */
-	pango_extents_to_pixels (&logical_rect, NULL);
+	g_mutex_lock(&registry->lock);
+	fonts = FcConfigGetFonts(registry->config, FcSetApplication);
+	if (fonts) {
+		scanned = fonts->nfont;
+	}
+	if (!FcConfigAppFontAddFile(registry->config, (const FcChar8 *)path)) {
+		g_mutex_unlock(&registry->lock);
+		FcPatternDestroy(pattern);
+		if (error) *error = GD_PANGO_ERROR_FC_PAT;
+		return GD_FAILURE;
+	}
 
-	rotated = (pango_context_get_matrix(context->context) != NULL);
+	/* one handle per face */
+	first = registry->faces->len;
+	count = MAX(count, 1);
+	handles = g_new(int, count);
+	for (i = 0; i < count; i++) {
+		if (i > 0) {
+			pattern = FcFreeTypeQuery((const FcChar8 *)path, i, NULL, NULL);
+		}
+		handles[i] = -1;
+		if (pattern) {
+			handles[i] = registry->faces->len;
+			g_ptr_array_add(registry->faces, pattern);
+		}
+	}
 
-	/* check if a matrix has been used
-	 * NB: other transformations are not supported yet. GD2 Renderer class
-	 * is required.
-	 */
-	if (rotated) {
-		angle = context->angle * G_PI/180;
+	/* the faces just scanned answer to the families of their handles;
+	   named instances of variable fonts keep their own names */
+	fonts = FcConfigGetFonts(registry->config, FcSetApplication);
+	for (i = scanned; fonts && i < fonts->nfont; i++) {
+		if (FcPatternGetInteger(fonts->fonts[i], FC_INDEX, 0, &index) != FcResultMatch ||
+			index < 0 || index >= count || handles[index] < 0) {
+			continue;
+		}
+		gdPangoFaceFamily(handles[index], family, sizeof(family));
+		FcPatternAddString(fonts->fonts[i], FC_FAMILY, (const FcChar8 *)family);
+	}
+	g_mutex_unlock(&registry->lock);
+	g_free(handles);
+	return first;
+}
 
-		pango_matrix_transform_rectangle (
-				pango_context_get_matrix(context->context),
-				&brect);
-		pango_extents_to_pixels (&brect, NULL);
-		new_w = brect.width;
-		new_h = brect.height;
+/**
+ * Register a font given in memory.
+ *
+ * The data is copied to a memory file, or a temporary file where memory
+ * files are not available, so it can be freed after the call.
+ *
+ * @param *registry	Registry
+ * @param *data		Font file contents
+ * @param size			Size of data in bytes
+ * @param *error		output of error code on failure; simply ignored if
+ *							error = NULL
+ * @return The handle of the first face of the font, or GD_FAILURE.
+ */
+int gdPangoRegisterFontData(gdPangoFontRegistry *registry, const void *data,
+	size_t size, int *error)
+{
+	const char *p = (const char *)data;
+	char *path = NULL;
+	size_t done = 0;
+	int fd, handle;
 
-		/* Right aligned rotated layout has different widths than the same contents
-		 * but left aligned
-		if (pango_layout_get_alignment(context->layout) != PANGO_ALIGN_LEFT) {
-			new_w = abs(sin(angle) * logical_rect.height + cos(angle) * logical_rect.width);
-		};
-		 */
-	} else {
-		new_w = logical_rect.width;
-		new_h = logical_rect.height;
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+	fd = memfd_create("gd-pango-font", MFD_CLOEXEC);
+	if (fd >= 0) {
+		path = g_strdup_printf("/proc/self/fd/%d", fd);
 	}
+#else
+	fd = g_file_open_tmp("gd-pango-font-XXXXXX", &path, NULL);
+#endif
+	if (fd < 0) {
+		if (error) *error = GD_PANGO_ERROR_FC_FT;
+		return GD_FAILURE;
+	}
+	while (done < size) {
+		ssize_t n = write(fd, p + done, size - done);
 
-	if (context->ft2bmp) {
-		gdPangoModifyFTBitmap(context->ft2bmp, new_w, new_h);
-	} else {
-		context->ft2bmp = gdPangoCreateFTBitmap(new_w, new_h);
+		if (n <= 0) {
+			break;
+		}
+		done += n;
 	}
 
-	if (!surface) {
-		surface = gdImageCreateTrueColor(new_w, new_h);
-		if (!surface) {
-			return NULL;
+	handle = done == size ? gdPangoRegisterFontFile(registry, path, error) : GD_FAILURE;
+	if (handle == GD_FAILURE) {
+		if (done != size && error) *error = GD_PANGO_ERROR_FC_FT;
+		close(fd);
+#if !(defined(__linux__) && defined(MFD_CLOEXEC))
+		g_unlink(path);
+#endif
+		g_free(path);
+		return GD_FAILURE;
+	}
+	g_array_append_val(registry->fds, fd);
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+	g_free(path);
+#else
+	g_ptr_array_add(registry->paths, path);
+#endif
+	return handle;
+}
+
+/**
+ * Create a context using only the fonts of a registry.
+ *
+ * The context has its own font map on the configuration of the registry,
+ * so it can be used from any thread. Characters missing from the
+ * registered fonts are drawn as unknown glyphs.
+ *
+ * @param *registry	Registry
+ * @return A pointer to the context as a gdPangoContext*.
+ */
+gdPangoContext* gdPangoCreateRegistryContext(gdPangoFontRegistry *registry)
+{
+	PangoFontMap *font_map = pango_ft2_font_map_new();
+	gdPangoContext *context;
+
+	pango_fc_font_map_set_config(PANGO_FC_FONT_MAP(font_map), registry->config);
+	pango_ft2_font_map_set_resolution(PANGO_FT2_FONT_MAP(font_map),
+		GD_PANGO_DEFAULT_DPI, GD_PANGO_DEFAULT_DPI);
+	context = gdPangoNewContext(font_map);
+	context->registry = gdPangoRefFontRegistry(registry);
+	return context;
+}
+
+/**
+ * Set a registered font to context.
+ *
+ * @param *context	Context created by gdPangoCreateRegistryContext
+ * @param handle		Handle of the font
+ * @param ptsize		Font size in points
+ * @param *error		output of error code on failure; simply ignored if
+ *							error = NULL
+ * @return GD_SUCCESS on success, otherwise GD_FAILURE.
+ */
+int gdPangoSetRegisteredFont(gdPangoContext *context, int handle,
+	double ptsize, int *error)
+{
+	gdPangoFontRegistry *registry = context->registry;
+	PangoFontDescription *font_desc = NULL;
+	char family[32];
+
+	if (registry) {
+		g_mutex_lock(&registry->lock);
+		if (handle >= 0 && handle < (int)registry->faces->len) {
+			font_desc = pango_fc_font_description_from_pattern(
+				(FcPattern *)g_ptr_array_index(registry->faces, handle), FALSE);
 		}
+		g_mutex_unlock(&registry->lock);
 	}
+	if (!font_desc) {
+		if (error) *error = GD_PANGO_ERROR_FONT;
+		return GD_FAILURE;
+	}
+	/* the family of the face alone, not the faces sharing its name */
+	gdPangoFaceFamily(handle, family, sizeof(family));
+	pango_font_description_set_family(font_desc, family);
+	pango_font_description_set_size(font_desc, (int)(ptsize * PANGO_SCALE + 0.5));
+	gdPangoSetFontDescription(context, font_desc);
+	pango_font_description_free(font_desc);
+	return GD_SUCCESS;
+}
 
-	if (rotated) {
-		int layout_x = 0, layout_y = 0;
-		gdRect rect;
+PangoFontMap* gdPangoGetPangoFontMap(gdPangoContext *context)
+{
+	return context->font_map;
+}
 
-		angle = fmod(angle, 2*G_PI);
-		angle = angle > G_PI ? angle - 2*G_PI : angle;
-		if (angle > 0. && angle < G_PI/2) {
-			layout_x =  brect.y * sin(angle);
-			layout_y = -brect.y * cos(angle);
-		} else if (angle >= -G_PI/2 && angle <= 0.) {
-			layout_x =  -brect.x * cos(angle);
-			layout_y =  -brect.x * sin(angle);
-		} else if (angle >= G_PI/2 && angle <= G_PI) {
-			layout_x = -logical_rect.width + logical_rect.height * cos(angle) * sin(angle);
-			layout_y = -logical_rect.height * cos(angle) * cos(angle);
-		} else if (angle >= -G_PI && angle < -G_PI/2) {
-			layout_x = -logical_rect.width * cos(angle) * cos(angle);
-			layout_y = -logical_rect.height - (logical_rect.width * cos(angle) * sin(angle));
-		} else {
-			fprintf(stderr, "angle %f not handled\n", angle * 180/G_PI);
+PangoFontDescription* gdPangoGetPangoFontDescription(gdPangoContext *context)
+{
+    return context->font_desc;
+}
+
+/**
+ * Returns the internal pango_context pointer.
+ *
+ * This pointer can then be used directly with Pango. There is no need for
+ * GD to duplicate the pango API.
+ *
+ * @param *context     PangoContext * Context
+ */
+PangoContext* gdPangoGetPangoContext(gdPangoContext *context)
+{
+	return context->context;
+}
+
+/**
+ * Returns the internal pango_layout pointer.
+ *
+ * This pointer can then be used directly with Pango. There is no need for
+ * GD to duplicate the pango API.
+ *
+ * @param *context     gdPangoContext Context
+ */
+PangoLayout* gdPangoGetPangoLayout(gdPangoContext *context)
+{
+	return context->layout;
+}
+
+/*
+ * Copy the text into the document and split it into paragraphs, all
+ * unmeasured and not laid out.
+ */
+static void gdPangoDocumentSplit(gdPangoDocument *document, const char *text,
+	int length)
+{
+	const char *p, *end;
+	int i, n;
+
+	if (length < 0) {
+		length = strlen(text);
+	}
+	document->text = g_strndup(text, length);
+	document->length = length;
+
+	n = 1;
+	end = document->text + length;
+	for (p = document->text; p < end; p++) {
+		if (*p == '\n') {
+			n++;
 		}
-		
-		rect.x = x + brect.x;
-		rect.y = y + brect.y;
-		rect.width = new_w;
-		rect.height = new_h;
+	}
 
-		pango_ft2_render_layout(context->ft2bmp, context->layout, layout_x, layout_y);
-		gdPangoCopyFTBitmapToSurface(context->ft2bmp, surface, &context->default_colors, &rect);
-	} else {
-		PangoLayoutIter *iter = pango_layout_get_iter(context->layout);
+	document->paragraphs = g_new0(gdPangoParagraph, n);
+	document->n_paragraphs = n;
 
-		do {
-			gdPangoRenderLine(context, surface, iter, x, y);
-		} while (pango_layout_iter_next_line(iter));
+	n = 0;
+	document->paragraphs[0].offset = 0;
+	for (p = document->text; p < end; p++) {
+		if (*p == '\n') {
+			document->paragraphs[n].length = (p - document->text) - document->paragraphs[n].offset;
+			n++;
+			document->paragraphs[n].offset = (p - document->text) + 1;
+		}
+	}
+	document->paragraphs[n].length = length - document->paragraphs[n].offset;
 
-		pango_layout_iter_free (iter);
+	for (i = 0; i < document->n_paragraphs; i++) {
+		document->paragraphs[i].height = -1;
+		document->paragraphs[i].dirty = 1;
 	}
-	return surface;
 }
 
 /**
- * Specify minimum size of drawing rect.
+ * Create a paginated document.
+ *
+ * The text is split at paragraph boundaries (new lines); paragraphs are
+ * laid out on demand, when a page or a range of rows is rendered, and
+ * only their heights are kept afterwards. The font, the wrapping width
+ * and the colors are taken from the context, which must outlive the
+ * document. Text must be utf-8, markup is not supported.
  *
  * @param *context	Context
- * @param width		Width. -1 means no wrapping mode.
- * @param height		Height. zero/minus value means non-specified.
+ * @param *text		Plain text
+ * @param length		Text length. -1 means NULL-terminated text.
+ * @param page_height	Height of a page in pixels
+ * @return A pointer to the document as a gdPangoDocument*, or NULL on
+ *			failure.
  */
-void gdPangoSetMinimumSize(gdPangoContext *context, int width, int height)
+gdPangoDocument* gdPangoCreateDocument(gdPangoContext *context,
+	const char *text, int length, int page_height)
 {
-	int pango_width;
-	if (width > 0) {
-		pango_width = width * PANGO_SCALE;
-	} else {
-		pango_width = -1;
+	gdPangoDocument *document;
+
+	if (!text || page_height <= 0) {
+		return NULL;
 	}
 
-	pango_layout_set_width(context->layout, pango_width);
+	document = (gdPangoDocument *)g_malloc(sizeof(gdPangoDocument));
+	document->context = context;
+	document->page_height = page_height;
+	document->n_measured = 0;
+	document->first_kept = document->last_kept = -1;
+	document->stale.x = document->stale.y = 0;
+	document->stale.width = document->stale.height = 0;
+	gdPangoDocumentSplit(document, text, length);
 
-	context->min_width = width;
-	context->min_height = height;
+	return document;
 }
 
 /**
- * Specify default color.
- *
- * Define the default foreground, background and alpha component.
+ * Free a document.
  *
- * @param *context	gdPangoContext context
- * @param *colors		a gdPangoColors ptr, defines fg, bg or alpha default
+ * @param *document	Document to be freed
  */
-void gdPangoSetDefaultColor(gdPangoContext *context,
-	const gdPangoColors  *colors)
+void gdPangoFreeDocument(gdPangoDocument *document)
 {
-	context->default_colors = *colors;
+	int i;
+
+	for (i = 0; i < document->n_paragraphs; i++) {
+		if (document->paragraphs[i].layout) {
+			g_object_unref(document->paragraphs[i].layout);
+		}
+	}
+	g_free(document->paragraphs);
+	g_free(document->text);
+	g_free(document);
 }
 
-/**
- * Get layout width.
- *
- * @param *context gdPangoContext context
- * @return Width
- */
-int gdPangoGetLayoutWidth(gdPangoContext *context)
+static PangoLayout *gdPangoParagraphLayout(gdPangoDocument *document, int i)
 {
-	PangoRectangle logical_rect;
+	gdPangoParagraph *paragraph = &document->paragraphs[i];
+	gdPangoContext *context = document->context;
 
-	pango_layout_get_extents (context->layout, NULL, &logical_rect);
-	return PANGO_PIXELS(logical_rect.width);
+	if (!paragraph->layout) {
+		PangoLayout *layout = pango_layout_new(context->context);
+
+		pango_layout_set_width(layout, pango_layout_get_width(context->layout));
+		pango_layout_set_wrap(layout, pango_layout_get_wrap(context->layout));
+		pango_layout_set_auto_dir(layout, TRUE);
+		pango_layout_set_alignment(layout, PANGO_ALIGN_LEFT);
+		pango_layout_set_font_description(layout, context->font_desc);
+		pango_layout_set_text(layout, document->text + paragraph->offset,
+			paragraph->length);
+		paragraph->layout = layout;
+	}
+	return paragraph->layout;
 }
 
-/**
- * Get layout height.
- *
- * @param *context	Context
- * @return Height
+static void gdPangoParagraphRelease(gdPangoDocument *document, int i)
+{
+	gdPangoParagraph *paragraph = &document->paragraphs[i];
+
+	if (paragraph->layout && (i < document->first_kept || i > document->last_kept)) {
+		g_object_unref(paragraph->layout);
+		paragraph->layout = NULL;
+	}
+}
+
+/*
+ * Measure the paragraphs from the top until the document is known down
+ * to the given y (pango units), or entirely if y < 0. Layouts ending
+ * above keep_y are released once measured, unless kept for rendering or,
+ * with keep_dirty, until a repaint draws them.
  */
-int gdPangoGetLayoutHeight(gdPangoContext *context)
+static void gdPangoDocumentMeasure(gdPangoDocument *document, int y, int keep_y,
+	int keep_dirty)
 {
-	PangoRectangle logical_rect;
+	while (document->n_measured < document->n_paragraphs) {
+		gdPangoParagraph *paragraph = &document->paragraphs[document->n_measured];
+		int top = 0;
 
-	pango_layout_get_extents (context->layout, NULL, &logical_rect);
-	return PANGO_PIXELS (logical_rect.height);
+		if (document->n_measured > 0) {
+			gdPangoParagraph *previous = paragraph - 1;
+			top = previous->y + previous->height;
+		}
+		if (y >= 0 && top >= y) {
+			break;
+		}
+
+		paragraph->y = top;
+		/* heights survive text updates which left the paragraph alone */
+		if (paragraph->height < 0) {
+			PangoRectangle ink_rect, logical_rect;
+
+			pango_layout_get_extents(gdPangoParagraphLayout(document, document->n_measured),
+				&ink_rect, &logical_rect);
+			paragraph->height = logical_rect.height;
+			gdPangoExtentsBox(&ink_rect, &logical_rect, &paragraph->box);
+			if (top + paragraph->height <= keep_y && !(keep_dirty && paragraph->dirty)) {
+				gdPangoParagraphRelease(document, document->n_measured);
+			}
+		}
+		document->n_measured++;
+	}
 }
 
 /**
- * Set markup text to context.
- * Text must be utf-8.
- * Markup format is same as pango.
+ * Get the total height of a document.
  *
- * @param *context 	gdPangoContex ptr
- * @param *markup		const char Markup text
- * @param length	 	Text length. -1 means NULL-terminated text.
+ * All the paragraphs are measured (but not kept) the first time.
+ *
+ * @param *document	Document
+ * @return Height in pixels
  */
-void gdPangoSetMarkup(gdPangoContext *context, const char *markup,
-	const int length)
+int gdPangoDocumentGetHeight(gdPangoDocument *document)
 {
-	pango_layout_set_markup(context->layout, markup, length);
-	pango_layout_set_auto_dir(context->layout, TRUE);
-	pango_layout_set_font_description(context->layout, context->font_desc);
+	gdPangoParagraph *last;
+
+	gdPangoDocumentMeasure(document, -1, G_MAXINT, 0);
+	last = &document->paragraphs[document->n_paragraphs - 1];
+	return PANGO_PIXELS(last->y + last->height);
 }
 
 /**
- * Set plain text to context.
- * Text must be utf-8.
+ * Get the number of pages of a document.
  *
- * @param *context	Context
- * @param *text		Plain text
- * @param length		Text length. -1 means NULL-terminated text.
+ * @param *document	Document
+ * @return Number of pages
  */
-void gdPangoSetText(gdPangoContext *context, const char *text,
-	int length)
+int gdPangoDocumentGetPageCount(gdPangoDocument *document)
 {
-	pango_layout_set_attributes(context->layout, NULL);
-	pango_layout_set_text(context->layout, text, length);
-	pango_layout_set_auto_dir(context->layout, TRUE);
-	pango_layout_set_alignment(context->layout, PANGO_ALIGN_LEFT);
-	pango_layout_set_font_description(context->layout, context->font_desc);
+	int height = gdPangoDocumentGetHeight(document);
+
+	return MAX((height + document->page_height - 1) / document->page_height, 1);
 }
 
 /**
- * Set DPI to context.
+ * Render a range of rows of a document.
  *
- * @param *context	Context
- * @param dpi_x 	Horizontal dpi
- * @param dpi_y 	Vertical dpi
+ * Only the paragraphs intersecting the range are laid out and rendered;
+ * the ones above it are measured once. Row top of the document is drawn
+ * at (x,y) on the surface, nothing is drawn outside of the range.
+ *
+ * @param *document	Document
+ * @param *surface	Surface to draw on it
+ * @param x				X of left-top of drawing area
+ * @param y				Y of left-top of drawing area
+ * @param top			First row of the document to render
+ * @param height		Number of rows to render
+ * @return GD_SUCCESS on success, otherwise GD_FAILURE.
  */
-void gdPangoSetDpi(gdPangoContext *context,
-	double dpi_x, double dpi_y)
+int gdPangoDocumentRenderRange(gdPangoDocument *document, gdImagePtr surface,
+	int x, int y, int top, int height)
 {
-   pango_ft2_font_map_set_resolution(PANGO_FT2_FONT_MAP(context->font_map),
-		dpi_x, dpi_y);
+	int i, first = -1, last = -1;
+	int clip_x1, clip_y1, clip_x2, clip_y2;
+	int range_top = top * PANGO_SCALE;
+	int range_bottom = (top + height) * PANGO_SCALE;
+
+	if (!surface || height <= 0) {
+		return GD_FAILURE;
+	}
+
+	gdPangoDocumentMeasure(document, range_bottom, range_top, 0);
+	for (i = 0; i < document->n_measured; i++) {
+		gdPangoParagraph *paragraph = &document->paragraphs[i];
+
+		if (paragraph->y + paragraph->height <= range_top) {
+			continue;
+		}
+		if (paragraph->y >= range_bottom) {
+			break;
+		}
+		if (first < 0) {
+			first = i;
+		}
+		last = i;
+	}
+
+	/* keep the layouts of this range only */
+	for (i = document->first_kept; i >= 0 && i <= document->last_kept; i++) {
+		if (i < first || i > last) {
+			gdPangoParagraph *paragraph = &document->paragraphs[i];
+
+			if (paragraph->layout) {
+				g_object_unref(paragraph->layout);
+				paragraph->layout = NULL;
+			}
+		}
+	}
+	document->first_kept = first;
+	document->last_kept = last;
+	if (first < 0) {
+		return GD_SUCCESS;
+	}
+
+	gdImageGetClip(surface, &clip_x1, &clip_y1, &clip_x2, &clip_y2);
+	gdImageSetClip(surface, clip_x1, MAX(clip_y1, y),
+		clip_x2, MIN(clip_y2, y + height - 1));
+
+	for (i = first; i <= last; i++) {
+		gdPangoParagraph *paragraph = &document->paragraphs[i];
+		gdPangoTarget target;
+
+		target.surface = surface;
+		target.x = x;
+		target.y = y + PANGO_PIXELS(paragraph->y - range_top);
+		target.damage = NULL;
+		gdPangoRenderLayout(document->context, gdPangoParagraphLayout(document, i),
+			&target, 1);
+	}
+
+	gdImageSetClip(surface, clip_x1, clip_y1, clip_x2, clip_y2);
+	if (document->context->stats) {
+		gdPangoFlushStats(document->context);
+	}
+	return GD_SUCCESS;
 }
 
 /**
- * Set base direction to context.
+ * Render a page of a document.
  *
- * @param *context	Context
- * @param direction	Direction
+ * Page n covers the rows from n * page_height to (n + 1) * page_height
+ * of the document, see gdPangoDocumentRenderRange.
+ *
+ * @param *document	Document
+ * @param *surface	Surface to draw on it
+ * @param x				X of left-top of drawing area
+ * @param y				Y of left-top of drawing area
+ * @param page			Page number, starting at zero
+ * @return GD_SUCCESS on success, otherwise GD_FAILURE.
  */
-void gdPangoSetBaseDirection(gdPangoContext *context,
-	PangoDirection direction)
+int gdPangoDocumentRenderPage(gdPangoDocument *document, gdImagePtr surface,
+	int x, int y, int page)
 {
-	pango_context_set_base_dir (context->context, direction);
+	if (page < 0) {
+		return GD_FAILURE;
+	}
+	return gdPangoDocumentRenderRange(document, surface, x, y,
+		page * document->page_height, document->page_height);
 }
 
 /**
- * Set font description from a ttf file.
+ * Replace the text of a document.
  *
- * @param *context Context
- * @param *fontlist path to ttf file
- * @param ptsize font size in points
- * @param *error output of error code on failure; simply ignored if error = NULL
- * @return GD_SUCCESS on success, otherwise GD_FAILURE.
+ * The new text is compared to the current one paragraph by paragraph.
+ * Paragraphs which did not change keep their layout and their height,
+ * only the changed ones are measured again. Use gdPangoDocumentRepaint to
+ * update a surface with the changes.
+ *
+ * @param *document	Document
+ * @param *text		Plain text
+ * @param length		Text length. -1 means NULL-terminated text.
+ * @return The number of changed paragraphs, or GD_FAILURE.
  */
-int gdPangoSetPangoFontDescriptionFromFile(gdPangoContext *context, const char
-		*fontlist, double ptsize, int *error)
+int gdPangoDocumentSetText(gdPangoDocument *document, const char *text,
+	int length)
 {
-	FcPattern *fcPattern;
-	FcBlanks *fcBlanks;
-	FcValue fcFamilyName;
-	FcResult fcResult;
-	int numFonts;
-	char *font_desc;
-	int n, r = GD_FAILURE;
+	gdPangoParagraph *old_paragraphs = document->paragraphs;
+	int old_n = document->n_paragraphs;
+	char *old_text = document->text;
+	int i, changed = 0, first_changed = -1;
 
-	fcBlanks = FcBlanksCreate();
-	fcPattern = FcFreeTypeQuery((FcChar8 *)fontlist, 0, fcBlanks, &numFonts);
-	if (!fcPattern) {
-		if (error) *error = GD_PANGO_ERROR_FC_FT;
-		goto fail0;
-	}
-	fcResult = FcPatternGet(fcPattern, FC_FAMILY, 0, &fcFamilyName);
-	if (fcResult != FcResultMatch) {
-		if (error) *error = GD_PANGO_ERROR_FC_PAT;
-		goto fail1;
+	if (!text) {
+		return GD_FAILURE;
 	}
 
-	n = snprintf(NULL, 0, "%s %f", fcFamilyName.u.s, ptsize);
-	if (n <= 0) {
-		if (error) *error = GD_PANGO_ERROR_FORMAT;
-		goto fail1;
+	gdPangoDocumentSplit(document, text, length);
+
+	for (i = 0; i < document->n_paragraphs; i++) {
+		gdPangoParagraph *paragraph = &document->paragraphs[i];
+		gdPangoParagraph *old;
+
+		if (i >= old_n) {
+			changed++;
+			if (first_changed < 0) {
+				first_changed = i;
+			}
+			continue;
+		}
+
+		old = &old_paragraphs[i];
+		paragraph->y = old->y;
+		paragraph->painted = old->painted;
+		paragraph->layout = old->layout;
+		old->layout = NULL;
+
+		if (old->length == paragraph->length &&
+			memcmp(old_text + old->offset, document->text + paragraph->offset,
+				paragraph->length) == 0) {
+			paragraph->height = old->height;
+			paragraph->box = old->box;
+			paragraph->dirty = old->dirty;
+			continue;
+		}
+
+		/* same layout object, new text */
+		if (paragraph->layout) {
+			pango_layout_set_text(paragraph->layout,
+				document->text + paragraph->offset, paragraph->length);
+		}
+		changed++;
+		if (first_changed < 0) {
+			first_changed = i;
+		}
 	}
-	font_desc = (char *)g_malloc(n + 1);
-	n = snprintf(font_desc, n + 1, "%s %f", fcFamilyName.u.s, ptsize);
-	if (n <= 0) {
-		if (error) *error = GD_PANGO_ERROR_FORMAT;
-		goto fail2;
+
+	/* removed paragraphs have to be erased on the next repaint */
+	for (i = document->n_paragraphs; i < old_n; i++) {
+		gdRect *painted = &old_paragraphs[i].painted;
+
+		gdPangoRectUnion(&document->stale, painted->x, painted->y,
+			painted->width, painted->height);
+		if (old_paragraphs[i].layout) {
+			g_object_unref(old_paragraphs[i].layout);
+		}
+		changed++;
 	}
-	context->font_desc = pango_font_description_from_string(font_desc);
-	r = GD_SUCCESS;
- fail2:
-	g_free(font_desc);
- fail1:
-	FcPatternDestroy(fcPattern);
- fail0:
-	FcBlanksDestroy(fcBlanks);
-	return r;
-}
 
-PangoFontMap* gdPangoGetPangoFontMap(gdPangoContext *context)
-{
-	return context->font_map;
-}
+	if (old_n > document->n_paragraphs && first_changed < 0) {
+		first_changed = document->n_paragraphs;
+	}
+	if (first_changed >= 0) {
+		document->n_measured = MIN(document->n_measured, first_changed);
+	}
+	document->last_kept = MIN(document->last_kept, document->n_paragraphs - 1);
+	if (document->first_kept > document->last_kept) {
+		document->first_kept = document->last_kept = -1;
+	}
 
-PangoFontDescription* gdPangoGetPangoFontDescription(gdPangoContext *context)
-{
-    return context->font_desc;
+	g_free(old_paragraphs);
+	g_free(old_text);
+	return changed;
 }
 
-/**
- * Returns the internal pango_context pointer.
- *
- * This pointer can then be used directly with Pango. There is no need for
- * GD to duplicate the pango API.
- *
- * @param *context     PangoContext * Context
+/*
+ * Clear a rectangle of the surface and draw again the parts of the
+ * paragraphs lying in it.
  */
-PangoContext* gdPangoGetPangoContext(gdPangoContext *context)
+static void gdPangoDocumentRepaintRect(gdPangoDocument *document,
+	gdImagePtr surface, int x, int y, const gdRect *rect)
 {
-	return context->context;
+	int clip_x1, clip_y1, clip_x2, clip_y2;
+	int i, alpha_blending_back;
+	gdRect clip, area;
+
+	gdImageGetClip(surface, &clip_x1, &clip_y1, &clip_x2, &clip_y2);
+	clip.x = clip_x1;
+	clip.y = clip_y1;
+	clip.width = clip_x2 - clip_x1 + 1;
+	clip.height = clip_y2 - clip_y1 + 1;
+	if (!gdPangoIntersectRect(rect, &clip, &area)) {
+		return;
+	}
+	gdImageSetClip(surface, area.x, area.y,
+		area.x + area.width - 1, area.y + area.height - 1);
+
+	alpha_blending_back = surface->alphaBlendingFlag;
+	gdImageAlphaBlending(surface, 0);
+	gdImageFilledRectangle(surface, area.x, area.y,
+		area.x + area.width - 1, area.y + area.height - 1,
+		document->context->default_colors.bg);
+	gdImageAlphaBlending(surface, alpha_blending_back);
+
+	for (i = 0; i < document->n_paragraphs; i++) {
+		gdPangoParagraph *paragraph = &document->paragraphs[i];
+		gdPangoTarget target;
+
+		if (!gdPangoIntersectRect(&paragraph->painted, &area, NULL)) {
+			continue;
+		}
+		target.surface = surface;
+		target.x = x;
+		target.y = y + PANGO_PIXELS(paragraph->y);
+		target.damage = NULL;
+		gdPangoRenderLayout(document->context, gdPangoParagraphLayout(document, i),
+			&target, 1);
+		/* only the layouts of the last rendered range are kept */
+		gdPangoParagraphRelease(document, i);
+	}
+
+	gdImageSetClip(surface, clip_x1, clip_y1, clip_x2, clip_y2);
 }
 
 /**
- * Returns the internal pango_layout pointer.
+ * Update a surface with the changes of a document.
  *
- * This pointer can then be used directly with Pango. There is no need for
- * GD to duplicate the pango API.
+ * The whole document is drawn at (x,y), as a single layout would be.
+ * Only the paragraphs changed by gdPangoDocumentSetText, or moved by a
+ * change of height above them, are cleared with the background color
+ * of the context and drawn again; the first call draws everything. The
+ * surface is expected to be updated by this function only. A changed
+ * paragraph is shaped once, its layout is kept from measuring to drawing;
+ * unchanged paragraphs overlapping the repainted area are laid out again
+ * to be drawn. Layouts are released afterwards, except the ones of the
+ * last range rendered.
  *
- * @param *context     gdPangoContext Context
+ * @param *document	Document
+ * @param *surface	Surface to draw on it
+ * @param x				X of left-top of drawing area
+ * @param y				Y of left-top of drawing area
+ * @param *damage		output of the repainted area; simply ignored if
+ *							damage = NULL
+ * @return GD_SUCCESS on success, otherwise GD_FAILURE.
  */
-PangoLayout* gdPangoGetPangoLayout(gdPangoContext *context)
+int gdPangoDocumentRepaint(gdPangoDocument *document, gdImagePtr surface,
+	int x, int y, gdRectPtr damage)
 {
-	return context->layout;
+	gdRect area;
+	int i, margin;
+
+	if (!surface) {
+		return GD_FAILURE;
+	}
+	if (damage) {
+		damage->x = damage->y = 0;
+		damage->width = damage->height = 0;
+	}
+
+	gdPangoDocumentMeasure(document, -1, G_MAXINT, 1);
+	margin = gdPangoEffectsMargin(document->context);
+
+	area = document->stale;
+	document->stale.width = document->stale.height = 0;
+
+	for (i = 0; i < document->n_paragraphs; i++) {
+		gdPangoParagraph *paragraph = &document->paragraphs[i];
+		gdRect box = paragraph->box;
+
+		/* underlines and effects are drawn around the ink */
+		box.x += x - margin;
+		box.y += y + PANGO_PIXELS(paragraph->y) - margin;
+		box.width += 2 * margin;
+		box.height += 2 * margin + GD_PANGO_DECORATION_MARGIN;
+
+		if (paragraph->dirty ||
+			box.x != paragraph->painted.x || box.y != paragraph->painted.y ||
+			box.width != paragraph->painted.width ||
+			box.height != paragraph->painted.height) {
+			gdPangoRectUnion(&area, paragraph->painted.x, paragraph->painted.y,
+				paragraph->painted.width, paragraph->painted.height);
+			gdPangoRectUnion(&area, box.x, box.y, box.width, box.height);
+			paragraph->painted = box;
+			paragraph->dirty = 0;
+		} else if (area.width > 0 && !gdPangoIntersectRect(&area, &box, NULL)) {
+			gdPangoDocumentRepaintRect(document, surface, x, y, &area);
+			gdPangoRectUnion(damage, area.x, area.y, area.width, area.height);
+			area.width = area.height = 0;
+		}
+	}
+	if (area.width > 0) {
+		gdPangoDocumentRepaintRect(document, surface, x, y, &area);
+		gdPangoRectUnion(damage, area.x, area.y, area.width, area.height);
+	}
+	/* changed paragraphs outside of the clip were not drawn */
+	for (i = 0; i < document->n_paragraphs; i++) {
+		gdPangoParagraphRelease(document, i);
+	}
+	if (document->context->stats) {
+		gdPangoFlushStats(document->context);
+	}
+
+	return GD_SUCCESS;
 }
 
 /**
  * Pango enabled replacement for gdImageStringFT.
  *
+ * Fonts are kept between calls in the font maps shared by the calling
+ * thread; a thread living as long as the process frees them with
+ * gdPangoReleaseSharedMaps.
+ *
  * @param *im  gdImagePtr
  * @param *bbox gdBBox layout the resulting bounds
  * @param fg foreground color
@@ -913,7 +6853,7 @@ char *gdImageStringPangoFT(gdImagePtr im, gdBBox *bbox, int fg, char *fontlist,
 	gdPangoColors default_colors;
 	PangoContext *pango_context;
 
-	context = gdPangoCreateContext();
+	context = gdPangoCreateSharedContext();
 	pango_context = gdPangoGetPangoContext(context);
 	pango_context_set_base_dir(pango_context, PANGO_DIRECTION_LTR);
 	r = gdPangoSetPangoFontDescriptionFromFile(context, fontlist, ptsize, NULL);
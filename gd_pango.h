@@ -53,6 +53,9 @@ enum {
 	GD_PANGO_ERROR_FC_FT,
 	GD_PANGO_ERROR_FC_PAT,
 	GD_PANGO_ERROR_FORMAT,
+	GD_PANGO_ERROR_MARKUP,
+	GD_PANGO_ERROR_FONT,
+	GD_PANGO_ERROR_CACHE,
 };
 
 /**
@@ -76,6 +79,95 @@ typedef struct gdPangoColors { /* colors definition */
 	unsigned int alpha; /*!< General alpha component */
 } gdPangoColors;
 
+/**
+ * Setters recorded between gdPangoBeginUpdate and gdPangoCommitUpdate.
+ */
+typedef struct gdPangoPending {
+	unsigned int flags;  /* GD_PANGO_PENDING_* */
+	char *text;
+	int length;
+	PangoAttrList *attrs;
+	int width;
+	PangoAlignment alignment;
+	PangoDirection direction;
+} gdPangoPending;
+
+#define GD_PANGO_PENDING_TEXT      (1 << 0)
+#define GD_PANGO_PENDING_FONT      (1 << 1)
+#define GD_PANGO_PENDING_WIDTH     (1 << 2)
+#define GD_PANGO_PENDING_ALIGNMENT (1 << 3)
+#define GD_PANGO_PENDING_DIRECTION (1 << 4)
+
+typedef struct gdPangoMetrics gdPangoMetrics;
+
+/**
+ * Time spent by each phase of gdPangoWarmup, in milliseconds.
+ */
+typedef struct gdPangoWarmupTimes {
+	double fontconfig;  /* configuration and font caches */
+	double fonts;       /* matching the fonts and opening their faces */
+	double fallback;    /* fallback font sets and shaping of the samples */
+	double render;      /* rasterizing the samples */
+} gdPangoWarmupTimes;
+
+typedef struct gdPangoWarmupTask gdPangoWarmupTask;
+
+/**
+ * Counters of a context, see gdPangoEnableStats. Times are in
+ * microseconds of the monotonic clock.
+ */
+typedef struct gdPangoStats {
+	guint64 lines;            /* lines drawn */
+	guint64 runs;             /* runs of the lines drawn */
+	guint64 glyphs;           /* glyphs rasterized by FreeType */
+	guint64 pixels;           /* pixels blended on the surfaces */
+	guint64 memset_bytes;     /* bytes cleared in the coverage bitmap */
+	guint64 scratch_reallocs; /* growths of the effect masks */
+	guint64 cache_hits;       /* glyphs found in the glyph cache */
+	guint64 cache_misses;     /* glyphs rasterized despite a glyph cache */
+	guint64 layout_time;      /* shaping and line breaking */
+	guint64 raster_time;      /* rasterization and effects */
+	guint64 blit_time;        /* blending on the surfaces */
+} gdPangoStats;
+
+/**
+ * A glyph cache file mapped in memory, see gdPangoOpenGlyphCache.
+ */
+typedef struct gdPangoGlyphCache gdPangoGlyphCache;
+
+/**
+ * Effects drawn with the text, see gdPangoSetHalo and gdPangoSetShadow.
+ */
+typedef struct gdPangoEffects {
+	int halo_radius;   /* pixels, 0 for no halo */
+	int halo_color;
+	int shadow_dx;     /* pixels, all zero for no shadow */
+	int shadow_dy;
+	int shadow_radius;
+	int shadow_color;
+} gdPangoEffects;
+
+#define GD_PANGO_DRAW_TEXT    (1 << 0)
+#define GD_PANGO_DRAW_EFFECTS (1 << 1)
+#define GD_PANGO_DRAW_ALL     (GD_PANGO_DRAW_TEXT | GD_PANGO_DRAW_EFFECTS)
+
+/**
+ * Rendering quality tiers of a context, see gdPangoSetQuality.
+ */
+enum {
+	GD_PANGO_QUALITY_DRAFT,  /* monochrome, full hinting, whole pixels */
+	GD_PANGO_QUALITY_NORMAL, /* the fontconfig settings of the system */
+	GD_PANGO_QUALITY_HIGH    /* gray, slight hinting, subpixel positions */
+};
+
+typedef struct gdPangoSharedMap gdPangoSharedMap;
+typedef struct gdPangoFallbackMemo gdPangoFallbackMemo;
+
+/**
+ * A private set of fonts, see gdPangoCreateFontRegistry.
+ */
+typedef struct gdPangoFontRegistry gdPangoFontRegistry;
+
 /**
  * Defines a gd Pango context. Use gdPangoCreateContext to create a GD
  * Context object. Different functions are provided to access its
@@ -84,6 +176,9 @@ typedef struct gdPangoColors { /* colors definition */
 typedef struct gdPangoContext { /* GD Pango Context */
 	PangoContext *context;
 	PangoFontMap *font_map;
+	gdPangoSharedMap *shared; /* thread font map of a shared context, or NULL */
+	gdPangoFallbackMemo *fallback; /* text whose fallback fonts were resolved */
+	gdPangoFontRegistry *registry;
 	PangoFontDescription *font_desc;
 	PangoMatrix *matrix;
 	PangoLayout *layout;
@@ -92,25 +187,326 @@ typedef struct gdPangoContext { /* GD Pango Context */
 	int min_width;
 	int min_height;
 	double angle;
+	int updating;
+	gdPangoPending pending;
+	GSList *metrics;          /* gdPangoMetrics of the fonts used */
+	PangoGlyphString *glyphs; /* glyphs placed by the simple text path */
+	gdPangoMetrics *simple;   /* metrics of glyphs, NULL for the full path */
+	guint simple_serial;      /* layout serial glyphs were placed for */
+	int simple_valid;
+	double dpi_x;
+	double dpi_y;
+	GSList *scaled;           /* contexts of gdPangoRenderScales */
+	gdPangoEffects effects;
+	int draw;                 /* GD_PANGO_DRAW_* of the current pass */
+	unsigned char *scratch;   /* effect masks */
+	int scratch_size;
+	GSList *sdf;              /* glyph distance fields of gdPangoBuildAtlasSDF */
+	gdPangoGlyphCache *glyph_cache;
+	GHashTable *cache_fonts;  /* font -> its glyphs in glyph_cache */
+	int quality;              /* GD_PANGO_QUALITY_* */
+	gdPangoStats *stats;      /* counted and already in the global ones, or NULL */
 } gdPangoContext;
 
+/**
+ * A glyph of a gdPangoAtlas. Sizes are in pixels unless noted.
+ */
+typedef struct gdPangoAtlasGlyph {
+	unsigned int glyph;      /* glyph id in the font */
+	unsigned int codepoint;  /* first character the glyph was drawn for, or 0 */
+	int x, y;                /* position in the atlas surface */
+	int width, height;       /* zero for blank glyphs, ie. spaces */
+	int bearing_x;           /* top-left of the bitmap from the pen */
+	int bearing_y;           /*   position on the baseline */
+	int advance;             /* Pango units */
+} gdPangoAtlasGlyph;
+
+/**
+ * Defines a glyph atlas, the glyphs of a font packed in one surface.
+ * Use gdPangoBuildAtlas or gdPangoBuildAtlasSDF to create an atlas.
+ */
+typedef struct gdPangoAtlas {
+	gdImagePtr image;
+	int n_glyphs;
+	gdPangoAtlasGlyph *glyphs;  /* sorted by glyph id */
+	int ascent;                 /* Pango units */
+	int descent;
+	int spread;                 /* distance field spread, 0 for coverage */
+} gdPangoAtlas;
+
+#define GD_PANGO_ATLAS_VERSION 2
+#define GD_PANGO_ATLAS_HEADER_SIZE 24
+#define GD_PANGO_ATLAS_ENTRY_SIZE 24
+
+/**
+ * Position of a label packed by gdPangoPackLabels.
+ */
+typedef struct gdPangoLabelRect {
+	int sheet;          /* index of the sheet */
+	int x, y;           /* top-left corner in the sheet */
+	int width, height;
+} gdPangoLabelRect;
+
+/**
+ * A glyph of a layout with its pen position, see gdPangoGetLayoutGlyphs.
+ */
+typedef struct gdPangoPositionedGlyph {
+	unsigned int glyph;
+	PangoFont *font;
+	int x;  /* Pango units, from the layout top-left corner */
+	int y;  /* baseline */
+} gdPangoPositionedGlyph;
+
+/**
+ * Defines a compiled markup, the plain text and attributes of a markup
+ * text parsed once. Use gdPangoCompileMarkup to create it.
+ */
+typedef struct gdPangoMarkup {
+	char *text;
+	int length;
+	PangoAttrList *attrs;
+} gdPangoMarkup;
+
+/**
+ * Defines a text template, a markup text parsed once with fields
+ * substituted on each use. Use gdPangoCreateTemplate to create a
+ * template, do not access it directly.
+ */
+typedef struct gdPangoTemplate {
+	char *text;          /* plain text, fields included */
+	int length;
+	PangoAttrList *attrs;
+	int n_fields;
+	char **names;
+	int *starts;         /* byte range of each field in text */
+	int *ends;
+} gdPangoTemplate;
+
+/**
+ * A paragraph of a gdPangoDocument. Positions are in Pango units and
+ * only valid once the paragraph has been measured.
+ */
+typedef struct gdPangoParagraph {
+	int offset;          /*!< Byte offset in the document text */
+	int length;          /*!< Byte length, without the new line */
+	int y;               /*!< Top of the paragraph */
+	int height;          /*!< Logical height of the paragraph, -1 if unknown */
+	gdRect box;          /*!< Ink and logical box in pixels, from its top */
+	gdRect painted;      /*!< Box drawn by gdPangoDocumentRepaint */
+	int dirty;           /*!< Changed since the last repaint */
+	PangoLayout *layout; /*!< Layout, NULL when not laid out */
+} gdPangoParagraph;
+
+/**
+ * Defines a paginated document. Use gdPangoCreateDocument to create a
+ * document, do not access it directly.
+ */
+typedef struct gdPangoDocument {
+	gdPangoContext *context;
+	char *text;
+	int length;
+	gdPangoParagraph *paragraphs;
+	int n_paragraphs;
+	int n_measured;
+	int first_kept;
+	int last_kept;
+	int page_height;
+	gdRect stale;
+} gdPangoDocument;
+
+/**
+ * Receives the bands rendered by gdPangoRenderBands. The band surface is
+ * reused for the next band. Return GD_SUCCESS to continue.
+ */
+typedef int (*gdPangoBandCallback)(gdImagePtr band, int y, int rows,
+	void *user_data);
+
 extern int gdPangoInit(void);
 extern int gdPangoIsInitialized(void);
 extern gdPangoContext* gdPangoCreateContext(void);
+extern gdPangoContext* gdPangoCreateSharedContext(void);
+extern void gdPangoReleaseSharedMaps(void);
+
 extern void gdPangoFreeContext(gdPangoContext *context);
 
+extern int gdPangoWarmup(
+	gdPangoContext *context,
+	const char **fonts,
+	const char **languages,
+	const char **samples,
+	gdPangoWarmupTimes *times);
+
+extern gdPangoWarmupTask* gdPangoWarmupStart(
+	gdPangoContext *context,
+	const char **fonts,
+	const char **languages,
+	const char **samples);
+
+extern int gdPangoWarmupJoin(
+	gdPangoWarmupTask *task,
+	gdPangoWarmupTimes *times);
+
 extern gdImagePtr gdPangoCreateSurfaceDraw(
 	gdPangoContext *context);
 
+extern gdImagePtr gdPangoCreateSurfaceDrawInk(
+	gdPangoContext *context,
+	int padding,
+	gdPointPtr origin);
+
 extern gdImagePtr gdPangoRenderTo(
 	gdPangoContext *context,
 	gdImagePtr surface,
 	int x, int y);
 
+extern gdImagePtr gdPangoRenderToWithDamage(
+	gdPangoContext *context,
+	gdImagePtr surface,
+	int x, int y,
+	gdRectPtr damage);
+
+extern int gdPangoRenderTiles(
+	gdPangoContext *context,
+	gdImagePtr *tiles,
+	int columns, int rows,
+	int tile_width, int tile_height,
+	int x, int y,
+	gdRectPtr damages);
+
+extern int gdPangoRenderBands(
+	gdPangoContext *context,
+	int band_height,
+	gdPangoBandCallback callback,
+	void *user_data);
+
 extern void gdPangoSetDpi(
 	gdPangoContext *context,
 	double dpi_x, double dpi_y);
 
+extern void gdPangoSetQuality(
+	gdPangoContext *context,
+	int quality);
+
+extern int gdPangoGetQuality(
+	gdPangoContext *context);
+
+extern void gdPangoEnableStats(
+	gdPangoContext *context,
+	int enable);
+
+extern void gdPangoGetStats(
+	gdPangoContext *context,
+	gdPangoStats *stats);
+
+extern void gdPangoResetStats(
+	gdPangoContext *context);
+
+extern void gdPangoGetGlobalStats(
+	gdPangoStats *stats);
+
+extern void gdPangoResetGlobalStats(void);
+
+extern int gdPangoRenderScales(
+	gdPangoContext *context,
+	const double *scales,
+	int n_scales,
+	gdImagePtr *surfaces);
+
+extern gdPangoAtlas* gdPangoBuildAtlas(
+	gdPangoContext *context,
+	const char *corpus,
+	int length,
+	int width,
+	int padding,
+	int *error);
+
+extern gdPangoAtlas* gdPangoBuildAtlasSDF(
+	gdPangoContext *context,
+	const char *corpus,
+	int length,
+	int width,
+	int padding,
+	int spread,
+	int *error);
+
+extern gdPangoAtlas* gdPangoBuildAtlasRange(
+	gdPangoContext *context,
+	unsigned int first,
+	unsigned int last,
+	int width,
+	int padding,
+	int *error);
+
+extern void gdPangoFreeAtlas(gdPangoAtlas *atlas);
+
+extern const gdPangoAtlasGlyph* gdPangoAtlasFind(
+	const gdPangoAtlas *atlas,
+	unsigned int glyph);
+
+extern unsigned char* gdPangoAtlasWriteTable(
+	const gdPangoAtlas *atlas,
+	int *size);
+
+extern int gdPangoWriteGlyphCache(
+	gdPangoContext *context,
+	const char *path,
+	const char *corpus,
+	int length,
+	int *error);
+
+extern gdPangoGlyphCache* gdPangoOpenGlyphCache(
+	const char *path,
+	int *error);
+
+extern void gdPangoFreeGlyphCache(gdPangoGlyphCache *cache);
+
+extern void gdPangoSetGlyphCache(
+	gdPangoContext *context,
+	gdPangoGlyphCache *cache);
+
+extern gdPangoPositionedGlyph* gdPangoGetLayoutGlyphs(
+	gdPangoContext *context,
+	int *n_glyphs);
+
+extern int gdPangoPackLabels(
+	gdPangoContext *context,
+	const char **labels,
+	int n_labels,
+	int sheet_width,
+	int sheet_height,
+	int padding,
+	gdImagePtr **sheets,
+	int *n_sheets,
+	gdPangoLabelRect *rects);
+
+extern int gdPangoFitToBox(
+	gdPangoContext *context,
+	int width, int height,
+	double min_pt, double max_pt,
+	PangoWrapMode wrap,
+	double *size);
+
+extern gdPangoMetrics* gdPangoGetMetrics(
+	gdPangoContext *context,
+	const PangoFontDescription *font_desc);
+
+extern int gdPangoMetricsNeedsShaping(
+	gdPangoMetrics *metrics,
+	const char *text,
+	int length);
+
+extern int gdPangoMetricsGetWidth(
+	gdPangoMetrics *metrics,
+	const char *text,
+	int length,
+	int *width);
+
+extern int gdPangoMetricsGetLine(
+	gdPangoMetrics *metrics,
+	int *ascent,
+	int *descent,
+	int *height);
+
 extern void gdPangoSetMinimumSize(
 	gdPangoContext *context,
 	int width, int height);
@@ -135,9 +531,99 @@ extern void gdPangoSetText(
 	const char *markup,
 	int length);
 
+extern gdPangoMarkup* gdPangoCompileMarkup(
+	const char *markup,
+	int length,
+	int *error);
+
+extern void gdPangoFreeMarkup(gdPangoMarkup *markup);
+
+extern void gdPangoSetCompiledMarkup(
+	gdPangoContext *context,
+	const gdPangoMarkup *markup);
+
+extern void gdPangoSetFontDescription(
+	gdPangoContext *context,
+	const PangoFontDescription *font_desc);
+
+extern void gdPangoSetWidth(
+	gdPangoContext *context,
+	int width);
+
+extern void gdPangoSetAlignment(
+	gdPangoContext *context,
+	PangoAlignment alignment);
+
+extern void gdPangoBeginUpdate(gdPangoContext *context);
+
+extern void gdPangoCommitUpdate(gdPangoContext *context);
+
+extern gdPangoTemplate* gdPangoCreateTemplate(
+	const char *markup,
+	int length,
+	int *error);
+
+extern void gdPangoFreeTemplate(gdPangoTemplate *tmpl);
+
+extern int gdPangoTemplateGetField(
+	gdPangoTemplate *tmpl,
+	const char *name);
+
+extern int gdPangoSetTemplate(
+	gdPangoContext *context,
+	gdPangoTemplate *tmpl,
+	const char **values,
+	int n_values);
+
+extern void gdPangoSetHalo(
+	gdPangoContext *context,
+	int radius,
+	int color);
+
+extern void gdPangoSetShadow(
+	gdPangoContext *context,
+	int dx, int dy,
+	int radius,
+	int color);
+
 extern  void gdPangoSetBaseDirection(
 	gdPangoContext *context, PangoDirection pango_dir);
 
+extern gdPangoDocument* gdPangoCreateDocument(
+	gdPangoContext *context,
+	const char *text,
+	int length,
+	int page_height);
+
+extern void gdPangoFreeDocument(gdPangoDocument *document);
+
+extern int gdPangoDocumentSetText(
+	gdPangoDocument *document,
+	const char *text,
+	int length);
+
+extern int gdPangoDocumentRepaint(
+	gdPangoDocument *document,
+	gdImagePtr surface,
+	int x, int y,
+	gdRectPtr damage);
+
+extern int gdPangoDocumentGetHeight(gdPangoDocument *document);
+
+extern int gdPangoDocumentGetPageCount(gdPangoDocument *document);
+
+extern int gdPangoDocumentRenderRange(
+	gdPangoDocument *document,
+	gdImagePtr surface,
+	int x, int y,
+	int top, int height);
+
+extern int gdPangoDocumentRenderPage(
+	gdPangoDocument *document,
+	gdImagePtr surface,
+	int x, int y,
+	int page);
+
 extern int gdPangoSetPangoFontDescriptionFromFile(
 	gdPangoContext *context, const char *fontlist, double ptsize, int *error);
 
@@ -163,6 +649,30 @@ extern char *gdImageStringPangoFT(
 
 #ifdef __PANGO_H__
 
+extern gdPangoFontRegistry* gdPangoCreateFontRegistry(void);
+
+extern void gdPangoFreeFontRegistry(gdPangoFontRegistry *registry);
+
+extern int gdPangoRegisterFontFile(
+	gdPangoFontRegistry *registry,
+	const char *path,
+	int *error);
+
+extern int gdPangoRegisterFontData(
+	gdPangoFontRegistry *registry,
+	const void *data,
+	size_t size,
+	int *error);
+
+extern gdPangoContext* gdPangoCreateRegistryContext(
+	gdPangoFontRegistry *registry);
+
+extern int gdPangoSetRegisteredFont(
+	gdPangoContext *context,
+	int handle,
+	double ptsize,
+	int *error);
+
 extern PangoFontMap* gdPangoGetPangoFontMap(gdPangoContext *context);
 extern PangoFontDescription* gdPangoGetPangoFontDescription(gdPangoContext *context);
 extern PangoLayout* gdPangoGetPangoLayout(gdPangoContext *context);
@@ -3,8 +3,11 @@
  * fix it as soon as possible.
  */
 #include <assert.h>
+#include <stdlib.h>
+#include <string.h>
 #include <pango/pango.h>
 #include <pango/pangoft2.h>
+#include <pango/pangofc-font.h>
 #include "gd.h"
 #include "gd_pango.h"
 
@@ -71,6 +74,38 @@ TEST(gdPangoCreateSurfaceDraw)
 	gdPangoFreeContext(context);
 }
 
+TEST(gdPangoCreateSurfaceDrawInk)
+{
+	gdPangoContext *context;
+	gdImagePtr im;
+	gdPoint origin;
+	int w, h;
+	context = gdPangoCreateContext();
+	gdPangoSetText(context, "a", -1);
+	im = gdPangoCreateSurfaceDrawInk(context, 2, &origin);
+	gdTestAssert(im);
+	gdTestAssert(gdImageSX(im) > 4);
+	gdTestAssert(gdImageSY(im) - 4 < gdPangoGetLayoutHeight(context));
+	gdTestAssert(origin.x >= 0 && origin.x < gdImageSX(im));
+	w = gdImageSX(im);
+	h = gdImageSY(im);
+	gdImageDestroy(im);
+
+	/* underlines are drawn below the ink */
+	gdPangoSetMarkup(context, "<u>a</u>", -1);
+	im = gdPangoCreateSurfaceDrawInk(context, 2, &origin);
+	gdTestAssert(gdImageSY(im) > h);
+	gdImageDestroy(im);
+
+	/* and effects around it */
+	gdPangoSetText(context, "a", -1);
+	gdPangoSetHalo(context, 3, 0x000000);
+	im = gdPangoCreateSurfaceDrawInk(context, 2, &origin);
+	gdTestAssert(gdImageSX(im) == w + 6 && gdImageSY(im) == h + 6);
+	gdImageDestroy(im);
+	gdPangoFreeContext(context);
+}
+
 TEST(gdPangoSetMinimumSize)
 {
 	gdPangoContext *context;
@@ -212,6 +247,1123 @@ TEST(gdPangoGetPangoLayout)
 	gdPangoFreeContext(context);
 }
 
+TEST(gdPangoRenderToWithDamage)
+{
+	gdPangoContext *context;
+	gdImagePtr im, imx;
+	gdRect damage;
+	context = gdPangoCreateContext();
+	gdPangoSetText(context, "a", -1);
+	im = gdImageCreateTrueColor(100, 120);
+	imx = gdPangoRenderToWithDamage(context, im, 50, 50, &damage);
+	gdTestAssert(im == imx);
+	gdTestAssert(damage.width > 0 && damage.height > 0);
+	gdTestAssert(damage.x >= 50 && damage.y >= 50);
+	gdTestAssert(damage.x + damage.width <= 100);
+	/* nothing lands on the surface */
+	imx = gdPangoRenderToWithDamage(context, im, 200, 200, &damage);
+	gdTestAssert(damage.width == 0 && damage.height == 0);
+	/* nothing lands in the clipping rectangle */
+	gdImageSetClip(im, 0, 0, 40, 40);
+	imx = gdPangoRenderToWithDamage(context, im, 50, 50, &damage);
+	gdTestAssert(damage.width == 0 && damage.height == 0);
+	gdImageSetClip(im, 0, 0, 54, 119);
+	imx = gdPangoRenderToWithDamage(context, im, 50, 0, &damage);
+	gdTestAssert(damage.x + damage.width <= 55);
+	gdImageDestroy(im);
+	gdPangoFreeContext(context);
+}
+
+TEST(gdPangoRenderTiles)
+{
+	gdPangoContext *context;
+	gdImagePtr im, tiles[2];
+	gdRect damages[2];
+	int r, i, k;
+	context = gdPangoCreateContext();
+	gdPangoSetText(context, "abcdef", -1);
+	im = gdImageCreateTrueColor(64, 32);
+	tiles[0] = gdImageCreateTrueColor(32, 32);
+	tiles[1] = gdImageCreateTrueColor(32, 32);
+	gdPangoRenderTo(context, im, 20, 5);
+	r = gdPangoRenderTiles(context, tiles, 2, 1, 32, 32, 20, 5, damages);
+	gdTestAssert(r == GD_SUCCESS);
+	gdTestAssert(damages[0].width > 0 && damages[1].width > 0);
+	/* seams match the single surface rendering */
+	for (i = 0; i < 32; i++) {
+		for (k = 0; k < 64; k++) {
+			gdTestAssert(gdImageGetTrueColorPixel(im, k, i) ==
+				gdImageGetTrueColorPixel(tiles[k / 32], k % 32, i));
+		}
+	}
+	gdImageDestroy(tiles[0]);
+	gdImageDestroy(tiles[1]);
+	gdImageDestroy(im);
+	gdPangoFreeContext(context);
+}
+
+static int band_check(gdImagePtr band, int y, int rows, void *user_data)
+{
+	gdImagePtr im = (gdImagePtr)user_data;
+	int i, k;
+	gdTestAssert(rows > 0 && rows <= gdImageSY(band));
+	for (i = 0; i < rows; i++) {
+		for (k = 0; k < gdImageSX(band); k++) {
+			gdTestAssert(gdImageGetTrueColorPixel(band, k, i) ==
+				gdImageGetTrueColorPixel(im, k, y + i));
+		}
+	}
+	return GD_SUCCESS;
+}
+
+TEST(gdPangoRenderBands)
+{
+	gdPangoContext *context;
+	gdImagePtr im;
+	int r;
+	context = gdPangoCreateContext();
+	gdPangoSetText(context, "one\ntwo\nthree\nfour\nfive", -1);
+	im = gdPangoCreateSurfaceDraw(context);
+	r = gdPangoRenderBands(context, 7, band_check, im);
+	gdTestAssert(r == GD_SUCCESS);
+	r = gdPangoRenderBands(context, 0, band_check, im);
+	gdTestAssert(r == GD_FAILURE);
+	gdImageDestroy(im);
+	gdPangoFreeContext(context);
+}
+
+TEST(gdPangoCreateDocument)
+{
+	gdPangoContext *context;
+	gdPangoDocument *document;
+	const char *text = "one\ntwo\nthree\n\nfive\nsix";
+	context = gdPangoCreateContext();
+	document = gdPangoCreateDocument(context, text, -1, 20);
+	gdTestAssert(document);
+	gdTestAssert(document->n_paragraphs == 6);
+	gdTestAssert(document->n_measured == 0);
+	gdPangoFreeDocument(document);
+	document = gdPangoCreateDocument(context, text, -1, 0);
+	gdTestAssert(document == NULL);
+	gdPangoFreeContext(context);
+}
+
+#define test_gdPangoFreeDocument test_gdPangoCreateDocument
+
+TEST(gdPangoDocumentGetHeight)
+{
+	gdPangoContext *context;
+	gdPangoDocument *document;
+	const char *text = "one\ntwo\nthree\n\nfive\nsix";
+	context = gdPangoCreateContext();
+	gdPangoSetText(context, text, -1);
+	document = gdPangoCreateDocument(context, text, -1, 20);
+	gdTestAssert(gdPangoDocumentGetHeight(document) == gdPangoGetLayoutHeight(context));
+	gdTestAssert(gdPangoDocumentGetPageCount(document) > 1);
+	gdPangoFreeDocument(document);
+	gdPangoFreeContext(context);
+}
+
+#define test_gdPangoDocumentGetPageCount test_gdPangoDocumentGetHeight
+
+TEST(gdPangoDocumentRenderPage)
+{
+	gdPangoContext *context;
+	gdPangoDocument *document;
+	gdImagePtr im;
+	int r, i, k, n = 0;
+	context = gdPangoCreateContext();
+	document = gdPangoCreateDocument(context, "one\ntwo\nthree\nfour\nfive", -1, 20);
+	im = gdImageCreateTrueColor(100, 20);
+	r = gdPangoDocumentRenderPage(document, im, 0, 0, 0);
+	gdTestAssert(r == GD_SUCCESS);
+	/* only the paragraphs of the first page are known */
+	gdTestAssert(document->n_measured < document->n_paragraphs);
+	for (i = 0; i < 20; i++) {
+		for (k = 0; k < 100; k++) {
+			n += (gdImageGetTrueColorPixel(im, k, i) != 0);
+		}
+	}
+	gdTestAssert(n > 0);
+	r = gdPangoDocumentRenderPage(document, im, 0, 0, -1);
+	gdTestAssert(r == GD_FAILURE);
+	gdImageDestroy(im);
+	gdPangoFreeDocument(document);
+	gdPangoFreeContext(context);
+}
+
+#define test_gdPangoDocumentRenderRange test_gdPangoDocumentRenderPage
+
+TEST(gdPangoDocumentSetText)
+{
+	gdPangoContext *context;
+	gdPangoDocument *document;
+	gdImagePtr im;
+	gdRect damage;
+	int r, w, y1, y2;
+	context = gdPangoCreateContext();
+	document = gdPangoCreateDocument(context, "12:00:00\nstatic\nstatic", -1, 100);
+	im = gdImageCreateTrueColor(100, 100);
+	r = gdPangoDocumentRepaint(document, im, 0, 0, &damage);
+	gdTestAssert(r == GD_SUCCESS);
+	gdTestAssert(damage.width > 0 && damage.height > 0);
+	/* only the first paragraph changed */
+	r = gdPangoDocumentSetText(document, "12:00:01\nstatic\nstatic", -1);
+	gdTestAssert(r == 1);
+	r = gdPangoDocumentRepaint(document, im, 0, 0, &damage);
+	gdTestAssert(damage.width > 0 && damage.height > 0);
+	w = damage.width;
+	/* with the room of underlines below the ink */
+	gdTestAssert(damage.y + damage.height <= PANGO_PIXELS(document->paragraphs[1].y) + 5);
+	/* the layouts are not kept */
+	gdTestAssert(!document->paragraphs[0].layout && !document->paragraphs[1].layout &&
+		!document->paragraphs[2].layout);
+	/* nothing changed */
+	r = gdPangoDocumentSetText(document, "12:00:01\nstatic\nstatic", -1);
+	gdTestAssert(r == 0);
+	r = gdPangoDocumentRepaint(document, im, 0, 0, &damage);
+	gdTestAssert(damage.width == 0 && damage.height == 0);
+	/* the paragraphs around a changed one stay in place */
+	y1 = document->paragraphs[1].y;
+	y2 = document->paragraphs[2].y;
+	r = gdPangoDocumentSetText(document, "12:00:01\nstatic!\nstatic", -1);
+	gdTestAssert(r == 1);
+	r = gdPangoDocumentRepaint(document, im, 0, 0, &damage);
+	gdTestAssert(document->paragraphs[0].y == 0 && document->paragraphs[1].y == y1 &&
+		document->paragraphs[2].y == y2);
+	gdTestAssert(damage.y >= PANGO_PIXELS(y1) - 5 && damage.y + damage.height <= PANGO_PIXELS(y2) + 5);
+	gdTestAssert(!document->paragraphs[1].layout);
+	/* a removed paragraph is erased */
+	r = gdPangoDocumentSetText(document, "12:00:01\nstatic", -1);
+	gdTestAssert(r == 1);
+	r = gdPangoDocumentRepaint(document, im, 0, 0, &damage);
+	gdTestAssert(damage.width > 0 && damage.height > 0);
+	/* the halo around the changed text is erased too */
+	gdPangoSetHalo(context, 3, 0x000000);
+	r = gdPangoDocumentRepaint(document, im, 0, 0, &damage);
+	r = gdPangoDocumentSetText(document, "12:00:02\nstatic", -1);
+	r = gdPangoDocumentRepaint(document, im, 0, 0, &damage);
+	gdTestAssert(damage.width == w + 6);
+	gdImageDestroy(im);
+	gdPangoFreeDocument(document);
+	gdPangoFreeContext(context);
+}
+
+#define test_gdPangoDocumentRepaint test_gdPangoDocumentSetText
+
+TEST(gdPangoCreateTemplate)
+{
+	gdPangoTemplate *tmpl;
+	int error;
+	tmpl = gdPangoCreateTemplate("Price: <b>{amount}</b> {currency} {}", -1, NULL);
+	gdTestAssert(tmpl);
+	gdTestAssert(tmpl->n_fields == 2);
+	gdTestAssert(gdPangoTemplateGetField(tmpl, "amount") == 0);
+	gdTestAssert(gdPangoTemplateGetField(tmpl, "currency") == 1);
+	gdTestAssert(gdPangoTemplateGetField(tmpl, "price") == -1);
+	gdPangoFreeTemplate(tmpl);
+	tmpl = gdPangoCreateTemplate("<b>{amount}", -1, &error);
+	gdTestAssert(tmpl == NULL && error == GD_PANGO_ERROR_MARKUP);
+}
+
+#define test_gdPangoFreeTemplate test_gdPangoCreateTemplate
+#define test_gdPangoTemplateGetField test_gdPangoCreateTemplate
+
+TEST(gdPangoSetTemplate)
+{
+	gdPangoContext *context;
+	gdPangoTemplate *tmpl;
+	const char *values[2];
+	int r, w1, w2;
+	context = gdPangoCreateContext();
+	tmpl = gdPangoCreateTemplate("Price: <b>{amount}</b> {currency}", -1, NULL);
+	values[0] = "12.50";
+	values[1] = "EUR";
+	r = gdPangoSetTemplate(context, tmpl, values, 2);
+	gdTestAssert(r == GD_SUCCESS);
+	gdTestAssert(strcmp(pango_layout_get_text(context->layout), "Price: 12.50 EUR") == 0);
+	w1 = gdPangoGetLayoutWidth(context);
+	gdPangoSetMarkup(context, "Price: <b>12.50</b> EUR", -1);
+	w2 = gdPangoGetLayoutWidth(context);
+	gdTestAssert(w1 == w2);
+	r = gdPangoSetTemplate(context, tmpl, values, 1);
+	gdTestAssert(strcmp(pango_layout_get_text(context->layout), "Price: 12.50 ") == 0);
+	gdPangoFreeTemplate(tmpl);
+	gdPangoFreeContext(context);
+}
+
+TEST(gdPangoCompileMarkup)
+{
+	gdPangoContext *context;
+	gdPangoMarkup *markup;
+	int error, w1, w2;
+	context = gdPangoCreateContext();
+	markup = gdPangoCompileMarkup("<i>Hello</i> <b>World</b>", -1, NULL);
+	gdTestAssert(markup);
+	gdTestAssert(strcmp(markup->text, "Hello World") == 0);
+	gdPangoSetCompiledMarkup(context, markup);
+	gdPangoFreeMarkup(markup);
+	gdTestAssert(strcmp(pango_layout_get_text(context->layout), "Hello World") == 0);
+	w1 = gdPangoGetLayoutWidth(context);
+	gdPangoSetMarkup(context, "<i>Hello</i> <b>World</b>", -1);
+	w2 = gdPangoGetLayoutWidth(context);
+	gdTestAssert(w1 == w2);
+	markup = gdPangoCompileMarkup("<i>Hello", -1, &error);
+	gdTestAssert(markup == NULL && error == GD_PANGO_ERROR_MARKUP);
+	gdPangoFreeContext(context);
+}
+
+#define test_gdPangoFreeMarkup test_gdPangoCompileMarkup
+#define test_gdPangoSetCompiledMarkup test_gdPangoCompileMarkup
+
+TEST(gdPangoBeginUpdate)
+{
+	gdPangoContext *context;
+	context = gdPangoCreateContext();
+	gdPangoSetText(context, "old", -1);
+	gdPangoBeginUpdate(context);
+	gdPangoSetMarkup(context, "<b>new</b> text", -1);
+	gdPangoSetWidth(context, 100);
+	gdPangoBeginUpdate(context);
+	gdPangoSetAlignment(context, PANGO_ALIGN_CENTER);
+	gdPangoCommitUpdate(context);
+	gdTestAssert(strcmp(pango_layout_get_text(context->layout), "old") == 0);
+	gdTestAssert(pango_layout_get_width(context->layout) == -1);
+	gdPangoCommitUpdate(context);
+	gdTestAssert(strcmp(pango_layout_get_text(context->layout), "new text") == 0);
+	gdTestAssert(pango_layout_get_width(context->layout) == 100 * PANGO_SCALE);
+	gdTestAssert(pango_layout_get_alignment(context->layout) == PANGO_ALIGN_CENTER);
+	gdPangoSetWidth(context, -1);
+	gdTestAssert(pango_layout_get_width(context->layout) == -1);
+	gdPangoFreeContext(context);
+}
+
+#define test_gdPangoCommitUpdate test_gdPangoBeginUpdate
+#define test_gdPangoSetWidth test_gdPangoBeginUpdate
+#define test_gdPangoSetAlignment test_gdPangoBeginUpdate
+
+TEST(gdPangoSetFontDescription)
+{
+	gdPangoContext *context;
+	PangoFontDescription *desc;
+	int w1, w2;
+	context = gdPangoCreateContext();
+	gdPangoSetText(context, "Hello World", -1);
+	w1 = gdPangoGetLayoutWidth(context);
+	desc = pango_font_description_from_string("Vera 20");
+	gdPangoSetFontDescription(context, desc);
+	pango_font_description_free(desc);
+	w2 = gdPangoGetLayoutWidth(context);
+	gdTestAssert(w2 > w1);
+	gdPangoFreeContext(context);
+}
+
+/* the simple text path must draw as the full path */
+TEST(gdPangoSimpleText)
+{
+	gdPangoContext *context;
+	gdImagePtr im1, im2;
+	PangoAttrList *attrs;
+	PangoRectangle logical_rect;
+	int w1, h1, x, y, same = 1;
+	context = gdPangoCreateContext();
+	gdPangoSetText(context, "AVA To 10.5 Wy", -1);
+	w1 = gdPangoGetLayoutWidth(context);
+	h1 = gdPangoGetLayoutHeight(context);
+	/* the placed glyphs are kept until the layout changes */
+	gdTestAssert(context->simple_valid && context->simple);
+	gdTestAssert(context->simple_serial == pango_layout_get_serial(context->layout));
+	im1 = gdPangoCreateSurfaceDraw(context);
+	/* any attribute list disables the simple path */
+	attrs = pango_attr_list_new();
+	pango_layout_set_attributes(context->layout, attrs);
+	pango_attr_list_unref(attrs);
+	gdTestAssert(gdPangoGetLayoutWidth(context) == w1);
+	gdTestAssert(gdPangoGetLayoutHeight(context) == h1);
+	gdTestAssert(context->simple == NULL);
+	im2 = gdPangoCreateSurfaceDraw(context);
+	gdTestAssert(gdImageSX(im1) == gdImageSX(im2) && gdImageSY(im1) == gdImageSY(im2));
+	for (y = 0; y < gdImageSY(im1); y++) {
+		for (x = 0; x < gdImageSX(im1); x++) {
+			if (gdImageGetPixel(im1, x, y) != gdImageGetPixel(im2, x, y)) {
+				same = 0;
+			}
+		}
+	}
+	gdTestAssert(same);
+	gdImageDestroy(im1);
+	gdImageDestroy(im2);
+	/* ligatures and contextual forms measure as the shaper gives them */
+	pango_layout_set_attributes(context->layout, NULL);
+	gdPangoSetText(context, "official affix waffle", -1);
+	w1 = gdPangoGetLayoutWidth(context);
+	pango_layout_get_extents(context->layout, NULL, &logical_rect);
+	gdTestAssert(w1 == PANGO_PIXELS(logical_rect.width));
+	/* text needing shaping still renders */
+	gdPangoSetText(context, "\xd8\xb3\xd9\x84\xd8\xa7\xd9\x85 office", -1);
+	gdTestAssert(gdPangoGetLayoutWidth(context) > 0);
+	gdPangoFreeContext(context);
+}
+
+TEST(gdPangoGetMetrics)
+{
+	gdPangoContext *context;
+	gdPangoMetrics *metrics;
+	PangoRectangle logical_rect;
+	PangoAttrList *attrs;
+	int r, width, ascent, descent, height;
+	context = gdPangoCreateContext();
+	metrics = gdPangoGetMetrics(context, NULL);
+	gdTestAssert(metrics);
+	gdTestAssert(gdPangoGetMetrics(context, context->font_desc) == metrics);
+	r = gdPangoMetricsGetWidth(metrics, "AVA Main St. 1024", -1, &width);
+	gdTestAssert(r == GD_SUCCESS);
+	gdTestAssert(!gdPangoMetricsNeedsShaping(metrics, "AVA Main St. 1024", -1));
+	/* measure with the full path */
+	attrs = pango_attr_list_new();
+	pango_layout_set_attributes(context->layout, attrs);
+	pango_attr_list_unref(attrs);
+	pango_layout_set_text(context->layout, "AVA Main St. 1024", -1);
+	pango_layout_get_extents(context->layout, NULL, &logical_rect);
+	gdTestAssert(width == logical_rect.width);
+	r = gdPangoMetricsGetLine(metrics, &ascent, &descent, &height);
+	gdTestAssert(r == GD_SUCCESS);
+	gdTestAssert(ascent + descent == height);
+	gdTestAssert(height == logical_rect.height);
+	gdTestAssert(ascent == pango_layout_get_baseline(context->layout));
+	gdTestAssert(gdPangoMetricsNeedsShaping(metrics, "\xd8\xb3\xd9\x84\xd8\xa7\xd9\x85", -1));
+	r = gdPangoMetricsGetWidth(metrics, "e\xcc\x81", -1, &width);
+	gdTestAssert(r == GD_FAILURE);
+	gdPangoFreeContext(context);
+}
+
+#define test_gdPangoMetricsNeedsShaping test_gdPangoGetMetrics
+#define test_gdPangoMetricsGetWidth test_gdPangoGetMetrics
+#define test_gdPangoMetricsGetLine test_gdPangoGetMetrics
+
+TEST(gdPangoFitToBox)
+{
+	gdPangoContext *context;
+	double size;
+	int r;
+	context = gdPangoCreateContext();
+	gdPangoSetText(context, "Grand opening sale, everything must go", -1);
+	r = gdPangoFitToBox(context, 200, 80, 6, 72, PANGO_WRAP_WORD, &size);
+	gdTestAssert(r == GD_SUCCESS);
+	gdTestAssert(size >= 6 && size <= 72);
+	gdTestAssert(pango_font_description_get_size(context->font_desc) == (int)(size * PANGO_SCALE));
+	gdTestAssert(gdPangoGetLayoutWidth(context) <= 200);
+	gdTestAssert(gdPangoGetLayoutHeight(context) <= 80);
+	gdTestAssert(size > 6);
+	r = gdPangoFitToBox(context, 10, 4, 6, 72, PANGO_WRAP_WORD, &size);
+	gdTestAssert(r == GD_FAILURE && size == 6);
+	/* a short line above a long one: the next half point must not fit */
+	gdPangoSetText(context, "SALE\nEverything in the store must go today", -1);
+	r = gdPangoFitToBox(context, 300, 200, 6, 72, PANGO_WRAP_WORD, &size);
+	gdTestAssert(r == GD_SUCCESS);
+	gdTestAssert(gdPangoGetLayoutWidth(context) <= 300);
+	gdTestAssert(gdPangoGetLayoutHeight(context) <= 200);
+	gdTestAssert(size < 72);
+	pango_font_description_set_size(context->font_desc, (gint)((size + 0.5) * PANGO_SCALE));
+	pango_layout_set_font_description(context->layout, context->font_desc);
+	gdTestAssert(gdPangoGetLayoutWidth(context) > 300 ||
+		gdPangoGetLayoutHeight(context) > 200);
+	gdPangoFreeContext(context);
+}
+
+TEST(gdPangoRenderScales)
+{
+	gdPangoContext *context;
+	gdImagePtr surfaces[3], im;
+	double scales[3] = {1, 2, 3};
+	int r, i;
+	context = gdPangoCreateContext();
+	gdPangoSetText(context, "Hello World", -1);
+	im = gdPangoCreateSurfaceDraw(context);
+	r = gdPangoRenderScales(context, scales, 3, surfaces);
+	gdTestAssert(r == GD_SUCCESS);
+	gdTestAssert(gdImageSX(surfaces[0]) == gdImageSX(im));
+	gdTestAssert(gdImageSY(surfaces[0]) == gdImageSY(im));
+	for (i = 1; i < 3; i++) {
+		/* hinting makes the size not exactly proportional */
+		gdTestAssert(abs(gdImageSX(surfaces[i]) - (int)(scales[i] * gdImageSX(im))) <= 2 * scales[i]);
+		gdTestAssert(abs(gdImageSY(surfaces[i]) - (int)(scales[i] * gdImageSY(im))) <= 2 * scales[i]);
+	}
+	/* the context itself is unchanged */
+	gdTestAssert(gdPangoGetLayoutWidth(context) == gdImageSX(im));
+	for (i = 0; i < 3; i++) {
+		gdImageDestroy(surfaces[i]);
+	}
+	/* every scale draws the halo */
+	gdPangoSetHalo(context, 2, 0xFF0000);
+	r = gdPangoRenderScales(context, scales, 3, surfaces);
+	gdTestAssert(r == GD_SUCCESS);
+	for (i = 0; i < 3; i++) {
+		int x, y, n = 0;
+		for (y = 0; y < gdImageSY(surfaces[i]); y++) {
+			for (x = 0; x < gdImageSX(surfaces[i]); x++) {
+				n += ((gdImageGetTrueColorPixel(surfaces[i], x, y) & 0xFFFFFF) == 0xFF0000);
+			}
+		}
+		gdTestAssert(n > 0);
+		gdImageDestroy(surfaces[i]);
+	}
+	/* a scale of zero is refused */
+	scales[1] = 0;
+	surfaces[0] = NULL;
+	r = gdPangoRenderScales(context, scales, 3, surfaces);
+	gdTestAssert(r == GD_FAILURE && surfaces[0] == NULL);
+	gdImageDestroy(im);
+	gdPangoFreeContext(context);
+}
+
+TEST(gdPangoBuildAtlas)
+{
+	gdPangoContext *context;
+	gdPangoAtlas *atlas;
+	gdPangoPositionedGlyph *glyphs;
+	unsigned char *table;
+	int i, j, n, size, error;
+	context = gdPangoCreateContext();
+	atlas = gdPangoBuildAtlas(context, "Hello World", -1, 64, 1, NULL);
+	gdTestAssert(atlas);
+	/* H e l o space W r d */
+	gdTestAssert(atlas->n_glyphs == 8);
+	for (i = 0; i < atlas->n_glyphs; i++) {
+		gdPangoAtlasGlyph *g1 = &atlas->glyphs[i];
+		gdTestAssert(g1->advance > 0);
+		gdTestAssert(g1->x >= 0 && g1->x + g1->width <= gdImageSX(atlas->image));
+		gdTestAssert(g1->y >= 0 && g1->y + g1->height <= gdImageSY(atlas->image));
+		for (j = i + 1; j < atlas->n_glyphs; j++) {
+			gdPangoAtlasGlyph *g2 = &atlas->glyphs[j];
+			gdTestAssert(g1->glyph < g2->glyph);
+			if (g1->width && g2->width) {
+				gdTestAssert(g1->x + g1->width <= g2->x || g2->x + g2->width <= g1->x ||
+					g1->y + g1->height <= g2->y || g2->y + g2->height <= g1->y);
+			}
+		}
+	}
+	table = gdPangoAtlasWriteTable(atlas, &size);
+	gdTestAssert(size == GD_PANGO_ATLAS_HEADER_SIZE + 8 * GD_PANGO_ATLAS_ENTRY_SIZE);
+	gdTestAssert(memcmp(table, "GDPA", 4) == 0);
+	g_free(table);
+
+	gdPangoSetText(context, "Hello World", -1);
+	glyphs = gdPangoGetLayoutGlyphs(context, &n);
+	gdTestAssert(glyphs && n == 11);
+	for (i = 0; i < n; i++) {
+		gdTestAssert(gdPangoAtlasFind(atlas, glyphs[i].glyph) != NULL);
+		gdTestAssert(i == 0 || glyphs[i].x > glyphs[i - 1].x);
+	}
+	g_free(glyphs);
+	gdPangoFreeAtlas(atlas);
+
+	atlas = gdPangoBuildAtlasRange(context, '0', '9', 64, 0, NULL);
+	gdTestAssert(atlas && atlas->n_glyphs == 10);
+	gdPangoFreeAtlas(atlas);
+	atlas = gdPangoBuildAtlas(context, "W", -1, 2, 0, &error);
+	gdTestAssert(atlas == NULL);
+	gdPangoFreeContext(context);
+}
+
+#define test_gdPangoBuildAtlasRange test_gdPangoBuildAtlas
+#define test_gdPangoFreeAtlas test_gdPangoBuildAtlas
+#define test_gdPangoAtlasFind test_gdPangoBuildAtlas
+#define test_gdPangoAtlasWriteTable test_gdPangoBuildAtlas
+#define test_gdPangoGetLayoutGlyphs test_gdPangoBuildAtlas
+
+TEST(gdPangoBuildAtlasSDF)
+{
+	gdPangoContext *context;
+	gdPangoAtlas *atlas, *sdf, *again;
+	int i, x, y, error;
+	context = gdPangoCreateContext();
+	atlas = gdPangoBuildAtlas(context, "Hello World", -1, 128, 0, NULL);
+	sdf = gdPangoBuildAtlasSDF(context, "Hello World", -1, 128, 0, 4, NULL);
+	gdTestAssert(atlas && sdf);
+	gdTestAssert(sdf->spread == 4 && atlas->spread == 0);
+	gdTestAssert(sdf->n_glyphs == atlas->n_glyphs);
+	for (i = 0; i < sdf->n_glyphs; i++) {
+		gdPangoAtlasGlyph *g1 = &atlas->glyphs[i];
+		gdPangoAtlasGlyph *g2 = &sdf->glyphs[i];
+		gdTestAssert(g1->glyph == g2->glyph);
+		if (g1->width == 0) {
+			continue;
+		}
+		gdTestAssert(g2->width == g1->width + 8 && g2->height == g1->height + 8);
+		gdTestAssert(g2->bearing_x == g1->bearing_x - 4);
+		/* the border is outside, fully covered pixels are inside */
+		gdTestAssert(gdTrueColorGetRed(gdImageGetPixel(sdf->image, g2->x, g2->y)) < 128);
+		for (y = 0; y < g1->height; y++) {
+			for (x = 0; x < g1->width; x++) {
+				int c = gdImageGetPixel(atlas->image, g1->x + x, g1->y + y);
+				if (gdTrueColorGetAlpha(c) == gdAlphaOpaque) {
+					c = gdImageGetPixel(sdf->image, g2->x + x + 4, g2->y + y + 4);
+					gdTestAssert(gdTrueColorGetRed(c) > 128);
+				}
+			}
+		}
+	}
+
+	/* the second build uses the cached fields */
+	again = gdPangoBuildAtlasSDF(context, "Hello World", -1, 128, 0, 4, NULL);
+	gdTestAssert(again && gdImageSY(again->image) == gdImageSY(sdf->image));
+	for (y = 0; y < gdImageSY(sdf->image); y++) {
+		for (x = 0; x < gdImageSX(sdf->image); x++) {
+			gdTestAssert(gdImageGetPixel(sdf->image, x, y) == gdImageGetPixel(again->image, x, y));
+		}
+	}
+	gdPangoFreeAtlas(again);
+	gdPangoFreeAtlas(sdf);
+	gdPangoFreeAtlas(atlas);
+	gdTestAssert(gdPangoBuildAtlasSDF(context, "Hello", -1, 128, 0, 0, &error) == NULL);
+	gdPangoFreeContext(context);
+}
+
+TEST(gdPangoWriteGlyphCache)
+{
+	const char *path = "gd_pango_test.cache";
+	gdPangoContext *context;
+	gdPangoGlyphCache *cache;
+	gdImagePtr im1, im2;
+	PangoFontDescription *desc;
+	PangoFont *font;
+	FcChar8 *file;
+	gchar *contents, *files[2], *font_path;
+	gsize size1, size2;
+	int i, x, y, same = 1, error;
+	context = gdPangoCreateContext();
+	gdPangoSetText(context, "Hello World", -1);
+	im1 = gdPangoCreateSurfaceDraw(context);
+	gdTestAssert(gdPangoWriteGlyphCache(context, path, "Hello World", -1, NULL) == GD_SUCCESS);
+	cache = gdPangoOpenGlyphCache(path, NULL);
+	gdTestAssert(cache);
+	gdPangoSetGlyphCache(context, cache);
+	im2 = gdPangoCreateSurfaceDraw(context);
+	for (y = 0; y < gdImageSY(im1); y++) {
+		for (x = 0; x < gdImageSX(im1); x++) {
+			if (gdImageGetPixel(im1, x, y) != gdImageGetPixel(im2, x, y)) {
+				same = 0;
+			}
+		}
+	}
+	gdTestAssert(same);
+	gdImageDestroy(im1);
+	gdImageDestroy(im2);
+	gdPangoSetGlyphCache(context, NULL);
+	gdPangoFreeGlyphCache(cache);
+
+	/* masks hold the whole rendered glyphs of slanted and bold faces */
+	desc = pango_font_description_from_string("Serif Bold Italic 48");
+	gdPangoSetFontDescription(context, desc);
+	pango_font_description_free(desc);
+	gdPangoSetText(context, "fjWy", -1);
+	im1 = gdPangoCreateSurfaceDraw(context);
+	gdTestAssert(gdPangoWriteGlyphCache(context, path, "fjWy", -1, NULL) == GD_SUCCESS);
+	cache = gdPangoOpenGlyphCache(path, NULL);
+	gdTestAssert(cache);
+	gdPangoSetGlyphCache(context, cache);
+	im2 = gdPangoCreateSurfaceDraw(context);
+	for (y = 0; y < gdImageSY(im1); y++) {
+		for (x = 0; x < gdImageSX(im1); x++) {
+			if (gdImageGetPixel(im1, x, y) != gdImageGetPixel(im2, x, y)) {
+				same = 0;
+			}
+		}
+	}
+	gdTestAssert(same);
+	gdImageDestroy(im1);
+	gdImageDestroy(im2);
+	gdPangoSetGlyphCache(context, NULL);
+	gdPangoFreeGlyphCache(cache);
+	gdPangoSetText(context, "Hello World", -1);
+
+	/* writing a font again replaces it */
+	gdTestAssert(g_file_get_contents(path, &contents, &size1, NULL));
+	g_free(contents);
+	gdTestAssert(gdPangoWriteGlyphCache(context, path, "Hello World", -1, NULL) == GD_SUCCESS);
+	gdTestAssert(g_file_get_contents(path, &contents, &size2, NULL));
+	g_free(contents);
+	gdTestAssert(size1 == size2);
+
+	gdTestAssert(g_file_set_contents(path, "GDPC", 4, NULL));
+	gdTestAssert(gdPangoOpenGlyphCache(path, &error) == NULL);
+	gdTestAssert(error == GD_PANGO_ERROR_CACHE);
+
+	/* a font file replaced in place does not use the glyphs of the former one */
+	for (i = 0; i < 2; i++) {
+		desc = pango_font_description_from_string(i ? "Serif 12" : "Sans 12");
+		font = pango_context_load_font(gdPangoGetPangoContext(context), desc);
+		gdTestAssert(FcPatternGetString(pango_fc_font_get_pattern(PANGO_FC_FONT(font)),
+			FC_FILE, 0, &file) == FcResultMatch);
+		files[i] = g_strdup((const char *)file);
+		g_object_unref(font);
+		pango_font_description_free(desc);
+	}
+	font_path = g_build_filename(g_get_tmp_dir(), "gd_pango_test.ttf", NULL);
+	for (i = 0; i < 2 && strcmp(files[0], files[1]) != 0; i++) {
+		gdPangoContext *registry_context;
+		gdPangoFontRegistry *registry;
+		gdPangoStats stats;
+		gdImagePtr im;
+		gdTestAssert(g_file_get_contents(files[i], &contents, &size1, NULL));
+		gdTestAssert(g_file_set_contents(font_path, contents, size1, NULL));
+		g_free(contents);
+		registry = gdPangoCreateFontRegistry();
+		gdTestAssert(gdPangoRegisterFontFile(registry, font_path, NULL) == 0);
+		registry_context = gdPangoCreateRegistryContext(registry);
+		gdPangoFreeFontRegistry(registry);
+		gdTestAssert(gdPangoSetRegisteredFont(registry_context, 0, 12, NULL) == GD_SUCCESS);
+		gdPangoSetText(registry_context, "Hello World", -1);
+		if (i == 0) {
+			gdTestAssert(gdPangoWriteGlyphCache(registry_context, path, "Hello World", -1, NULL) == GD_SUCCESS);
+		} else {
+			cache = gdPangoOpenGlyphCache(path, NULL);
+			gdTestAssert(cache);
+			gdPangoSetGlyphCache(registry_context, cache);
+			gdPangoEnableStats(registry_context, 1);
+			im = gdImageCreateTrueColor(200, 40);
+			gdPangoRenderTo(registry_context, im, 0, 0);
+			gdPangoGetStats(registry_context, &stats);
+			gdTestAssert(stats.cache_hits == 0 && stats.cache_misses > 0);
+			gdImageDestroy(im);
+			gdPangoSetGlyphCache(registry_context, NULL);
+			gdPangoFreeGlyphCache(cache);
+		}
+		gdPangoFreeContext(registry_context);
+	}
+	remove(font_path);
+	g_free(font_path);
+	g_free(files[0]);
+	g_free(files[1]);
+	remove(path);
+	gdPangoFreeContext(context);
+}
+
+#define test_gdPangoOpenGlyphCache test_gdPangoWriteGlyphCache
+#define test_gdPangoFreeGlyphCache test_gdPangoWriteGlyphCache
+#define test_gdPangoSetGlyphCache test_gdPangoWriteGlyphCache
+
+TEST(gdPangoPackLabels)
+{
+	gdPangoContext *context;
+	gdPangoLabelRect rects[20];
+	gdImagePtr *sheets, im;
+	const char *labels[20];
+	char buffers[20][16];
+	int i, j, r, n_sheets;
+	context = gdPangoCreateContext();
+	for (i = 0; i < 20; i++) {
+		snprintf(buffers[i], sizeof(buffers[i]), "Label %d", i * 37);
+		labels[i] = buffers[i];
+	}
+	r = gdPangoPackLabels(context, labels, 20, 128, 64, 1, &sheets, &n_sheets, rects);
+	gdTestAssert(r == GD_SUCCESS);
+	gdTestAssert(n_sheets > 1);
+	for (i = 0; i < 20; i++) {
+		gdTestAssert(rects[i].sheet >= 0 && rects[i].sheet < n_sheets);
+		gdTestAssert(rects[i].x >= 1 && rects[i].x + rects[i].width <= 128);
+		gdTestAssert(rects[i].y >= 1 && rects[i].y + rects[i].height <= gdImageSY(sheets[rects[i].sheet]));
+		for (j = 0; j < i; j++) {
+			if (rects[i].sheet == rects[j].sheet) {
+				gdTestAssert(rects[i].x + rects[i].width <= rects[j].x ||
+					rects[j].x + rects[j].width <= rects[i].x ||
+					rects[i].y + rects[i].height <= rects[j].y ||
+					rects[j].y + rects[j].height <= rects[i].y);
+			}
+		}
+	}
+	/* the context is left with the last label */
+	gdTestAssert(strcmp(pango_layout_get_text(context->layout), labels[19]) == 0);
+	/* the kept layouts are drawn in their rectangles */
+	im = sheets[rects[3].sheet];
+	r = 0;
+	for (j = 0; j < rects[3].height; j++) {
+		for (i = 0; i < rects[3].width; i++) {
+			if (gdImageGetPixel(im, rects[3].x + i, rects[3].y + j) != gdImageGetPixel(im, 0, 0)) {
+				r = 1;
+			}
+		}
+	}
+	gdTestAssert(r);
+	gdPangoSetText(context, labels[3], -1);
+	im = gdPangoCreateSurfaceDraw(context);
+	gdTestAssert(gdImageSX(im) == rects[3].width && gdImageSY(im) == rects[3].height);
+	gdImageDestroy(im);
+	for (i = 0; i < n_sheets; i++) {
+		gdImageDestroy(sheets[i]);
+	}
+	g_free(sheets);
+	/* a label wider than the sheets */
+	r = gdPangoPackLabels(context, labels, 20, 8, 64, 0, &sheets, &n_sheets, rects);
+	gdTestAssert(r == GD_FAILURE && sheets == NULL);
+	gdPangoFreeContext(context);
+}
+
+TEST(gdPangoSetHalo)
+{
+	gdPangoContext *context;
+	gdImagePtr im;
+	gdRect d1, d2;
+	PangoAttrList *attrs;
+	gdPangoStats stats;
+	int x, y, red = 0;
+	context = gdPangoCreateContext();
+	gdPangoSetText(context, "Main St", -1);
+	im = gdImageCreateTrueColor(200, 60);
+	gdPangoRenderToWithDamage(context, im, 10, 10, &d1);
+	gdImageFilledRectangle(im, 0, 0, 199, 59, 0);
+	gdPangoSetHalo(context, 2, 0xFF0000);
+	gdPangoRenderToWithDamage(context, im, 10, 10, &d2);
+	gdTestAssert(d2.x == d1.x - 2 && d2.y == d1.y - 2);
+	gdTestAssert(d2.width == d1.width + 4 && d2.height == d1.height + 4);
+	for (y = d2.y; y < d2.y + d2.height; y++) {
+		for (x = d2.x; x < d2.x + d2.width; x++) {
+			if (gdImageGetPixel(im, x, y) == 0xFF0000) {
+				red++;
+			}
+		}
+	}
+	gdTestAssert(red > 0);
+	/* a single run through the full path is rasterized once */
+	attrs = pango_attr_list_new();
+	pango_layout_set_attributes(context->layout, attrs);
+	pango_attr_list_unref(attrs);
+	gdPangoEnableStats(context, 1);
+	gdPangoRenderTo(context, im, 10, 10);
+	gdPangoGetStats(context, &stats);
+	gdTestAssert(stats.runs == 1 && stats.glyphs == 7);
+	gdPangoEnableStats(context, 0);
+	/* markup runs take the two pass path */
+	gdImageFilledRectangle(im, 0, 0, 199, 59, 0);
+	gdPangoSetMarkup(context, "<b>Main</b> St", -1);
+	gdPangoRenderToWithDamage(context, im, 10, 10, &d2);
+	gdTestAssert(d2.width > 4 && d2.height > 4);
+	gdImageDestroy(im);
+	gdPangoFreeContext(context);
+}
+
+TEST(gdPangoSetShadow)
+{
+	gdPangoContext *context;
+	gdImagePtr im;
+	gdRect d1, d2;
+	context = gdPangoCreateContext();
+	gdPangoSetText(context, "Shadow", -1);
+	im = gdImageCreateTrueColor(200, 60);
+	gdPangoRenderToWithDamage(context, im, 10, 10, &d1);
+	/* a sharp shadow is the text moved by the offset */
+	gdImageFilledRectangle(im, 0, 0, 199, 59, 0);
+	gdPangoSetShadow(context, 3, 2, 0, 0x808080);
+	gdPangoRenderToWithDamage(context, im, 10, 10, &d2);
+	gdTestAssert(d2.x == d1.x && d2.y == d1.y);
+	gdTestAssert(d2.width == d1.width + 3 && d2.height == d1.height + 2);
+	/* a blurred shadow spreads around it */
+	gdImageFilledRectangle(im, 0, 0, 199, 59, 0);
+	gdPangoSetShadow(context, 3, 2, 3, 0x808080);
+	gdPangoRenderToWithDamage(context, im, 10, 10, &d2);
+	gdTestAssert(d2.width > d1.width + 3 && d2.height > d1.height + 2);
+	gdTestAssert(d2.x + d2.width <= d1.x + d1.width + 6);
+	gdPangoSetShadow(context, 0, 0, 0, 0);
+	gdPangoRenderToWithDamage(context, im, 10, 10, &d2);
+	gdTestAssert(d2.x == d1.x && d2.width == d1.width);
+	gdImageDestroy(im);
+	gdPangoFreeContext(context);
+}
+
+TEST(gdPangoWarmup)
+{
+	const char *fonts[] = {"Sans 10", "Serif Bold 14", NULL};
+	const char *missing[] = {"No Such Family Gd 12", NULL};
+	const char *languages[] = {"en", "ru", NULL};
+	const char *samples[] = {"Hello", "\xd0\x9f\xd1\x80\xd0\xb8\xd0\xb2\xd0\xb5\xd1\x82", NULL};
+	gdPangoContext *context, *shared;
+	gdPangoWarmupTask *task;
+	gdPangoWarmupTimes times;
+	gdImagePtr im;
+	context = gdPangoCreateContext();
+	gdTestAssert(gdPangoWarmup(context, fonts, languages, samples, &times) == GD_SUCCESS);
+	gdTestAssert(times.fontconfig >= 0 && times.fonts >= 0);
+	gdTestAssert(times.fallback >= 0 && times.render >= 0);
+	gdTestAssert(gdPangoWarmup(NULL, NULL, NULL, NULL, NULL) == GD_SUCCESS);
+	/* a substituted family is reported */
+	gdTestAssert(gdPangoWarmup(context, missing, NULL, NULL, NULL) == GD_FAILURE);
+
+	/* shared contexts are warmed on their own thread */
+	shared = gdPangoCreateSharedContext();
+	gdTestAssert(gdPangoWarmupStart(shared, fonts, NULL, samples) == NULL);
+	gdPangoFreeContext(shared);
+
+	task = gdPangoWarmupStart(context, fonts, NULL, samples);
+	gdTestAssert(task);
+	gdTestAssert(gdPangoWarmupJoin(task, &times) == GD_SUCCESS);
+	gdTestAssert(times.render >= 0);
+
+	gdPangoSetText(context, samples[1], -1);
+	im = gdPangoCreateSurfaceDraw(context);
+	gdTestAssert(im);
+	gdImageDestroy(im);
+	gdPangoFreeContext(context);
+}
+
+#define test_gdPangoWarmupStart test_gdPangoWarmup
+#define test_gdPangoWarmupJoin test_gdPangoWarmup
+
+TEST(gdPangoCreateSharedContext)
+{
+	gdPangoContext *c1, *c2, *c3;
+	PangoFontMap *font_map;
+	const char *language;
+	int w1, w2;
+	c1 = gdPangoCreateSharedContext();
+	c2 = gdPangoCreateSharedContext();
+	c3 = gdPangoCreateContext();
+	gdTestAssert(gdPangoGetPangoFontMap(c1) == gdPangoGetPangoFontMap(c2));
+	gdTestAssert(gdPangoGetPangoFontMap(c1) != gdPangoGetPangoFontMap(c3));
+	/* a language tag, not a charset name */
+	language = pango_language_to_string(pango_context_get_language(gdPangoGetPangoContext(c3)));
+	gdTestAssert(strcmp(language, "utf-8") != 0 && strcmp(language, "ansi_x3.4-1968") != 0);
+
+	gdPangoSetText(c1, "office \xd0\x9f\xd1\x80\xd0\xb8\xd0\xb2\xd0\xb5\xd1\x82 \xd7\xa9\xd7\x9c\xd7\x95\xd7\x9d", -1);
+	gdPangoSetText(c2, "office \xd0\x9f\xd1\x80\xd0\xb8\xd0\xb2\xd0\xb5\xd1\x82 \xd7\xa9\xd7\x9c\xd7\x95\xd7\x9d", -1);
+	gdPangoSetText(c3, "office \xd0\x9f\xd1\x80\xd0\xb8\xd0\xb2\xd0\xb5\xd1\x82 \xd7\xa9\xd7\x9c\xd7\x95\xd7\x9d", -1);
+	w1 = gdPangoGetLayoutWidth(c1);
+	gdTestAssert(w1 > 0 && w1 == gdPangoGetLayoutWidth(c2));
+	gdTestAssert(w1 == gdPangoGetLayoutWidth(c3));
+	/* fallback fonts are resolved for shared contexts only */
+	gdTestAssert(c1->fallback != NULL && c3->fallback == NULL);
+
+	/* the resolution of a shared context does not change the others */
+	gdPangoSetDpi(c2, 192, 192);
+	w2 = gdPangoGetLayoutWidth(c2);
+	gdTestAssert(w2 > w1);
+	gdTestAssert(gdPangoGetPangoFontMap(c1) != gdPangoGetPangoFontMap(c2));
+	gdTestAssert(gdPangoGetLayoutWidth(c1) == w1);
+
+	/* maps are released once no shared context uses them */
+	font_map = gdPangoGetPangoFontMap(c1);
+	g_object_add_weak_pointer(G_OBJECT(font_map), (gpointer *)&font_map);
+	gdPangoReleaseSharedMaps();
+	gdTestAssert(font_map != NULL);
+	gdPangoFreeContext(c1);
+	gdPangoFreeContext(c2);
+	gdPangoFreeContext(c3);
+	gdPangoReleaseSharedMaps();
+	gdTestAssert(font_map == NULL);
+}
+
+#define test_gdPangoReleaseSharedMaps test_gdPangoCreateSharedContext
+
+TEST(gdPangoCreateFontRegistry)
+{
+	gdPangoContext *context, *private_context;
+	gdPangoFontRegistry *registry;
+	PangoFont *font;
+	FcChar8 *file;
+	gchar *path, *data;
+	gsize size;
+	int h1, h2, error;
+	context = gdPangoCreateContext();
+	font = pango_context_load_font(gdPangoGetPangoContext(context),
+		gdPangoGetPangoFontDescription(context));
+	gdTestAssert(FcPatternGetString(pango_fc_font_get_pattern(PANGO_FC_FONT(font)),
+		FC_FILE, 0, &file) == FcResultMatch);
+	path = g_strdup((const char *)file);
+	g_object_unref(font);
+	gdTestAssert(g_file_get_contents(path, &data, &size, NULL));
+
+	registry = gdPangoCreateFontRegistry();
+	h1 = gdPangoRegisterFontFile(registry, path, NULL);
+	h2 = gdPangoRegisterFontData(registry, data, size, NULL);
+	g_free(data);
+	/* every face of a collection has a handle */
+	gdTestAssert(h1 == 0 && h2 > h1);
+	gdTestAssert(gdPangoRegisterFontData(registry, "not a font", 10, &error) == GD_FAILURE);
+	gdTestAssert(gdPangoRegisterFontFile(registry, "/nonexistent.ttf", &error) == GD_FAILURE);
+
+	private_context = gdPangoCreateRegistryContext(registry);
+	/* kept by the context */
+	gdPangoFreeFontRegistry(registry);
+	gdTestAssert(gdPangoSetRegisteredFont(private_context, 2 * h2, 10, &error) == GD_FAILURE);
+	gdTestAssert(error == GD_PANGO_ERROR_FONT);
+	gdTestAssert(gdPangoSetRegisteredFont(private_context, h2, 10, NULL) == GD_SUCCESS);
+	gdPangoSetFontDescription(context, gdPangoGetPangoFontDescription(private_context));
+	gdPangoSetText(context, "Hello World", -1);
+	gdPangoSetText(private_context, "Hello World", -1);
+	gdTestAssert(gdPangoGetLayoutWidth(private_context) > 0);
+	gdTestAssert(gdPangoGetLayoutWidth(private_context) == gdPangoGetLayoutWidth(context));
+
+	/* each handle resolves to its own face, though both share family and style */
+	font = pango_context_load_font(gdPangoGetPangoContext(private_context),
+		gdPangoGetPangoFontDescription(private_context));
+	gdTestAssert(FcPatternGetString(pango_fc_font_get_pattern(PANGO_FC_FONT(font)),
+		FC_FILE, 0, &file) == FcResultMatch);
+#ifdef __linux__
+	/* data is kept in a memory file */
+	gdTestAssert(strncmp((const char *)file, "/proc/self/fd/", 14) == 0);
+#else
+	gdTestAssert(strcmp((const char *)file, path) != 0);
+#endif
+	g_object_unref(font);
+	gdTestAssert(gdPangoSetRegisteredFont(private_context, h1, 10, NULL) == GD_SUCCESS);
+	font = pango_context_load_font(gdPangoGetPangoContext(private_context),
+		gdPangoGetPangoFontDescription(private_context));
+	gdTestAssert(FcPatternGetString(pango_fc_font_get_pattern(PANGO_FC_FONT(font)),
+		FC_FILE, 0, &file) == FcResultMatch);
+	gdTestAssert(strcmp((const char *)file, path) == 0);
+	g_object_unref(font);
+	g_free(path);
+	gdPangoFreeContext(private_context);
+	gdPangoFreeContext(context);
+}
+
+#define test_gdPangoFreeFontRegistry test_gdPangoCreateFontRegistry
+#define test_gdPangoRegisterFontFile test_gdPangoCreateFontRegistry
+#define test_gdPangoRegisterFontData test_gdPangoCreateFontRegistry
+#define test_gdPangoCreateRegistryContext test_gdPangoCreateFontRegistry
+#define test_gdPangoSetRegisteredFont test_gdPangoCreateFontRegistry
+
+/* count the pixels drawn with full and with partial coverage */
+static void gdPangoCountCoverage(gdImagePtr im, int *full, int *partial)
+{
+	int x, y;
+	*full = *partial = 0;
+	for (y = 0; y < gdImageSY(im); y++) {
+		for (x = 0; x < gdImageSX(im); x++) {
+			int c = gdImageGetPixel(im, x, y) & 0xFFFFFF;
+			if (c == 0xFFFFFF) {
+				(*full)++;
+			} else if (c != 0) {
+				(*partial)++;
+			}
+		}
+	}
+}
+
+TEST(gdPangoSetQuality)
+{
+	gdPangoContext *context, *shared;
+	PangoFontMap *font_map;
+	PangoFont *font;
+	FcBool antialias = FcTrue;
+	gdPangoColors colors;
+	gdImagePtr im;
+	int full, partial;
+	context = gdPangoCreateContext();
+	gdTestAssert(gdPangoGetQuality(context) == GD_PANGO_QUALITY_NORMAL);
+	gdPangoSetText(context, "Quality tiers", -1);
+
+	gdPangoSetQuality(context, GD_PANGO_QUALITY_DRAFT);
+	gdTestAssert(gdPangoGetQuality(context) == GD_PANGO_QUALITY_DRAFT);
+	font = pango_context_load_font(gdPangoGetPangoContext(context),
+		gdPangoGetPangoFontDescription(context));
+	FcPatternGetBool(pango_fc_font_get_pattern(PANGO_FC_FONT(font)), FC_ANTIALIAS, 0, &antialias);
+	gdTestAssert(!antialias);
+	g_object_unref(font);
+	im = gdImageCreateTrueColor(200, 40);
+	gdPangoRenderTo(context, im, 5, 5);
+	gdPangoCountCoverage(im, &full, &partial);
+	gdTestAssert(full > 0 && partial == 0);
+	/* and so is it over a halo, black as the background */
+	gdImageFilledRectangle(im, 0, 0, 199, 39, 0);
+	gdPangoSetHalo(context, 1, 0x000000);
+	gdPangoRenderTo(context, im, 5, 5);
+	gdPangoCountCoverage(im, &full, &partial);
+	gdTestAssert(full > 0 && partial == 0);
+	gdPangoSetHalo(context, 0, 0);
+	/* a translucent color is blended, whatever the blending mode */
+	gdImageFilledRectangle(im, 0, 0, 199, 39, 0);
+	gdImageAlphaBlending(im, 0);
+	colors.fg = gdTrueColorAlpha(255, 255, 255, 64);
+	colors.bg = 0;
+	colors.alpha = 0;
+	gdPangoSetDefaultColor(context, &colors);
+	gdPangoRenderTo(context, im, 5, 5);
+	gdPangoCountCoverage(im, &full, &partial);
+	gdTestAssert(full == 0 && partial > 0);
+	gdImageDestroy(im);
+	colors.fg = 0xFFFFFF;
+	gdPangoSetDefaultColor(context, &colors);
+
+	gdPangoSetQuality(context, GD_PANGO_QUALITY_HIGH);
+	im = gdImageCreateTrueColor(200, 40);
+	gdPangoRenderTo(context, im, 5, 5);
+	gdPangoCountCoverage(im, &full, &partial);
+	gdTestAssert(partial > 0);
+	gdImageDestroy(im);
+
+	/* unknown tiers are ignored */
+	gdPangoSetQuality(context, 42);
+	gdTestAssert(gdPangoGetQuality(context) == GD_PANGO_QUALITY_HIGH);
+	gdPangoFreeContext(context);
+
+	/* shared contexts of another tier use another font map */
+	context = gdPangoCreateSharedContext();
+	shared = gdPangoCreateSharedContext();
+	font_map = gdPangoGetPangoFontMap(shared);
+	gdPangoSetQuality(context, GD_PANGO_QUALITY_DRAFT);
+	gdTestAssert(gdPangoGetPangoFontMap(context) != font_map);
+	gdPangoSetQuality(context, GD_PANGO_QUALITY_NORMAL);
+	gdTestAssert(gdPangoGetPangoFontMap(context) == font_map);
+	gdPangoFreeContext(context);
+	gdPangoFreeContext(shared);
+}
+
+#define test_gdPangoGetQuality test_gdPangoSetQuality
+
+TEST(gdPangoEnableStats)
+{
+	gdPangoContext *context;
+	gdPangoStats stats, global;
+	gdImagePtr im;
+	context = gdPangoCreateContext();
+	gdPangoSetText(context, "Counted\nlines", -1);
+	im = gdImageCreateTrueColor(200, 80);
+
+	/* disabled by default */
+	gdPangoRenderTo(context, im, 5, 5);
+	gdPangoGetStats(context, &stats);
+	gdTestAssert(stats.lines == 0 && stats.glyphs == 0 && stats.pixels == 0);
+
+	gdPangoEnableStats(context, 1);
+	gdPangoRenderTo(context, im, 5, 5);
+	gdPangoGetStats(context, &stats);
+	gdTestAssert(stats.lines == 2 && stats.runs >= 2);
+	gdTestAssert(stats.glyphs >= 12 && stats.pixels > 0 && stats.memset_bytes > 0);
+	gdTestAssert(stats.cache_hits == 0 && stats.cache_misses == 0);
+	gdPangoGetGlobalStats(&global);
+	gdTestAssert(global.lines >= stats.lines && global.pixels >= stats.pixels);
+
+	/* the global counts outlive the context ones */
+	gdPangoResetStats(context);
+	gdPangoGetStats(context, &stats);
+	gdTestAssert(stats.lines == 0 && stats.glyphs == 0 && stats.layout_time == 0);
+	gdPangoGetGlobalStats(&stats);
+	gdTestAssert(stats.lines >= global.lines);
+
+	gdPangoRenderTo(context, im, 5, 5);
+	gdPangoEnableStats(context, 0);
+	gdPangoGetStats(context, &stats);
+	gdTestAssert(stats.lines == 0);
+	gdPangoResetGlobalStats();
+	gdPangoGetGlobalStats(&global);
+	gdTestAssert(global.lines == 0 && global.pixels == 0);
+
+	/* tiles reach the global counts without reading the context ones */
+	gdPangoEnableStats(context, 1);
+	gdTestAssert(gdPangoRenderTiles(context, &im, 1, 1, 200, 80, 5, 5, NULL) == GD_SUCCESS);
+	gdPangoGetGlobalStats(&global);
+	gdTestAssert(global.lines == 2 && global.pixels > 0);
+	gdPangoEnableStats(context, 0);
+	gdImageDestroy(im);
+	gdPangoFreeContext(context);
+}
+
+#define test_gdPangoGetStats test_gdPangoEnableStats
+#define test_gdPangoResetStats test_gdPangoEnableStats
+#define test_gdPangoGetGlobalStats test_gdPangoEnableStats
+#define test_gdPangoResetGlobalStats test_gdPangoEnableStats
+
 static int gdBBoxEqual(gdBBox *bbox1, gdBBox *bbox2)
 {
 	return (bbox1->bottom_left.x == bbox2->bottom_left.x &&
@@ -259,6 +1411,7 @@ int main(int argc, char *argv[])
 	DO_TEST(gdPangoFreeContext);
 	DO_TEST(gdPangoRenderTo);
 	DO_TEST(gdPangoCreateSurfaceDraw);
+	DO_TEST(gdPangoCreateSurfaceDrawInk);
 	DO_TEST(gdPangoSetMinimumSize);
 	DO_TEST(gdPangoSetDefaultColor);
 	DO_TEST(gdPangoGetLayoutWidth);
@@ -272,6 +1425,68 @@ int main(int argc, char *argv[])
 	DO_TEST(gdPangoGetPangoFontDescription);
 	DO_TEST(gdPangoGetPangoContext);
 	DO_TEST(gdPangoGetPangoLayout);
+	DO_TEST(gdPangoRenderToWithDamage);
+	DO_TEST(gdPangoRenderTiles);
+	DO_TEST(gdPangoRenderBands);
+	DO_TEST(gdPangoCreateDocument);
+	DO_TEST(gdPangoFreeDocument);
+	DO_TEST(gdPangoDocumentGetHeight);
+	DO_TEST(gdPangoDocumentGetPageCount);
+	DO_TEST(gdPangoDocumentRenderPage);
+	DO_TEST(gdPangoDocumentRenderRange);
+	DO_TEST(gdPangoDocumentSetText);
+	DO_TEST(gdPangoDocumentRepaint);
+	DO_TEST(gdPangoCreateTemplate);
+	DO_TEST(gdPangoFreeTemplate);
+	DO_TEST(gdPangoTemplateGetField);
+	DO_TEST(gdPangoSetTemplate);
+	DO_TEST(gdPangoCompileMarkup);
+	DO_TEST(gdPangoFreeMarkup);
+	DO_TEST(gdPangoSetCompiledMarkup);
+	DO_TEST(gdPangoBeginUpdate);
+	DO_TEST(gdPangoCommitUpdate);
+	DO_TEST(gdPangoSetWidth);
+	DO_TEST(gdPangoSetAlignment);
+	DO_TEST(gdPangoSetFontDescription);
+	DO_TEST(gdPangoSimpleText);
+	DO_TEST(gdPangoGetMetrics);
+	DO_TEST(gdPangoMetricsNeedsShaping);
+	DO_TEST(gdPangoMetricsGetWidth);
+	DO_TEST(gdPangoMetricsGetLine);
+	DO_TEST(gdPangoFitToBox);
+	DO_TEST(gdPangoRenderScales);
+	DO_TEST(gdPangoBuildAtlas);
+	DO_TEST(gdPangoBuildAtlasSDF);
+	DO_TEST(gdPangoBuildAtlasRange);
+	DO_TEST(gdPangoFreeAtlas);
+	DO_TEST(gdPangoAtlasFind);
+	DO_TEST(gdPangoAtlasWriteTable);
+	DO_TEST(gdPangoGetLayoutGlyphs);
+	DO_TEST(gdPangoWriteGlyphCache);
+	DO_TEST(gdPangoOpenGlyphCache);
+	DO_TEST(gdPangoFreeGlyphCache);
+	DO_TEST(gdPangoSetGlyphCache);
+	DO_TEST(gdPangoPackLabels);
+	DO_TEST(gdPangoSetHalo);
+	DO_TEST(gdPangoSetShadow);
+	DO_TEST(gdPangoWarmup);
+	DO_TEST(gdPangoWarmupStart);
+	DO_TEST(gdPangoWarmupJoin);
+	DO_TEST(gdPangoCreateSharedContext);
+	DO_TEST(gdPangoReleaseSharedMaps);
+	DO_TEST(gdPangoCreateFontRegistry);
+	DO_TEST(gdPangoFreeFontRegistry);
+	DO_TEST(gdPangoRegisterFontFile);
+	DO_TEST(gdPangoRegisterFontData);
+	DO_TEST(gdPangoCreateRegistryContext);
+	DO_TEST(gdPangoSetRegisteredFont);
+	DO_TEST(gdPangoSetQuality);
+	DO_TEST(gdPangoGetQuality);
+	DO_TEST(gdPangoEnableStats);
+	DO_TEST(gdPangoGetStats);
+	DO_TEST(gdPangoResetStats);
+	DO_TEST(gdPangoGetGlobalStats);
+	DO_TEST(gdPangoResetGlobalStats);
 	DO_TEST(gdImageStringPangoFT);
 	return 0;
 }